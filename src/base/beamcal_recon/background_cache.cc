@@ -0,0 +1,662 @@
+#undef _GLIBCXX_USE_CXX11_ABI
+#define _GLIBCXX_USE_CXX11_ABI 0
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simple_list_geometry.h"
+#include "background_cache.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+/*
+ * Generating the background database (reading every bgd slcio file,
+ * pixelating it, and calibrating the scanner on it) is by far the
+ * slowest part of the reconstruction. Since it comes out identical
+ * every time it is run on the same inputs, we can save the result to
+ * disk and just memory-map it back in on the next job.
+ *
+ * The cache file is a cache_header followed by one section per array
+ * of the background_database (its pixel columns included), plus the
+ * pixel_moments of the pixel_statistics, each written out as it is in
+ * memory. The header gives where each section starts and how long it
+ * is; the arrays of the form of the database that is not stored
+ * (compressed or not) are left empty. Every section starts on a page
+ * boundary, so a database too big for memory can be used straight out
+ * of the mapped file (see map_database), with each pixel column lying
+ * in one contiguous run of pages for the scans to stream through.
+ *
+ * The raw moments are stored (rather than the averages and deviations)
+ * so that caches built from separate background samples can still be
+ * merged. The header also holds the sigma cut, the quantile sketch
+ * it is kept up to date with as background events are appended, and
+ * how many of the background hits each pixelation cut threw out. The
+ * header carries a key which fingerprints every input the
+ * database depends on. If the key (or the format version) does not
+ * match, the cache is considered stale and the database is regenerated.
+ */
+
+        static const char _cache_magic[8] = {'B','C','A','L','D','B','\0','\0'};
+        static const unsigned int _cache_version = 9;
+
+        static const long long _section_alignment = 4096;
+
+        //how much of the pixel columns background_cache_stream fills in
+        //at a time (see background_cache_stream::finish)
+        static const long long _column_block_bytes = 256LL << 20;
+
+        //the sections, in the order they are laid out in the file
+        enum cache_section_id {
+            INDICES_SECTION,
+            ENERGIES_SECTION,
+            OFFSETS_SECTION,
+            GAP_OFFSETS_SECTION,
+            INDEX_GAPS_SECTION,
+            QUANTIZED_ENERGIES_SECTION,
+            ENERGY_SCALES_SECTION,
+            ENERGY_ZERO_CODES_SECTION,
+            COLUMN_START_SECTION,
+            MOMENTS_SECTION,
+            COLUMNS_SECTION,
+            COLUMN_OFFSETS_SECTION,
+            COLUMN_EVENTS_SECTION,
+            COLUMN_CODES_SECTION,
+            SECTION_COUNT
+        };
+
+        struct cache_section {
+            long long start;
+            long long bytes;
+        };
+
+        struct cache_header {
+            char magic[8];
+            unsigned int version;
+            float sigma_cut;
+            unsigned long long key;
+            long long event_count;
+            long long entry_count;
+            long long pixel_count;
+            long long stats_event_count;
+            unsigned int compressed;
+            float max_quantization_error;
+            long long column_stride;
+            quantile_sketch sketch;
+            hit_cut_counts cuts;
+            cache_section sections[SECTION_COUNT];
+        };
+
+
+
+        static long long align_section(long long position) {
+            return (position + _section_alignment - 1) / _section_alignment * _section_alignment;
+        }
+
+
+
+        /*
+         * Place the sections one after another (the section sizes must
+         * already be filled in), and return the size of the whole file.
+         */
+        static long long lay_out_sections(cache_header* header) {
+            long long position = align_section( sizeof(cache_header) );
+            for (int section = 0; section < SECTION_COUNT; section++) {
+                position = align_section(position);
+                header->sections[section].start = position;
+                position += header->sections[section].bytes;
+            }
+            return position;
+        }
+
+
+
+        static void start_header(cache_header* header, unsigned long long key, long long pixel_count) {
+            //cleared bytewise, padding included, so the file is the same every time
+            memset((void*)header, 0, sizeof(cache_header));
+            memcpy(header->magic, _cache_magic, sizeof(_cache_magic));
+            header->version = _cache_version;
+            header->key = key;
+            header->pixel_count = pixel_count;
+        }
+
+
+
+        bool write_bytes(int fd, const void* data, long long bytes, long long position) {
+            const char* next = (const char*) data;
+            while ( bytes > 0 ) {
+                ssize_t written = pwrite(fd, next, bytes, position);
+                if ( written <= 0 ) return false;
+                next += written;
+                bytes -= written;
+                position += written;
+            }
+            return true;
+        }
+
+
+
+        unsigned long long hash_bytes(unsigned long long hash, const void* data, size_t size) {
+            const unsigned char* bytes = (const unsigned char*) data;
+            for (size_t i = 0; i < size; i++) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+            }
+            return hash;
+        }
+
+
+
+        /*
+         * Fingerprint the background sample and the geometry it was
+         * pixelated on. The slcio file names are taken from the file list,
+         * and each file's size and modification time are folded in too, so
+         * a regenerated background file also invalidates the cache.
+         */
+        unsigned long long hash_background_inputs(string bgd_list_file_name, int bgd_events_to_be_read) {
+            unsigned long long hash = 14695981039346656037ULL;
+            hash = hash_value(hash, _cache_version);
+            hash = hash_value(hash, bgd_events_to_be_read);
+
+            ifstream filelist (bgd_list_file_name, ifstream::in);
+            string slcioFile;
+            while ( filelist >> slcioFile ) {
+                hash = hash_bytes(hash, slcioFile.c_str(), slcioFile.size()+1);
+
+                struct stat file_status;
+                if ( stat(slcioFile.c_str(), &file_status) == 0 ) {
+                    long long file_size = file_status.st_size;
+                    long long file_time = file_status.st_mtime;
+                    hash = hash_value(hash, file_size);
+                    hash = hash_value(hash, file_time);
+                }
+            }
+            filelist.close();
+
+            int last_ring = _LastRing;
+            float sector_offset = get_sector_offset();
+            hash = hash_value(hash, last_ring);
+            hash = hash_value(hash, _IDlimit);
+            hash = hash_value(hash, sector_offset);
+            for (int ring = 0; ring <= last_ring; ring++) {
+                float radius = get_ring_radius(ring);
+                int sectors = get_sector_count(ring);
+                hash = hash_value(hash, radius);
+                hash = hash_value(hash, sectors);
+            }
+
+            return hash;
+        }
+
+
+
+        /*
+         * Check that every section lies within the file and has
+         * the size the header's counts call for.
+         */
+        static bool check_sections(const cache_header& header, const char* base, long long file_size) {
+            long long expected[SECTION_COUNT] = {0};
+            long long index_count = header.compressed ? 0 : header.entry_count;
+            expected[INDICES_SECTION] = index_count*sizeof(int);
+            expected[ENERGIES_SECTION] = index_count*sizeof(float);
+            expected[OFFSETS_SECTION] = (header.event_count+1)*sizeof(long long);
+            if ( header.compressed ) {
+                expected[GAP_OFFSETS_SECTION] = (header.event_count+1)*sizeof(long long);
+                expected[INDEX_GAPS_SECTION] = header.sections[INDEX_GAPS_SECTION].bytes;
+                expected[QUANTIZED_ENERGIES_SECTION] = header.entry_count*sizeof(unsigned short);
+                expected[ENERGY_SCALES_SECTION] = header.pixel_count*sizeof(float);
+                expected[ENERGY_ZERO_CODES_SECTION] = header.pixel_count*sizeof(unsigned short);
+                expected[COLUMN_OFFSETS_SECTION] = (header.pixel_count+1)*sizeof(long long);
+                expected[COLUMN_EVENTS_SECTION] = header.entry_count*sizeof(int);
+                expected[COLUMN_CODES_SECTION] = header.entry_count*sizeof(unsigned short);
+            } else {
+                expected[COLUMN_START_SECTION] = header.pixel_count*sizeof(long long);
+            }
+            expected[MOMENTS_SECTION] = header.pixel_count*sizeof(pixel_moments);
+
+            for (int section = 0; section < SECTION_COUNT; section++) {
+                const cache_section& part = header.sections[section];
+                if ( part.start < (long long)sizeof(cache_header) || part.start % _section_alignment != 0 ) return false;
+                if ( part.bytes < 0 || part.start + part.bytes > file_size ) return false;
+                if ( section != COLUMNS_SECTION && part.bytes != expected[section] ) return false;
+            }
+
+            const long long* offsets = (const long long*) (base + header.sections[OFFSETS_SECTION].start);
+            if ( offsets[0] != 0 || offsets[header.event_count] != header.entry_count ) return false;
+            if ( header.compressed ) {
+                const long long* gap_offsets = (const long long*) (base + header.sections[GAP_OFFSETS_SECTION].start);
+                long long gap_bytes = header.sections[INDEX_GAPS_SECTION].bytes;
+                if ( gap_offsets[0] != 0 || gap_offsets[header.event_count] != gap_bytes ) return false;
+            }
+
+            //every hit is in one sparse column
+            if ( header.compressed ) {
+                if ( header.sections[COLUMNS_SECTION].bytes != 0 ) return false;
+                const long long* column_offsets = (const long long*) (base + header.sections[COLUMN_OFFSETS_SECTION].start);
+                if ( column_offsets[0] != 0 || column_offsets[header.pixel_count] != header.entry_count ) return false;
+                for (long long index = 0; index < header.pixel_count; index++) {
+                    if ( column_offsets[index+1] < column_offsets[index] ) return false;
+                }
+                return true;
+            }
+
+            //every hit pixel has a full column
+            const long long* column_start = (const long long*) (base + header.sections[COLUMN_START_SECTION].start);
+            long long column_count = 0;
+            for (long long index = 0; index < header.pixel_count; index++) {
+                if ( column_start[index] >= 0 ) column_count++;
+            }
+            if ( header.column_stride < header.event_count ) return false;
+            long long cells = column_count * header.column_stride;
+            if ( header.sections[COLUMNS_SECTION].bytes != cells*(long long)sizeof(float) ) return false;
+            for (long long index = 0; index < header.pixel_count; index++) {
+                if ( column_start[index] < 0 ) continue;
+                if ( column_start[index] >= cells || column_start[index] % header.column_stride != 0 ) return false;
+            }
+            return true;
+        }
+
+
+
+        template <typename T>
+        static void load_section(database_array<T>* array, const char* base, const cache_section& section, bool map_in_place) {
+            const T* data = (const T*) (base + section.start);
+            long long size = section.bytes / sizeof(T);
+            if (map_in_place) array->map(data, size);
+            else array->values.assign(data, data + size);
+        }
+
+
+
+        /*
+         * Memory-map the cache file, and if it was generated from the
+         * same inputs (same key), load the database, statistics, sigma
+         * cut, quantile sketch and hit cut counts out of it. Returns false if the cache could not be
+         * used, in which case nothing has been loaded.
+         *
+         * With map_database, the database is not copied out of the file,
+         * but left mapped and read straight from it (see
+         * background_database::is_mapped). The file is mapped shared, so
+         * every job on the node mapping the same cache reads the same
+         * pages of the page cache.
+         */
+        bool read_background_cache(string cache_file_name, unsigned long long key,
+                                    background_database* database,
+                                    pixel_statistics* stats,
+                                    float& sigma_cut, quantile_sketch* sketch,
+                                    hit_cut_counts* cuts, bool map_database) {
+
+            int fd = open(cache_file_name.c_str(), O_RDONLY);
+            if (fd < 0) {
+                cout << "No background cache found at " << cache_file_name << endl;
+                return false;
+            }
+
+            struct stat file_status;
+            if ( fstat(fd, &file_status) != 0 || (size_t)file_status.st_size < sizeof(cache_header) ) {
+                cout << "Background cache " << cache_file_name << " is truncated, ignoring it\n";
+                close(fd);
+                return false;
+            }
+            size_t file_size = file_status.st_size;
+
+            void* mapping = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                cout << "Unable to map background cache " << cache_file_name << endl;
+                return false;
+            }
+            const char* base = (const char*) mapping;
+
+            cache_header header;
+            memcpy(&header, base, sizeof(cache_header));
+
+            bool valid = true;
+            if ( memcmp(header.magic, _cache_magic, sizeof(_cache_magic)) != 0 ) valid = false;
+            else if ( header.version != _cache_version ) valid = false;
+            else if ( header.key != key ) valid = false;
+            else if ( header.event_count < 0 || header.entry_count < 0 ) valid = false;
+            else if ( header.pixel_count != get_pixel_count() ) valid = false;
+            else if ( not check_sections(header, base, file_size) ) valid = false;
+
+            if (not valid) {
+                cout << "Background cache " << cache_file_name << " is stale, regenerating it\n";
+                munmap(mapping, file_size);
+                return false;
+            }
+
+            const cache_section* sections = header.sections;
+            load_section( &database->offsets, base, sections[OFFSETS_SECTION], map_database );
+            load_section( &database->indices, base, sections[INDICES_SECTION], map_database );
+            load_section( &database->energies, base, sections[ENERGIES_SECTION], map_database );
+            load_section( &database->gap_offsets, base, sections[GAP_OFFSETS_SECTION], map_database );
+            load_section( &database->index_gaps, base, sections[INDEX_GAPS_SECTION], map_database );
+            load_section( &database->quantized_energies, base, sections[QUANTIZED_ENERGIES_SECTION], map_database );
+            load_section( &database->energy_scales, base, sections[ENERGY_SCALES_SECTION], map_database );
+            load_section( &database->energy_zero_codes, base, sections[ENERGY_ZERO_CODES_SECTION], map_database );
+            load_section( &database->column_start, base, sections[COLUMN_START_SECTION], map_database );
+            load_section( &database->columns, base, sections[COLUMNS_SECTION], map_database );
+            load_section( &database->column_offsets, base, sections[COLUMN_OFFSETS_SECTION], map_database );
+            load_section( &database->column_events, base, sections[COLUMN_EVENTS_SECTION], map_database );
+            load_section( &database->column_codes, base, sections[COLUMN_CODES_SECTION], map_database );
+            database->compressed = header.compressed;
+            database->max_quantization_error = header.max_quantization_error;
+            database->column_stride = header.column_stride;
+
+            const pixel_moments* moments = (const pixel_moments*) (base + sections[MOMENTS_SECTION].start);
+            stats->moments.assign( moments, moments + header.pixel_count );
+            stats->event_count = header.stats_event_count;
+            sigma_cut = header.sigma_cut;
+            *sketch = header.sketch;
+            *cuts = header.cuts;
+
+            if (map_database) {
+                database->mapping = shared_ptr<const void>( mapping,
+                                            [file_size](const void* data) { munmap((void*)data, file_size); } );
+            } else {
+                munmap(mapping, file_size);
+            }
+            return true;
+        }
+
+
+
+        /*
+         * Dump the database (with its columns built), statistics, sigma cut,
+         * quantile sketch and hit cut counts to the cache file. The file is written under a temporary name
+         * and then renamed, so concurrent jobs sharing a cache never see a
+         * half-written file.
+         */
+        bool write_background_cache(string cache_file_name, unsigned long long key,
+                                    background_database* database,
+                                    pixel_statistics* stats,
+                                    float sigma_cut, const quantile_sketch& sketch,
+                                    const hit_cut_counts& cuts) {
+
+            cache_header header;
+            start_header(&header, key, stats->moments.size());
+            header.sigma_cut = sigma_cut;
+            header.sketch = sketch;
+            header.cuts = cuts;
+            header.column_stride = database->column_stride;
+            header.event_count = database->size();
+            header.entry_count = database->offsets.back();
+            header.stats_event_count = stats->event_count;
+            header.compressed = database->compressed;
+            header.max_quantization_error = database->max_quantization_error;
+
+            const void* data[SECTION_COUNT];
+            cache_section* sections = header.sections;
+            data[INDICES_SECTION] = database->indices.data();
+            sections[INDICES_SECTION].bytes = database->indices.size()*sizeof(int);
+            data[ENERGIES_SECTION] = database->energies.data();
+            sections[ENERGIES_SECTION].bytes = database->energies.size()*sizeof(float);
+            data[OFFSETS_SECTION] = database->offsets.data();
+            sections[OFFSETS_SECTION].bytes = database->offsets.size()*sizeof(long long);
+            data[GAP_OFFSETS_SECTION] = database->gap_offsets.data();
+            sections[GAP_OFFSETS_SECTION].bytes = database->gap_offsets.size()*sizeof(long long);
+            data[INDEX_GAPS_SECTION] = database->index_gaps.data();
+            sections[INDEX_GAPS_SECTION].bytes = database->index_gaps.size();
+            data[QUANTIZED_ENERGIES_SECTION] = database->quantized_energies.data();
+            sections[QUANTIZED_ENERGIES_SECTION].bytes = database->quantized_energies.size()*sizeof(unsigned short);
+            data[ENERGY_SCALES_SECTION] = database->energy_scales.data();
+            sections[ENERGY_SCALES_SECTION].bytes = database->energy_scales.size()*sizeof(float);
+            data[ENERGY_ZERO_CODES_SECTION] = database->energy_zero_codes.data();
+            sections[ENERGY_ZERO_CODES_SECTION].bytes = database->energy_zero_codes.size()*sizeof(unsigned short);
+            data[COLUMN_START_SECTION] = database->column_start.data();
+            sections[COLUMN_START_SECTION].bytes = database->column_start.size()*sizeof(long long);
+            data[MOMENTS_SECTION] = stats->moments.data();
+            sections[MOMENTS_SECTION].bytes = stats->moments.size()*sizeof(pixel_moments);
+            data[COLUMNS_SECTION] = database->columns.data();
+            sections[COLUMNS_SECTION].bytes = database->columns.size()*sizeof(float);
+            data[COLUMN_OFFSETS_SECTION] = database->column_offsets.data();
+            sections[COLUMN_OFFSETS_SECTION].bytes = database->column_offsets.size()*sizeof(long long);
+            data[COLUMN_EVENTS_SECTION] = database->column_events.data();
+            sections[COLUMN_EVENTS_SECTION].bytes = database->column_events.size()*sizeof(int);
+            data[COLUMN_CODES_SECTION] = database->column_codes.data();
+            sections[COLUMN_CODES_SECTION].bytes = database->column_codes.size()*sizeof(unsigned short);
+            long long file_size = lay_out_sections(&header);
+
+            string temp_file_name = cache_file_name + ".tmp." + to_string( getpid() );
+            int fd = open(temp_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                cout << "Unable to write background cache " << cache_file_name << endl;
+                return false;
+            }
+
+            bool written = ftruncate(fd, file_size) == 0;
+            written = written && write_bytes(fd, &header, sizeof(cache_header), 0);
+            for (int section = 0; section < SECTION_COUNT; section++) {
+                written = written && write_bytes(fd, data[section], sections[section].bytes, sections[section].start);
+            }
+            written = ( close(fd) == 0 ) && written;
+
+            if ( not written || rename(temp_file_name.c_str(), cache_file_name.c_str()) != 0 ) {
+                cout << "Unable to write background cache " << cache_file_name << endl;
+                remove(temp_file_name.c_str());
+                return false;
+            }
+
+            cout << "Background cache written to " << cache_file_name << endl;
+            return true;
+        }
+
+
+
+        background_cache_stream::background_cache_stream() :
+            key(0), pixel_count(0), fd(-1), energy_fd(-1), failed(false) {}
+
+
+
+        background_cache_stream::~background_cache_stream() {
+            if ( energy_fd >= 0 ) close(energy_fd);
+            if ( fd >= 0 ) {
+                close(fd);
+                remove( temp_file_name.c_str() );
+            }
+        }
+
+
+
+        /*
+         * Start writing the cache file (under a temporary name, like
+         * write_background_cache). The pixel energies go to a second,
+         * already unlinked, file until the pixel indices are complete.
+         */
+        bool background_cache_stream::open(string bgd_cache_file_name, unsigned long long cache_key, int pixels) {
+            cache_file_name = bgd_cache_file_name;
+            temp_file_name = cache_file_name + ".tmp." + to_string( getpid() );
+            key = cache_key;
+            pixel_count = pixels;
+            offsets.assign(1, 0);
+            hit.assign(pixel_count, 0);
+            failed = false;
+
+            fd = ::open(temp_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            string energy_file_name = temp_file_name + ".energies";
+            energy_fd = ::open(energy_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+            remove( energy_file_name.c_str() );
+            if ( fd < 0 || energy_fd < 0 ) {
+                cout << "Unable to write background cache " << cache_file_name << endl;
+                failed = true;
+                return false;
+            }
+            return true;
+        }
+
+
+
+        /*
+         * Write out every event of an (uncompressed) database
+         * after the events written so far.
+         */
+        void background_cache_stream::append(const background_database& events) {
+            if (failed) return;
+
+            long long base = offsets.back();
+            long long first_index = align_section( sizeof(cache_header) ) + base*sizeof(int);
+            long long first_energy = base*sizeof(float);
+            long long count = events.offsets.back();
+            failed = not write_bytes(fd, events.indices.data(), count*sizeof(int), first_index)
+                        or not write_bytes(energy_fd, events.energies.data(), count*sizeof(float), first_energy);
+
+            for (long long i = 0; i < count; i++) hit[ events.indices[i] ] = 1;
+            for (int event = 1; event <= events.size(); event++) {
+                offsets.push_back( base + events.offsets[event] );
+            }
+        }
+
+
+
+        /*
+         * Write out everything but the sigma cut: the rest of the database,
+         * its pixel columns, and the statistics. The file is then mapped,
+         * and database (which must be empty) is pointed into it.
+         *
+         * The columns are filled straight into the mapping, a block of
+         * pixels at a time, with every event read over once per block;
+         * only the current block of columns has to be resident.
+         */
+        bool background_cache_stream::finish(const pixel_statistics& stats, background_database* database) {
+            if (failed) return false;
+
+            long long event_count = offsets.size() - 1;
+            long long entry_count = offsets.back();
+            vector<long long> column_start(pixel_count, -1);
+            long long column_count = 0;
+            for (int index = 0; index < pixel_count; index++) {
+                if ( hit[index] ) column_start[index] = event_count * column_count++;
+            }
+
+            cache_header header;
+            start_header(&header, key, pixel_count);
+            memset(header.magic, 0, sizeof(header.magic)); //set by commit()
+            header.event_count = event_count;
+            header.entry_count = entry_count;
+            header.stats_event_count = stats.event_count;
+            header.column_stride = event_count;
+            cache_section* sections = header.sections;
+            sections[INDICES_SECTION].bytes = entry_count*sizeof(int);
+            sections[ENERGIES_SECTION].bytes = entry_count*sizeof(float);
+            sections[OFFSETS_SECTION].bytes = offsets.size()*sizeof(long long);
+            sections[COLUMN_START_SECTION].bytes = pixel_count*sizeof(long long);
+            sections[MOMENTS_SECTION].bytes = pixel_count*sizeof(pixel_moments);
+            sections[COLUMNS_SECTION].bytes = column_count*event_count*sizeof(float);
+            long long file_size = lay_out_sections(&header);
+
+            //move the energies over from their own file
+            vector<char> buffer(1 << 20);
+            for (long long copied = 0; copied < sections[ENERGIES_SECTION].bytes && not failed; ) {
+                ssize_t bytes = pread(energy_fd, buffer.data(), buffer.size(), copied);
+                if ( bytes <= 0 ) failed = true;
+                else failed = not write_bytes(fd, buffer.data(), bytes, sections[ENERGIES_SECTION].start + copied);
+                copied += bytes;
+            }
+            close(energy_fd);
+            energy_fd = -1;
+
+            //the columns are left as a hole in the file, which reads
+            //back as zeros; only the hits are written into it
+            failed = failed or ftruncate(fd, file_size) != 0
+                        or not write_bytes(fd, offsets.data(), sections[OFFSETS_SECTION].bytes, sections[OFFSETS_SECTION].start)
+                        or not write_bytes(fd, column_start.data(), sections[COLUMN_START_SECTION].bytes,
+                                            sections[COLUMN_START_SECTION].start)
+                        or not write_bytes(fd, stats.moments.data(), sections[MOMENTS_SECTION].bytes, sections[MOMENTS_SECTION].start)
+                        or not write_bytes(fd, &header, sizeof(cache_header), 0);
+            void* mapping = failed ? MAP_FAILED : mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if ( mapping == MAP_FAILED ) {
+                cout << "Unable to write background cache " << cache_file_name << endl;
+                failed = true;
+                return false;
+            }
+            char* base = (char*) mapping;
+            vector<long long>().swap(offsets);
+
+            const long long* event_offsets = (const long long*) (base + sections[OFFSETS_SECTION].start);
+            const int* indices = (const int*) (base + sections[INDICES_SECTION].start);
+            const float* energies = (const float*) (base + sections[ENERGIES_SECTION].start);
+            float* columns = (float*) (base + sections[COLUMNS_SECTION].start);
+
+            long long block_cells = max( _column_block_bytes / (long long)sizeof(float), event_count );
+            for (int first = 0; first < pixel_count; ) {
+                //the pixels [first,last) have at most block_cells of columns
+                int last = first;
+                long long first_cell = -1, cells = 0;
+                for ( ; last < pixel_count; last++) {
+                    if ( column_start[last] < 0 ) continue;
+                    if ( cells + event_count > block_cells ) break;
+                    if ( first_cell < 0 ) first_cell = column_start[last];
+                    cells += event_count;
+                }
+
+                for (long long event = 0; event < event_count; event++) {
+                    const int* event_end = indices + event_offsets[event+1];
+                    const int* hit_index = lower_bound(indices + event_offsets[event], event_end, first);
+                    for ( ; hit_index != event_end && *hit_index < last; hit_index++) {
+                        columns[ column_start[*hit_index] + event ] = energies[ hit_index - indices ];
+                    }
+                }
+
+                //start writing the finished block back
+                if ( first_cell >= 0 ) {
+                    long long block_start = sections[COLUMNS_SECTION].start + first_cell*(long long)sizeof(float);
+                    long long page_start = block_start / _section_alignment * _section_alignment;
+                    msync(base + page_start, block_start - page_start + cells*sizeof(float), MS_ASYNC);
+                }
+                first = last;
+            }
+            mprotect(mapping, file_size, PROT_READ);
+
+            database->offsets.map(event_offsets, event_count+1);
+            database->indices.map(indices, entry_count);
+            database->energies.map(energies, entry_count);
+            database->column_start.map( (const long long*) (base + sections[COLUMN_START_SECTION].start), pixel_count );
+            database->columns.map(columns, column_count*event_count);
+            database->compressed = false;
+            database->column_stride = event_count;
+            database->mapping = shared_ptr<const void>( mapping,
+                                            [file_size](const void* data) { munmap((void*)data, file_size); } );
+            return true;
+        }
+
+
+
+        /*
+         * Fill in the sigma cut, quantile sketch and hit cut counts, and
+         * put the finished file in place under its real name.
+         */
+        bool background_cache_stream::commit(float sigma_cut, const quantile_sketch& sketch,
+                                                const hit_cut_counts& cuts) {
+            if (failed) return false;
+
+            cache_header header;
+            bool written = pread(fd, &header, sizeof(cache_header), 0) == sizeof(cache_header);
+            memcpy(header.magic, _cache_magic, sizeof(_cache_magic));
+            header.sigma_cut = sigma_cut;
+            header.sketch = sketch;
+            header.cuts = cuts;
+            written = written && write_bytes(fd, &header, sizeof(cache_header), 0);
+            written = ( close(fd) == 0 ) && written;
+            fd = -1;
+
+            if ( not written || rename(temp_file_name.c_str(), cache_file_name.c_str()) != 0 ) {
+                cout << "Unable to write background cache " << cache_file_name << endl;
+                remove(temp_file_name.c_str());
+                return false;
+            }
+
+            cout << "Background cache written to " << cache_file_name << endl;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef BACKGROUND_CACHE_H
+#define BACKGROUND_CACHE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "background_database.h"
+#include "cell_id_decoder.h"
+#include "pixel_statistics.h"
+#include "quantile_sketch.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        //64 bit FNV-1a, used to fingerprint everything the cached
+        //background database was derived from.
+        unsigned long long hash_bytes(unsigned long long hash, const void* data, size_t size);
+
+        template<typename T>
+        unsigned long long hash_value(unsigned long long hash, const T& value) {
+            return hash_bytes(hash, &value, sizeof(T));
+        }
+
+        //pwrite all of the bytes, however many calls it takes
+        bool write_bytes(int fd, const void* data, long long bytes, long long position);
+
+        unsigned long long hash_background_inputs(std::string bgd_list_file_name, int bgd_events_to_be_read);
+
+        bool read_background_cache(std::string cache_file_name, unsigned long long key,
+                                    background_database* database,
+                                    pixel_statistics* stats,
+                                    float& sigma_cut, quantile_sketch* sketch,
+                                    hit_cut_counts* cuts, bool map_database = false);
+
+        bool write_background_cache(std::string cache_file_name, unsigned long long key,
+                                    background_database* database,
+                                    pixel_statistics* stats,
+                                    float sigma_cut, const quantile_sketch& sketch,
+                                    const hit_cut_counts& cuts);
+
+
+
+        /*
+         * Writes a background database into a cache file while it is
+         * being generated, for databases too large to hold in memory.
+         * The events are appended as they are read, finish() then lays
+         * out the rest of the file and maps the database back out of it
+         * for the calibration, and commit() adds the sigma cut (and the
+         * hit cut counts) and puts
+         * the file in place. Only uncompressed databases are written
+         * this way. If the stream is dropped before commit(), the
+         * partial file is removed.
+         */
+        struct background_cache_stream {
+            std::string cache_file_name;
+            std::string temp_file_name;
+            unsigned long long key;
+            int pixel_count;
+
+            int fd;             //the cache file, under its temporary name
+            int energy_fd;      //the pixel energies, until the indices are all written
+            bool failed;
+
+            //the event offsets so far, and which pixels have been hit
+            std::vector<long long> offsets;
+            std::vector<char> hit;
+
+            background_cache_stream();
+            ~background_cache_stream();
+
+            bool open(std::string bgd_cache_file_name, unsigned long long cache_key, int pixels);
+            void append(const background_database& events);
+            bool finish(const pixel_statistics& stats, background_database* database);
+            bool commit(float sigma_cut, const quantile_sketch& sketch, const hit_cut_counts& cuts);
+        };
+    }
+}
+#endif
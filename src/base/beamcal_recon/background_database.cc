@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "background_database.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        //the largest quantized energy
+        static const float _quantized_max = 65535.0;
+
+
+
+        /*
+         * Append a (dense) pixelated event to the end of the
+         * database, keeping only the pixels which were hit
+         * (with at least zero_threshold energy).
+         */
+        void background_database::add_event(const pixel_map& pixels, float zero_threshold) {
+            int pixel_count = pixels.size();
+            for (int index = 0; index < pixel_count; index++) {
+                if ( pixels[index] == 0.0 ) continue;
+                if ( fabs(pixels[index]) < zero_threshold ) continue;
+                indices.values.push_back(index);
+                energies.values.push_back(pixels[index]);
+            }
+            offsets.values.push_back( indices.size() );
+            if ( not column_start.empty() ) extend_columns( size()-1 );
+        }
+
+
+
+        /*
+         * Append every event of another database, in order.
+         * Neither database may be compressed.
+         */
+        void background_database::append(const background_database& other) {
+            int first_event = size();
+            long long base = indices.size();
+            indices.values.insert( indices.values.end(), other.indices.data(), other.indices.data() + other.indices.size() );
+            energies.values.insert( energies.values.end(), other.energies.data(), other.energies.data() + other.energies.size() );
+            for (int event = 1; event <= other.size(); event++) {
+                offsets.values.push_back( base + other.offsets[event] );
+            }
+            if ( not column_start.empty() ) extend_columns(first_event);
+        }
+
+
+
+        /*
+         * Drop every event past the first event_count.
+         * The database may not be compressed.
+         */
+        void background_database::truncate(int event_count) {
+            if ( event_count >= size() ) return;
+            offsets.values.resize(event_count+1);
+            indices.values.resize( offsets.back() );
+            energies.values.resize( offsets.back() );
+        }
+
+
+
+        static void put_gap(vector<unsigned char>* bytes, unsigned int gap) {
+            while ( gap >= 0x80 ) {
+                bytes->push_back( (gap & 0x7f) | 0x80 );
+                gap >>= 7;
+            }
+            bytes->push_back(gap);
+        }
+
+        static unsigned int get_gap(const unsigned char*& bytes) {
+            unsigned int gap = 0;
+            int shift = 0;
+            while ( *bytes & 0x80 ) {
+                gap |= (unsigned int)(*bytes++ & 0x7f) << shift;
+                shift += 7;
+            }
+            return gap | ( (unsigned int)(*bytes++) << shift );
+        }
+
+
+
+        /*
+         * Switch the (complete) database over to its compressed form.
+         * Each pixel's energies are stored as multiples of the span of
+         * that pixel's energies (from its lowest, or zero, up to its
+         * highest, or zero) / 65535, rounded to the nearest. They are
+         * counted up from the pixel's zero code, which is 0 unless it has
+         * negative energies, so those keep their sign. A hit is never
+         * rounded to nothing, so the same pixels stay hit in every event.
+         * The largest difference between an energy and its stored value
+         * is kept in max_quantization_error.
+         *
+         * Any columns have to be built again afterwards.
+         */
+        void background_database::compress(int pixel_count) {
+            if ( compressed ) return;
+
+            vector<float> highest(pixel_count, 0.0);
+            vector<float> lowest(pixel_count, 0.0);
+            for (long long i = 0; i < indices.size(); i++) {
+                highest[ indices[i] ] = max( highest[ indices[i] ], energies[i] );
+                lowest[ indices[i] ] = min( lowest[ indices[i] ], energies[i] );
+            }
+            vector<float>& scales = energy_scales.values;
+            vector<unsigned short>& zero_codes = energy_zero_codes.values;
+            scales.assign(pixel_count, 1.0);
+            zero_codes.assign(pixel_count, 0);
+            for (int index = 0; index < pixel_count; index++) {
+                float span = highest[index] - lowest[index];
+                if ( span > 0.0 ) scales[index] = span / _quantized_max;
+                if ( lowest[index] < 0.0 ) {
+                    //leave a code either side of zero for the smallest hits
+                    float zero = floor( -lowest[index] / scales[index] + 0.5 );
+                    float top = ( highest[index] > 0.0 ) ? _quantized_max - 1 : _quantized_max;
+                    zero_codes[index] = (unsigned short) min( max(zero, (float)1.0), top );
+                }
+            }
+
+            gap_offsets.values.assign(1, 0);
+            index_gaps.values.clear();
+            vector<unsigned short>& quantized_values = quantized_energies.values;
+            quantized_values.resize( indices.size() );
+            max_quantization_error = 0.0;
+            for (int event = 0; event < size(); event++) {
+                int previous = -1;
+                for (long long i = offsets[event]; i < offsets[event+1]; i++) {
+                    int index = indices[i];
+                    put_gap( &index_gaps.values, index - previous );
+                    previous = index;
+
+                    float zero = zero_codes[index];
+                    float quantized = floor( energies[i] / scales[index] + 0.5 ) + zero;
+                    quantized = min( max(quantized, (float)0.0), _quantized_max );
+                    if ( quantized == zero ) {
+                        quantized = ( energies[i] < 0.0 || zero == _quantized_max ) ? zero - 1 : zero + 1;
+                    }
+                    quantized_values[i] = (unsigned short)quantized;
+
+                    float error = fabs( energies[i] - decode_energy(index, quantized_values[i]) );
+                    max_quantization_error = max( max_quantization_error, error );
+                }
+                gap_offsets.values.push_back( index_gaps.size() );
+            }
+
+            vector<int>().swap(indices.values);
+            vector<float>().swap(energies.values);
+            vector<long long>().swap(column_start.values);
+            vector<float>().swap(columns.values);
+            compressed = true;
+        }
+
+
+
+        /*
+         * The hit pixels of an event: sets event_indices and event_energies
+         * to its (pixel index, energy) pairs in increasing index order, and
+         * returns how many there are. The pairs point straight into the
+         * database, or when it is compressed, into the buffers they are
+         * decoded into.
+         */
+        int background_database::get_event(int event, const int** event_indices, const float** event_energies,
+                                            vector<int>* index_buffer, vector<float>* energy_buffer) const {
+            int count = offsets[event+1] - offsets[event];
+            if ( not compressed ) {
+                *event_indices = indices.data() + offsets[event];
+                *event_energies = energies.data() + offsets[event];
+                return count;
+            }
+
+            index_buffer->resize(count);
+            energy_buffer->resize(count);
+            const unsigned char* gaps = index_gaps.data() + gap_offsets[event];
+            const unsigned short* quantized = quantized_energies.data() + offsets[event];
+            int index = -1;
+            for (int i = 0; i < count; i++) {
+                index += get_gap(gaps);
+                (*index_buffer)[i] = index;
+                (*energy_buffer)[i] = decode_energy(index, quantized[i]);
+            }
+            *event_indices = index_buffer->data();
+            *event_energies = energy_buffer->data();
+            return count;
+        }
+
+
+
+        /*
+         * Energy deposited in a single pixel during the given event.
+         * Read from the pixel's column if the columns have been built,
+         * otherwise found by a search through the event's hit pixels.
+         */
+        float background_database::get_energy(int event, int index) const {
+            if ( has_columns() ) return get_column_energy(index, event);
+
+            if ( compressed ) {
+                vector<int> index_buffer;
+                vector<float> energy_buffer;
+                const int* event_indices;
+                const float* event_energies;
+                int count = get_event(event, &event_indices, &event_energies, &index_buffer, &energy_buffer);
+                const int* found = lower_bound(event_indices, event_indices+count, index);
+                if ( found == event_indices+count || *found != index ) return 0.0;
+                return event_energies[ found - event_indices ];
+            }
+
+            const int* first = indices.data() + offsets[event];
+            const int* last = indices.data() + offsets[event+1];
+            const int* found = lower_bound(first, last, index);
+            if ( found == last || *found != index ) return 0.0;
+            return energies[ found - indices.data() ];
+        }
+
+
+
+        /*
+         * Transpose the database into pixel-major columns. Only pixels
+         * that are hit in at least one event get a column. A compressed
+         * database gets sparse columns, of its hits only, in the same
+         * per-pixel units (see build_sparse_columns).
+         */
+        void background_database::build_columns(int pixel_count) {
+            if ( compressed ) {
+                build_sparse_columns(pixel_count);
+                return;
+            }
+            int event_count = size();
+
+            vector<bool> hit(pixel_count, false);
+            for (long long i = 0; i < indices.size(); i++) hit[ indices[i] ] = true;
+
+            vector<long long>& starts = column_start.values;
+            starts.assign(pixel_count, -1);
+            column_stride = event_count;
+            long long column_count = 0;
+            for (int index = 0; index < pixel_count; index++) {
+                if ( hit[index] ) starts[index] = column_stride * column_count++;
+            }
+
+            columns.values.assign(event_count * column_count, 0.0);
+            for (int event = 0; event < event_count; event++) {
+                for (long long i = offsets[event]; i < offsets[event+1]; i++) {
+                    columns.values[ starts[indices[i]] + event ] = energies[i];
+                }
+            }
+        }
+
+
+
+        /*
+         * The columns of a compressed database: the hits are counted up
+         * per pixel, and then dealt out to the pixels' columns event by
+         * event, so each column comes out in event order.
+         */
+        void background_database::build_sparse_columns(int pixel_count) {
+            int event_count = size();
+            vector<long long>().swap(column_start.values);
+            vector<float>().swap(columns.values);
+            column_stride = 0;
+
+            vector<int> index_buffer;
+            vector<float> energy_buffer;
+            const int* event_indices;
+            const float* event_energies;
+
+            vector<long long>& starts = column_offsets.values;
+            starts.assign(pixel_count+1, 0);
+            for (int event = 0; event < event_count; event++) {
+                int count = get_event(event, &event_indices, &event_energies, &index_buffer, &energy_buffer);
+                for (int i = 0; i < count; i++) starts[ event_indices[i] + 1 ]++;
+            }
+            for (int index = 0; index < pixel_count; index++) starts[index+1] += starts[index];
+
+            vector<long long> next( starts.begin(), starts.end()-1 );
+            column_events.values.resize( starts.back() );
+            column_codes.values.resize( starts.back() );
+            for (int event = 0; event < event_count; event++) {
+                int count = get_event(event, &event_indices, &event_energies, &index_buffer, &energy_buffer);
+                for (int i = 0; i < count; i++) {
+                    long long entry = next[ event_indices[i] ]++;
+                    column_events.values[entry] = event;
+                    column_codes.values[entry] = quantized_energies[ offsets[event] + i ];
+                }
+            }
+        }
+
+
+
+        /*
+         * Bring the columns up to date with the events from first_event on,
+         * which have just been appended. When the columns fill up, they are
+         * moved out to (at least) twice their length, so appending stays
+         * cheap however many events come in. A pixel hit for the first time
+         * gets a new column at the end. The database may not be compressed.
+         */
+        void background_database::extend_columns(int first_event) {
+            int event_count = size();
+            vector<long long>& starts = column_start.values;
+            vector<float>& cells = columns.values;
+
+            if ( event_count > column_stride ) {
+                long long stride = max( (long long)event_count, 2*column_stride );
+                long long column_count = ( column_stride > 0 ) ? cells.size() / column_stride : 0;
+                vector<float> moved(column_count * stride, 0.0);
+                for ( long long& start : starts ) {
+                    if ( start < 0 ) continue;
+                    long long column = start / column_stride;
+                    copy( cells.begin()+start, cells.begin()+start+first_event, moved.begin() + column*stride );
+                    start = column*stride;
+                }
+                cells.swap(moved);
+                column_stride = stride;
+            }
+
+            for (int event = first_event; event < event_count; event++) {
+                for (long long i = offsets[event]; i < offsets[event+1]; i++) {
+                    long long& start = starts[ indices[i] ];
+                    if ( start < 0 ) {
+                        start = cells.size();
+                        cells.resize( cells.size() + column_stride, 0.0 );
+                    }
+                    cells[start + event] = energies[i];
+                }
+            }
+        }
+
+
+
+        /*
+         * The energy of the given pixel in every event (in event order),
+         * or NULL if the pixel is never hit. Points straight into the
+         * columns, or when compressed, into the buffer its hits are
+         * decoded into. Requires build_columns.
+         */
+        const float* background_database::get_column(int index, vector<float>* buffer) const {
+            if ( not compressed ) {
+                long long start = column_start[index];
+                return ( start < 0 ) ? NULL : columns.data() + start;
+            }
+
+            long long first = column_offsets[index];
+            int count = column_offsets[index+1] - first;
+            if ( count == 0 ) return NULL;
+            buffer->resize( size() );
+            float* column = buffer->data();
+            fill( column, column + size(), (float)0.0 );
+            const int* events = column_events.data() + first;
+            const unsigned short* quantized = column_codes.data() + first;
+            float scale = energy_scales[index];
+            float zero = energy_zero_codes[index];
+            for (int i = 0; i < count; i++) column[ events[i] ] = ( (float)quantized[i] - zero ) * scale;
+            return column;
+        }
+
+
+
+        /*
+         * Energy of a pixel in one event, found by a binary search of
+         * the pixel's sparse column.
+         */
+        float background_database::get_sparse_column_energy(int index, int event) const {
+            const int* first = column_events.data() + column_offsets[index];
+            const int* last = column_events.data() + column_offsets[index+1];
+            const int* found = lower_bound(first, last, event);
+            if ( found == last || *found != event ) return 0.0;
+            return decode_energy( index, column_codes[ found - column_events.data() ] );
+        }
+
+
+
+        /*
+         * Add the given pixel's energy in every event onto event_energies.
+         * Requires build_columns.
+         */
+        void background_database::add_column(int index, double* event_energies) const {
+            if ( compressed ) {
+                long long first = column_offsets[index];
+                int count = column_offsets[index+1] - first;
+                const int* events = column_events.data() + first;
+                const unsigned short* quantized = column_codes.data() + first;
+                float scale = energy_scales[index];
+                float zero = energy_zero_codes[index];
+                for (int i = 0; i < count; i++) {
+                    float energy = ( (float)quantized[i] - zero ) * scale;
+                    event_energies[ events[i] ] += energy;
+                }
+                return;
+            }
+
+            long long start = column_start[index];
+            if ( start < 0 ) return;
+            int event_count = size();
+            const float* column = columns.data() + start;
+            for (int event = 0; event < event_count; event++) event_energies[event] += column[event];
+        }
+
+
+
+        /*
+         * Memory taken up by the events (with the per-pixel energy scales
+         * of a compressed database), and by the columns, in bytes. For a
+         * mapped database, this is the size of its part of the file.
+         */
+        long long background_database::get_row_bytes() const {
+            return offsets.size()*sizeof(long long) + indices.size()*sizeof(int) + energies.size()*sizeof(float)
+                    + gap_offsets.size()*sizeof(long long) + index_gaps.size()
+                    + quantized_energies.size()*sizeof(unsigned short) + energy_scales.size()*sizeof(float)
+                    + energy_zero_codes.size()*sizeof(unsigned short);
+        }
+
+        long long background_database::get_column_bytes() const {
+            return column_start.size()*sizeof(long long) + columns.size()*sizeof(float)
+                    + column_offsets.size()*sizeof(long long) + column_events.size()*sizeof(int)
+                    + column_codes.size()*sizeof(unsigned short);
+        }
+
+
+
+        /*
+         * Print how much memory (or mapped file) the events and the
+         * columns take, and for a compressed database, how each compares
+         * to its uncompressed form (dense float columns, one per hit
+         * pixel) and how far off the stored energies may be.
+         */
+        void background_database::report_storage() const {
+            long long row_bytes = get_row_bytes();
+            long long column_bytes = get_column_bytes();
+            cout << "Background database: " << size() << " events, " << offsets.back() << " hit pixels, "
+                 << row_bytes + column_bytes << " bytes" << ( is_mapped() ? " (memory-mapped)" : "" )
+                 << ": " << row_bytes << " in events, " << column_bytes << " in columns\n";
+            if ( not compressed ) return;
+
+            long long uncompressed_rows = offsets.size()*sizeof(long long)
+                                            + offsets.back()*( sizeof(int) + sizeof(float) );
+            int pixel_count = column_offsets.empty() ? 0 : column_offsets.size() - 1;
+            long long column_count = 0;
+            for (int index = 0; index < pixel_count; index++) {
+                if ( column_offsets[index+1] > column_offsets[index] ) column_count++;
+            }
+            long long uncompressed_columns = pixel_count*sizeof(long long) + column_count*size()*sizeof(float);
+            cout << "   events compressed from " << uncompressed_rows << " bytes (compression ratio "
+                 << (double)uncompressed_rows / row_bytes << "), columns from " << uncompressed_columns
+                 << " bytes (compression ratio " << (double)uncompressed_columns / max(column_bytes, 1LL)
+                 << "), maximum quantization error " << max_quantization_error << " GeV\n";
+        }
+
+
+
+        /*
+         * Lay the overlay over the given background event (or over
+         * nothing, for an event of -1), with no signal on it yet.
+         */
+        void background_overlay::set_event(const background_database* bgd_database, int bgd_event, int pixel_count) {
+            if ( (int)is_touched.size() != pixel_count ) {
+                is_touched.assign(pixel_count, 0);
+                touched_energies.assign(pixel_count, 0.0);
+            }
+            for ( int index : touched ) is_touched[index] = 0;
+            touched.clear();
+
+            database = bgd_database;
+            event = bgd_event;
+        }
+
+
+
+        /*
+         * Add signal energy to a pixel. The first time a pixel is hit,
+         * it starts from its background energy, so the sum comes out
+         * exactly as if the signal had been added onto a copy of the
+         * background event.
+         */
+        void background_overlay::add_energy(int index, float energy) {
+            if ( not is_touched[index] ) {
+                is_touched[index] = 1;
+                touched.push_back(index);
+                touched_energies[index] = 0.0;
+                if ( event >= 0 ) touched_energies[index] += database->get_energy(event, index);
+            }
+            touched_energies[index] += energy;
+        }
+
+
+
+        /*
+         * Set the combined energy of a pixel outright, for when the
+         * signal has already been added onto its background elsewhere.
+         */
+        void background_overlay::set_energy(int index, float energy) {
+            if ( not is_touched[index] ) {
+                is_touched[index] = 1;
+                touched.push_back(index);
+            }
+            touched_energies[index] = energy;
+        }
+
+
+
+        /*
+         * Combined background and signal energy of a pixel.
+         */
+        float background_overlay::get_energy(int index) const {
+            if ( is_touched[index] ) return touched_energies[index];
+            if ( event < 0 ) return 0.0;
+            return database->get_energy(event, index);
+        }
+    }
+}
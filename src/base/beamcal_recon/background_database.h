@@ -0,0 +1,184 @@
+#ifndef BACKGROUND_DATABASE_H
+#define BACKGROUND_DATABASE_H
+
+#include <vector>
+#include <memory>
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+        //The energy of every pixel of the beamcal, indexed by
+        //the dense pixel index (see get_pixel_index).
+        typedef std::vector<float> pixel_map;
+
+
+
+        /*
+         * One array of the database. Normally the array is held in values,
+         * but a database mapped from a file (see map_background_cache)
+         * leaves values empty and points straight into the mapping. The
+         * accessors work on either; only an array held in values can be
+         * changed.
+         */
+        template <typename T>
+        struct database_array {
+            std::vector<T> values;
+            const T* mapped;
+            long long mapped_size;
+
+            database_array() : mapped(NULL), mapped_size(0) {}
+            database_array(long long size, const T& value) : values(size, value), mapped(NULL), mapped_size(0) {}
+
+            void map(const T* data, long long size) {
+                std::vector<T>().swap(values);
+                mapped = data;
+                mapped_size = size;
+            }
+
+            const T* data() const { return mapped ? mapped : values.data(); }
+            long long size() const { return mapped ? mapped_size : (long long)values.size(); }
+            bool empty() const { return size() == 0; }
+            const T& operator[](long long i) const { return data()[i]; }
+            const T& back() const { return data()[size()-1]; }
+        };
+
+        /*
+         * All of the background events, stored back to back in
+         * sorted-sparse form: only the hit pixels of each event are
+         * kept, as (pixel index, energy) pairs in increasing index
+         * order. The hit pixels of event i are the entries
+         * offsets[i] ... offsets[i+1]-1 of indices and energies.
+         *
+         * The same energies can also be laid out pixel-major (see
+         * build_columns): one contiguous column per pixel, holding that
+         * pixel's energy in every event, zeros included. That is the
+         * layout the cluster statistics want, since they need the
+         * energy of a handful of pixels across all of the events.
+         *
+         * For very large background samples, the database can be
+         * compressed once it is complete (see compress). The pixel
+         * indices of each event are then stored as variable-length
+         * gaps from the previous index (usually a single byte), and the
+         * energies as 16 bit multiples of a per-pixel energy scale. The
+         * columns of a compressed database are sparse too: each holds
+         * only the events its pixel was hit in, and the quantized
+         * energies there, so they take no more room than the hits do,
+         * however sparse those are. Everything reading the database goes
+         * through get_event, get_energy and the column functions below,
+         * which work on either form.
+         *
+         * A database too large for memory can instead live in a
+         * memory-mapped cache file (see background_cache.h), arrays and
+         * columns alike. Only the pages being scanned are then resident,
+         * and every job mapping the same file shares them. A mapped
+         * database can not be changed.
+         */
+        struct background_database {
+            database_array<long long> offsets;
+            database_array<int> indices;
+            database_array<float> energies;
+
+            //the compressed form: the index gaps of event i take up bytes
+            //gap_offsets[i] ... gap_offsets[i+1]-1 of index_gaps, and its
+            //energies are quantized_energies[offsets[i]] ... (counted up
+            //from energy_zero_codes[index], in units of energy_scales[index])
+            bool compressed;
+            database_array<long long> gap_offsets;
+            database_array<unsigned char> index_gaps;
+            database_array<unsigned short> quantized_energies;
+            database_array<float> energy_scales;
+            database_array<unsigned short> energy_zero_codes;
+            float max_quantization_error;
+
+            //column_start[index] is where the column of that pixel begins
+            //within columns, or -1 if the pixel is never hit. Each column
+            //is column_stride long, which leaves room for events appended
+            //later on.
+            database_array<long long> column_start;
+            long long column_stride;
+            database_array<float> columns;
+
+            //the sparse columns of a compressed database: the hits of pixel
+            //i are column_events[column_offsets[i]] ... column_events[column_offsets[i+1]-1]
+            //in event order, with their quantized energies in column_codes
+            database_array<long long> column_offsets;
+            database_array<int> column_events;
+            database_array<unsigned short> column_codes;
+
+            //the file the arrays are mapped from, if any; unmapped
+            //once the last database using it is gone
+            std::shared_ptr<const void> mapping;
+
+            background_database() : offsets(1,0), compressed(false), max_quantization_error(0.0), column_stride(0) {}
+
+            int size() const { return offsets.size() - 1; }
+            bool is_mapped() const { return (bool)mapping; }
+
+            //pixels below zero_threshold are left out of the event. Once
+            //the columns are built, these keep them up to date.
+            void add_event(const pixel_map& pixels, float zero_threshold = 0.0);
+            void append(const background_database& other);
+            void truncate(int event_count);
+            void compress(int pixel_count);
+
+            int get_event(int event, const int** event_indices, const float** event_energies,
+                            std::vector<int>* index_buffer, std::vector<float>* energy_buffer) const;
+            float get_energy(int event, int index) const;
+
+            void build_columns(int pixel_count);
+            void build_sparse_columns(int pixel_count);
+            void extend_columns(int first_event);
+            bool has_columns() const { return not column_start.empty() or not column_offsets.empty(); }
+            const float* get_column(int index, std::vector<float>* buffer) const;
+            void add_column(int index, double* event_energies) const;
+
+            float get_column_energy(int index, int event) const {
+                if ( compressed ) return get_sparse_column_energy(index, event);
+                long long start = column_start[index];
+                if ( start < 0 ) return 0.0;
+                return columns[start+event];
+            }
+            float get_sparse_column_energy(int index, int event) const;
+
+            //a quantized energy of the given pixel, in GeV
+            float decode_energy(int index, unsigned short quantized) const {
+                return ( (float)quantized - (float)energy_zero_codes[index] ) * energy_scales[index];
+            }
+
+            long long get_row_bytes() const;
+            long long get_column_bytes() const;
+            long long get_storage_bytes() const { return get_row_bytes() + get_column_bytes(); }
+            void report_storage() const;
+        };
+
+
+
+        /*
+         * A single background event with a signal laid on top of it,
+         * read straight out of the database instead of copied into a
+         * pixel map. The pixels the signal hits keep their combined
+         * (background plus signal) energy here, every other pixel is
+         * looked up in the background event.
+         *
+         * The arrays are sized once, and moving to another event only
+         * clears the pixels the last signal hit, so reusing an overlay
+         * costs nothing proportional to the background occupancy.
+         */
+        struct background_overlay {
+            const background_database* database;
+            int event;      //-1 for no background at all
+
+            //the pixels the signal hit, in the order it first hit them
+            std::vector<int> touched;
+            std::vector<char> is_touched;
+            pixel_map touched_energies;
+
+            background_overlay() : database(NULL), event(-1) {}
+
+            void set_event(const background_database* bgd_database, int bgd_event, int pixel_count);
+            void add_energy(int index, float energy);
+            void set_energy(int index, float energy);
+            float get_energy(int index) const;
+        };
+    }
+}
+#endif
@@ -0,0 +1,189 @@
+#ifndef BEAMCAL_LAYOUT_H
+#define BEAMCAL_LAYOUT_H
+
+#include <cmath>
+
+#include "polar_coords.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        //0, 1, ..., N-1 as a parameter pack, for building tables
+        //out of a layout at compile time
+        template <int... values> struct int_sequence {};
+
+        template <int N, int... values>
+        struct make_int_sequence : make_int_sequence<N-1, N-1, values...> {};
+
+        template <int... values>
+        struct make_int_sequence<0, values...> {
+            typedef int_sequence<values...> type;
+        };
+
+
+
+        constexpr short _sidloi3_sector_counts[] = {6, 13, 19, 25, 31, 38, 44, 50, 57,
+                                                    63, 69, 75, 82, 88, 94, 101, 107,
+                                                    113, 119, 126, 132, 138, 145, 151,
+                                                    157, 163, 170, 176, 182, 188, 195,
+                                                    201, 207, 214, 220, 226, 232, 239,
+                                                    245, 251, 258, 264, 270, 276, 283,
+                                                    289, 295, 302, 308, 314, 320, 327,
+                                                    333, 339, 346, 352, 358};
+
+
+
+        /*
+         * A beamcal pixel layout fixed at compile time. It is just a type
+         * (see sidloi3_layout): code templated on it has every ring radius,
+         * sector count and offset as a constant, and can fold them.
+         *
+         * Uniform layouts have ring r reach out to (r+1)*ring_pitch, which
+         * lets the ring of a radius be worked out rather than searched for.
+         */
+        struct sidloi3_layout {
+            static constexpr int last_ring = 56;
+            static constexpr bool uniform_rings = true;
+            static constexpr float ring_pitch = 3.5;
+            static constexpr float sector_offset = 0.05;
+
+            static constexpr float ring_radius(int ring) { return ring_pitch * (ring+1); }
+            static constexpr int sector_count(int ring) { return _sidloi3_sector_counts[ring]; }
+        };
+
+
+
+        //The geometry as read at run time (see simple_list_geometry.cc),
+        //for when it is not one of the layouts compiled in.
+        struct runtime_layout {};
+
+
+
+        template <typename layout>
+        constexpr int layout_ring_offset(int ring) {
+            return ( ring == 0 ) ? 0 : layout_ring_offset<layout>(ring-1) + layout::sector_count(ring-1);
+        }
+
+
+
+        /*
+         * Tables derived from a compile-time layout, filled in by the
+         * compiler: the dense index of each ring's first pixel (and the
+         * pixel count), each ring's sector offset, and each ring's sectors
+         * per radian, so that finding a sector takes a multiplication
+         * rather than a division.
+         */
+        template < typename layout, typename rings = typename make_int_sequence<layout::last_ring+1>::type >
+        struct layout_tables;
+
+        template <typename layout, int... rings>
+        struct layout_tables< layout, int_sequence<rings...> > {
+            static constexpr int ring_offsets[] = { layout_ring_offset<layout>(rings)...,
+                                                    layout_ring_offset<layout>(layout::last_ring+1) };
+            static constexpr float sector_offsets[] = { layout::sector_offset * rings... };
+            static constexpr double sectors_per_radian[] = { layout::sector_count(rings) / (2.0*M_PI)... };
+        };
+
+        template <typename layout, int... rings>
+        constexpr int layout_tables< layout, int_sequence<rings...> >::ring_offsets[];
+
+        template <typename layout, int... rings>
+        constexpr float layout_tables< layout, int_sequence<rings...> >::sector_offsets[];
+
+        template <typename layout, int... rings>
+        constexpr double layout_tables< layout, int_sequence<rings...> >::sectors_per_radian[];
+
+
+
+        /*
+         * Pixel lookups for a layout. Every one of them gives exactly what
+         * the run time geometry gives for the same layout:
+         *
+         * > a uniform layout's ring is guessed from the radius, and then
+         *   set right by comparing with the two ring edges around it,
+         * > the sector is found with a multiplication; only when that
+         *   lands within a hair of a sector edge is the division of the
+         *   run time geometry done instead, to settle which side it is on.
+         */
+        template <typename layout>
+        struct layout_lookup {
+            typedef layout_tables<layout> tables;
+
+            static int last_ring() { return layout::last_ring; }
+            static int sector_count(int ring) { return layout::sector_count(ring); }
+            static float ring_radius(int ring) { return layout::ring_radius(ring); }
+            static int ring_offset(int ring) { return tables::ring_offsets[ring]; }
+
+            static int get_ring(double radius) {
+                if ( radius <= layout::ring_radius(0) ) return 0;
+                if ( radius >= layout::ring_radius(layout::last_ring-1) ) return layout::last_ring;
+
+                if ( layout::uniform_rings ) {
+                    //the number of ring edges at or inside the radius
+                    int ring = (int)( radius * (1.0/layout::ring_pitch) );
+                    ring += ( layout::ring_radius(ring) <= radius );
+                    ring -= ( ring > 0 && layout::ring_radius(ring-1) > radius );
+                    return ring;
+                }
+
+                int start = 0;
+                int end = layout::last_ring;
+                while ( end-start > 1 ) {
+                    int center = (end-start)/2 + start;
+                    if ( radius < layout::ring_radius(center) ) end = center;
+                    else start = center;
+                }
+                return end;
+            }
+
+            static int get_sector(int ring, double phi) {
+                double offset_phi = phi - tables::sector_offsets[ring];
+                if (offset_phi < 0) offset_phi += 2.0*M_PI;
+                if ((2.0*M_PI) < offset_phi) offset_phi -= 2.0*M_PI;
+
+                double position = offset_phi * tables::sectors_per_radian[ring];
+                int sector = (int)position;
+                double edge_distance = position - sector;
+                if ( edge_distance < 1e-9 || edge_distance > 1.0 - 1e-9 ) {
+                    sector = (int)( (offset_phi/(2.0*M_PI)) * layout::sector_count(ring) );
+                }
+                return sector;
+            }
+
+            static double get_phi(int ring, int sector) {
+                int sectorCount = layout::sector_count(ring);
+                if( sector      < 0.0    ) sector += sectorCount;
+                if( sectorCount < sector ) sector -= sectorCount;
+
+                double offset_phi = ((double)sector / (double)sectorCount) * 2.0*M_PI;
+                double phi = offset_phi + tables::sector_offsets[ring];
+                if (phi>2.0*M_PI) phi -= 2.0*M_PI;
+                return phi;
+            }
+
+            static int get_index(double x, double y) {
+                double r,phi;
+                scipp_ilc::cartesian_to_polar(x,y,r,phi);
+                int ring = get_ring(r);
+                return tables::ring_offsets[ring] + get_sector(ring,phi);
+            }
+        };
+
+
+
+        //the run time geometry, defined in simple_list_geometry.cc
+        template <>
+        struct layout_lookup<runtime_layout> {
+            static int last_ring();
+            static int sector_count(int ring);
+            static float ring_radius(int ring);
+            static int ring_offset(int ring);
+
+            static int get_ring(double radius);
+            static int get_sector(int ring, double phi);
+            static double get_phi(int ring, int sector);
+            static int get_index(double x, double y);
+        };
+    }
+}
+#endif
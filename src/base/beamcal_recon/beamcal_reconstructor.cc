@@ -4,20 +4,32 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
-#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdlib.h>
 
 #include "lcio.h"
 #include "IMPL/LCEventImpl.h"
 #include "EVENT/LCEvent.h"
 #include "EVENT/LCCollection.h"
 #include "EVENT/SimCalorimeterHit.h"
-#include "UTIL/CellIDDecoder.h"
 #include "IMPL/LCRunHeaderImpl.h"
 
 
+#include "beamcal_layout.h"
 #include "simple_list_geometry.h"
 #include "beamcal_scanner.h"
 #include "beamcal_reconstructor.h"
+#include "background_cache.h"
+#include "pixel_statistics.h"
+#include "pixel_covariance.h"
+#include "seed_bounds.h"
+#include "quantile_sketch.h"
+#include "layer_tensor.h"
+#include "cell_id_decoder.h"
 
 #include "scipp_ilc_globals.h"
 
@@ -41,43 +53,50 @@ namespace scipp_ilc {
  * a 2x2 hits; with 3, you get 9 hits in a 3x3 pattern; etc.
  * _cellsize is the original square pixel size as defined in the lcdd and 
  * compact.xml.
+ *
+ * With PIXELATION_CELL_AREA, the anti-aliasing is exact instead: each hit's
+ * energy is shared out among all the pixels its square cell overlaps, in
+ * proportion to the overlapping area, as looked up in the geometry's cell
+ * table (see get_cell_pixels).
  */
 
-        static const float _cellsize = 1; //milimeter
+        static const float _cellsize = _BeamCal_cell_size; //milimeter
         static const float _spreadfactor = 1; //1; we decided we don't need to spread a 1 mm pixel
         static const bool _remove_negative = true;
 
+        //the range of layers which are compressed together into a
+        //single pixel by default (see pixelate_beamcal), and the
+        //number of layers any weighting of them can cover
+        static const unsigned int _layer_min = 6;
+        static const unsigned int _layer_max = 39;
+        static const int _layer_count = 40;
+
         //the fraction of background events that the program is
         //allowed to reject. This is used to calculate the
         //sigma cut
         static const float _rejection_limit = 0.1;
 
-        static float _sigma_cut;
+        //how many overlays reconstruct_overlays() combines and scans at a time
+        static const int _overlay_batch_size = 64;
 
-        static bool _adding_to_stats;
-        static int _num_bgd_events;
-        static unordered_map<int,double>* _energy_totals;
-        static unordered_map<int,double>* _square_energy_totals;
-        static unordered_map<int,double>* _energy_averages;
-        static unordered_map<int,double>* _energy_std_devs;
-        static unordered_map<int,int>* _times_hit;
-        
-        vector<pixel_map*>* _database;
+        //the reconstructor behind the original free function interface
+        static beamcal_reconstructor* _default_reconstructor = NULL;
+        static reconstruction_scratch* _default_scratch = NULL;
 
 
 
         /*
          * Open an lcio event and take the rectilinear beamcal hits and apply them
          * to the radial tiling scheme we use. If the simulation-level pixel size
-         * is too large, you also need to use the hit spreader.
-         *
-         * Additionally, if processing the background hits,
-         * load up the statistics maps.
+         * is too large, you also need to use the hit spreader. The hits are added
+         * onto new_pixels: either a pixel_map, which must already be sized to
+         * get_pixel_count(), a background_overlay, a list of (pixel index,
+         * energy) hits, or a layered_event, which keeps the layers apart.
          *
          *
          * IMPORTANT: From this point forward, all "pixels" are NOT just one pixel.
          * They are "layer compressed" pixels. That is, all pixels of the same ID
-         * between layers "layer_min" and "layer_max" are all compressed together
+         * between layers "_layer_min" and "_layer_max" are all compressed together
          * into a single pixel. This drastically reduces processing time and memory
          * consumption, and also aids identification of signal events, as signal
          * events penetrate more deeply into the beamcal than background events.
@@ -85,120 +104,450 @@ namespace scipp_ilc {
          * layer 9 and 39, because indexing starts at layer 0), please refer to
          * Alex Bogert's Thesis.
          *
-         * Developer Note: A possible improvement on the current algorithm may
-         * be to weight hits from later layers. That is, a layer 9 hit simply
-         * adds hit->getEnergy(), but a layer 28 hit will add:
-         * layerWeight(28)*hit->getEnergy(), where layerWeight(int layer) is
-         * a function you would need to define that fits the signal's energy
-         * deposition per layer. The signal's energy deposition per layer is
-         * higher than bgd events, so magnifying late-layer energy deposition
-         * may increase signal recognition. Of course, this will make it more
-         * of a pain to reconstruct the signal event's energy later on, once
-         * you've identified it (you'll probably just have to rerun over the
-         * beamcal hits and only accept the hits that land within the IDs
-         * specified in the cluster IDlist returned by the scanner). 
+         * More generally, each layer's hits are weighted by layer_weights[layer]
+         * (layers without a weight, or with a weight of 0, are skipped), and the
+         * window above is just the default weighting: 1 from _layer_min to
+         * _layer_max and 0 elsewhere (see set_layer_weights). The signal's
+         * energy deposition per layer is higher than bgd events, so magnifying
+         * late-layer energy deposition may increase signal recognition. Of
+         * course, this will make it more of a pain to reconstruct the signal
+         * event's energy later on, once you've identified it. Rather than
+         * running over the beamcal hits again and only accepting those that
+         * land within the cluster's IDs, a recording_overlay can be pixelated
+         * onto, which notes which hits (and how much of each) went into each
+         * pixel (see profile_cluster). With NULL weights, every layer is kept,
+         * unweighted; that is what a layered_event is for.
+         *
+         * The layer of each hit is read straight out of its cell ID, by the
+         * decoder compiled from the collection's encoding string (which is
+         * only compiled again if the string changes). The cheap cuts, on the
+         * sign of z and on the layer, are made before any floating point
+         * work, and each cut's rejections are counted in cuts. The cell ID's
+         * x and y fields give the hit's cell for PIXELATION_CELL_AREA.
          *
+         * Every target is also handed the hit's place in the collection and
+         * the share of it the pixel got, which all but a recording_overlay
+         * ignore.
          */
-        static void pixelate_beamcal(lcio::LCEvent* event, pixel_map* new_pixels) {
+        struct recording_overlay {
+            background_overlay* overlay;
+            signal_hit_record* record;
+        };
+
+        static void add_pixel_energy(pixel_map* pixels, int index, int, float energy, int, float) {
+            (*pixels)[index] += energy;
+        }
+
+        static void add_pixel_energy(background_overlay* pixels, int index, int, float energy, int, float) {
+            pixels->add_energy(index, energy);
+        }
+
+        static void add_pixel_energy(vector< pair<int,float> >* hits, int index, int, float energy, int, float) {
+            hits->push_back( pair<int,float>(index, energy) );
+        }
+
+        static void add_pixel_energy(layered_event* pixels, int index, int layer, float energy, int, float) {
+            pixels->add_energy(index, layer, energy);
+        }
+
+        static void add_pixel_energy(recording_overlay* pixels, int index, int, float energy, int hit, float share) {
+            pixels->overlay->add_energy(index, energy);
+            pixel_hit part = { hit, share };
+            pixels->record->entries.push_back( pair<int,pixel_hit>(index, part) );
+        }
+
+        /*
+         * How pixelate_beamcal() turns hits into pixel energies: the weight
+         * of each layer, how each hit's energy is shared out among the
+         * pixels, and whether every layer is to be kept, unweighted (for
+         * the layer tensor). Either way, hits in layers weighted zero are
+         * counted as cut on layer, so the cut counts do not depend on
+         * whether the layers are kept.
+         */
+        struct pixelation_settings {
+            const vector<float>* layer_weights;
+            pixelation_mode mode;
+            bool all_layers;
+        };
+
+        template <typename lookup, typename pixel_target>
+        static void pixelate_hits(lcio::LCEvent* event, const pixelation_settings& settings,
+                                    cell_id_decoder* decoder, hit_cut_counts* cuts, pixel_target* new_pixels) {
+            const vector<float>* layer_weights = settings.layer_weights;
+            bool cell_area = ( settings.mode == PIXELATION_CELL_AREA );
             double dim = _cellsize / ( _spreadfactor );
             double Ediv = (_spreadfactor * _spreadfactor);
 
-            unsigned int layer_min = 6;
-            unsigned int layer_max = 39;
-
             lcio::LCCollection* col = event->getCollection("BeamCalHits") ;
             if( col != NULL ){
-                lcio::CellIDDecoder<lcio::SimCalorimeterHit> decoder = lcio::CellIDDecoder<lcio::SimCalorimeterHit>(col);
+                //checked once here, so the hits need no dynamic_cast
+                if ( col->getTypeName() != lcio::LCIO::SIMCALORIMETERHIT ) {
+                    cout << "BeamCalHits holds " << col->getTypeName() << " rather than calorimeter hits\n";
+                    return;
+                }
+                if ( not decoder->compile( col->getParameters().getStringVal(lcio::LCIO::CellIDEncoding) ) ) return;
+                const cell_id_field& layer_field = decoder->layer;
 
                 int nElements = col->getNumberOfElements()  ;
+                cuts->hits += nElements;
                 for(int hitIndex = 0; hitIndex < nElements ; hitIndex++){
-                    lcio::SimCalorimeterHit* hit = dynamic_cast<lcio::SimCalorimeterHit*>( col->getElementAt(hitIndex) );
+                    lcio::SimCalorimeterHit* hit = static_cast<lcio::SimCalorimeterHit*>( col->getElementAt(hitIndex) );
 
+                    //the cuts needing no floating point work go first
                     const float* old_pos = hit->getPosition();
-
                     float old_z = old_pos[2];
+                    if ( _remove_negative && (old_z<0) ) {
+                        cuts->negative_z++;
+                        continue;
+                    }
+
+                    unsigned long long cell_id = ( (unsigned long long)(unsigned int)hit->getCellID1() << 32 )
+                                                    | (unsigned int)hit->getCellID0();
+                    long long layer = layer_field.decode(cell_id);
+                    if ( layer < 0 || layer >= _layer_count ) {
+                        cuts->layer++;
+                        continue;
+                    }
+                    float weight = (*layer_weights)[layer];
+                    bool layer_cut = ( weight == 0.0 );
+                    if ( layer_cut ) {
+                        cuts->layer++;
+                        if ( not settings.all_layers ) continue;
+                    }
+                    if ( settings.all_layers ) weight = 1.0;
+
                     float old_y = old_pos[1];
                     float old_x = old_pos[0] - abs(old_z)*_transform;
                     float radius = hypot(old_x,old_y);
+                    if ( radius > _radius_cut ) {
+                        if ( not layer_cut ) cuts->radius++;
+                        continue;
+                    }
                     float old_energy = hit->getEnergy();
-                    unsigned int layer = decoder(hit)["layer"];
 
-                    if ( _remove_negative && (old_z<0) ) continue;
-                    if ( radius > _radius_cut ) continue;
-                    if ( layer < layer_min or layer_max < layer ) continue;
+                    //the hit's cell, looked up in the cell table; hits whose
+                    //cell is not in it (or not in the cell ID) fall through
+                    if ( cell_area && decoder->has_cell_xy ) {
+                        const int* indices;
+                        const float* fractions;
+                        int overlaps = get_cell_pixels( decoder->cell_x.decode(cell_id), decoder->cell_y.decode(cell_id),
+                                                        &indices, &fractions );
+                        if ( overlaps > 0 ) {
+                            for (int k = 0; k < overlaps; k++) {
+                                add_pixel_energy(new_pixels, indices[k], layer, fractions[k] * weight * old_energy,
+                                                    hitIndex, fractions[k]);
+                            }
+                            continue;
+                        }
+                    }
                     
                     if (_spreadfactor > 1) {
-                        float spread_energy = old_energy / Ediv;
+                        float spread_energy = weight * old_energy / Ediv;
                         for (int i = 0; i < _spreadfactor; i++) {
                             float spread_x = (i*dim) + old_x + (dim/2.0) - (_cellsize/2.0);
                             for (int j = 0; j < _spreadfactor; j++) {
                                 float spread_y = (j*dim) + old_y + (dim/2.0) - (_cellsize/2.0);
 
-                                int ID = getID(spread_x,spread_y);
-                                (*new_pixels)[ID] += spread_energy;
+                                int index = lookup::get_index(spread_x,spread_y);
+                                add_pixel_energy(new_pixels, index, layer, spread_energy, hitIndex, 1.0/Ediv);
                             }
                         }
                     } else {
-                        int ID = getID(old_x,old_y);
-                        (*new_pixels)[ID] += old_energy;
+                        int index = lookup::get_index(old_x,old_y);
+                        add_pixel_energy(new_pixels, index, layer, weight * old_energy, hitIndex, 1.0);
                     }
                 }
+            }
+        }
 
-                if (_adding_to_stats) {
-                    for( auto pixel : *new_pixels ) {
-                        int ID = pixel.first;
-                        float energy = pixel.second;
 
-                        (*_energy_totals)[ID] += energy;
-                        (*_square_energy_totals)[ID] += ( (double)energy ) * ( (double)energy );
-                        (*_times_hit)[ID] += 1;
-                    }
-                }
+
+        /*
+         * Pixelate with the pixel lookups of the compiled layout when the
+         * geometry is one, so the ring and sector of each hit come out of
+         * constants rather than the geometry tables.
+         */
+        template <typename pixel_target>
+        static void pixelate_beamcal(lcio::LCEvent* event, const pixelation_settings& settings,
+                                        cell_id_decoder* decoder, hit_cut_counts* cuts, pixel_target* new_pixels) {
+            if ( has_compiled_layout() ) {
+                pixelate_hits< layout_lookup<sidloi3_layout> >(event, settings, decoder, cuts, new_pixels);
+            } else {
+                pixelate_hits< layout_lookup<runtime_layout> >(event, settings, decoder, cuts, new_pixels);
             }
         }
 
 
 
         /*
-         * Read in the background file list, iterate through it line
-         * by line, read in each slcio file, read the slcio's event by
-         * event, and load the beamcal hits from each event into a 
-         * pixel_map for that specific event.
+         * Everything read out of a single background slcio file:
+         * the pixelated events, in file order, and the file's
+         * contribution to the pixel statistics, plus the events with their
+         * layers kept apart, if those are wanted. Files are read into
+         * separate chunks (possibly by separate threads), and the
+         * chunks are then merged in file list order, so the result does
+         * not depend on how many threads did the reading.
          */
-        static void process_background_events(string bgd_list_file_name) {
-            _database = new vector<pixel_map*>();
+        struct background_file_chunk {
+            background_database events;
+            pixel_statistics stats;
+            layer_tensor layers;
+            hit_cut_counts cuts;
 
-            int numEventsRead = 0;
-            try { 
-                //open filelist
-                ifstream filelist (bgd_list_file_name, ifstream::in);
-                lcio::LCReader* lcReader = lcio::LCFactory::getInstance()->createLCReader() ;
-                string slcioFile;
+            //set if the file could not be fully read;
+            //no files after this one are used.
+            bool failed;
+
+            background_file_chunk() : failed(false) {}
+        };
+
+
+
+        /*
+         * Read, pixelate and accumulate the statistics of (at most
+         * max_events) events of a single slcio file, pixelated as the
+         * settings say. Pixels with less than zero_threshold
+         * energy are left out.
+         *
+         * If the layers are to be kept, every layer of each event goes
+         * into the chunk's tensor, and the event's pixels are then taken
+         * from the tensor, so that they come out just as they would if the
+         * tensor were later collapsed with the same weights.
+         */
+        static void read_background_file(lcio::LCReader* lcReader, string slcioFile, int max_events,
+                                            float zero_threshold, const pixelation_settings* settings,
+                                            bool keep_layers, background_file_chunk* chunk) {
+            chunk->failed = false;
+            chunk->stats.reset( get_pixel_count() );
+            chunk->cuts.reset();
+            cell_id_decoder decoder;
+            pixel_map new_pixels( get_pixel_count() );
+            layered_event layered;
+            pixelation_settings all_layers = { settings->layer_weights, settings->mode, true };
+            if (keep_layers) layered.reset( get_pixel_count(), _layer_count );
+            try {
                 lcio::LCEvent* event = NULL;
+                lcReader->open(slcioFile);
 
-                //for each slcio file in the file list
-                while ( filelist >> slcioFile ) {
-                    lcReader->open(slcioFile);
-                    
-                    //for each event in the slcio file
-                    while( (event=lcReader->readNextEvent()) ) {
-                        pixel_map* new_pixels = new pixel_map();
-                        pixelate_beamcal(event,new_pixels);
-                        _database->push_back(new_pixels);
-
-                        numEventsRead++;
-                        cout << "Database read number = " << numEventsRead << endl;
-                        if ( numEventsRead >= _num_bgd_events ) {
-                            delete event;
-                            break;
-                        }
+                //for each event in the slcio file
+                while( (int)chunk->events.size() < max_events && (event=lcReader->readNextEvent()) ) {
+                    fill( new_pixels.begin(), new_pixels.end(), 0.0 );
+                    if (keep_layers) {
+                        layered.clear();
+                        pixelate_beamcal(event,all_layers,&decoder,&chunk->cuts,&layered);
+                        chunk->layers.add_event(layered);
+                        chunk->layers.get_event(chunk->layers.size()-1, *settings->layer_weights, &new_pixels);
+                    } else {
+                        pixelate_beamcal(event,*settings,&decoder,&chunk->cuts,&new_pixels);
+                    }
+                    chunk->events.add_event(new_pixels, zero_threshold);
+                    chunk->stats.add_event(chunk->events, chunk->events.size()-1);
+
+                    if ( (int)chunk->events.size() >= max_events ) {
+                        delete event;
+                        break;
                     }
-                    lcReader->close();
-                    if ( numEventsRead >= _num_bgd_events ) break;
                 }
-                filelist.close();
+                lcReader->close();
             } catch(lcio::IOException& e) {
                 cout << " Unable to read and analyze the LCIO file - " << e.what() << endl ;
+                chunk->failed = true;
+            }
+        }
+
+
+
+        /*
+         * Drop all events of the chunk past the first keep_events,
+         * and redo its statistics for the events that remain.
+         */
+        static void truncate_chunk(background_file_chunk* chunk, int keep_events) {
+            chunk->events.truncate(keep_events);
+            chunk->layers.truncate(keep_events);
+
+            chunk->stats.reset( get_pixel_count() );
+            for (int event = 0; event < chunk->events.size(); event++) chunk->stats.add_event(chunk->events, event);
+        }
+
+
+
+        /*
+         * Which chunks the ingest workers have finished reading, so
+         * that each can be merged (and freed) as soon as it and every
+         * chunk before it are in.
+         */
+        struct ingest_progress {
+            mutex lock;
+            condition_variable chunk_read;
+            vector<char> chunk_done;
+            int workers_running;
+        };
+
+
+
+        /*
+         * Each worker thread takes the next unread file in the list
+         * until either the list is exhausted or enough events have been
+         * read. Since files are handed out in list order, the files that
+         * get read always form the start of the list.
+         */
+        static void background_ingest_worker(lcio::LCReader* lcReader, vector<string>* slcio_files,
+                                                vector<background_file_chunk>* chunks, int max_events,
+                                                float zero_threshold, const pixelation_settings* settings,
+                                                bool keep_layers, atomic<int>* next_file,
+                                                atomic<int>* events_read, ingest_progress* progress) {
+            while ( *events_read < max_events ) {
+                int file_index = (*next_file)++;
+                if ( file_index >= (int)slcio_files->size() ) break;
+
+                background_file_chunk* chunk = &(*chunks)[file_index];
+                read_background_file( lcReader, (*slcio_files)[file_index], max_events, zero_threshold,
+                                        settings, keep_layers, chunk );
+                *events_read += chunk->events.size();
+                if ( chunk->failed ) *events_read += max_events;
+
+                lock_guard<mutex> lock(progress->lock);
+                progress->chunk_done[file_index] = 1;
+                progress->chunk_read.notify_all();
+            }
+
+            lock_guard<mutex> lock(progress->lock);
+            progress->workers_running--;
+            progress->chunk_read.notify_all();
+        }
+
+
+
+        /*
+         * Read in the background file list, read in each slcio file,
+         * read the slcio's event by event, and load the beamcal hits
+         * from each event (at most max_events of them) onto the end of
+         * the database.
+         *
+         * With more than one ingest thread, the slcio files are read
+         * and pixelated concurrently, each into its own chunk. Either
+         * way, the chunks are merged in file list order, so the
+         * database and statistics come out identical to a serial read.
+         *
+         * Each chunk is merged as soon as it can be, and then dropped.
+         * Given a stream, the chunks are merged into the cache file
+         * instead of the database, so the events are never all in
+         * memory at once.
+         */
+        void beamcal_reconstructor::process_background_events(string bgd_list_file_name, int max_events,
+                                                                int ingest_threads, background_cache_stream* stream) {
+            //open filelist
+            vector<string> slcio_files;
+            ifstream filelist (bgd_list_file_name, ifstream::in);
+            string slcioFile;
+            while ( filelist >> slcioFile ) slcio_files.push_back(slcioFile);
+            filelist.close();
+
+            vector<background_file_chunk> chunks( slcio_files.size() );
+            if ( ingest_threads > (int)slcio_files.size() ) ingest_threads = slcio_files.size();
+
+            //Every thread gets its own reader. They are all created
+            //here, as LCFactory is not meant to be used concurrently.
+            if ( ingest_threads < 1 ) ingest_threads = 1;
+            vector<lcio::LCReader*> lcReaders;
+            for (int i = 0; i < ingest_threads; i++) {
+                lcReaders.push_back( lcio::LCFactory::getInstance()->createLCReader() );
+            }
+
+            bool keep_layers = ( _layer_tensor != NULL );
+            pixelation_settings settings = { &_layer_weights, _pixelation, false };
+
+            //when running in parallel, the files are read ahead by the
+            //workers; otherwise, each file is read right before it is merged.
+            bool parallel = ingest_threads > 1;
+            atomic<int> next_file(0);
+            atomic<int> events_read(0);
+            ingest_progress progress;
+            progress.chunk_done.assign(slcio_files.size(), 0);
+            progress.workers_running = 0;
+            vector<thread> workers;
+            if (parallel) {
+                cout << "Reading background files on " << ingest_threads << " threads\n";
+                progress.workers_running = ingest_threads;
+                for (int i = 0; i < ingest_threads; i++) {
+                    workers.push_back( thread(background_ingest_worker, lcReaders[i], &slcio_files, &chunks,
+                                                max_events, _zero_threshold, &settings, keep_layers,
+                                                &next_file, &events_read, &progress) );
+                }
+            }
+
+            int numEventsRead = 0;
+            for (unsigned int file_index = 0; file_index < slcio_files.size(); file_index++) {
+                if ( numEventsRead >= max_events ) break;
+
+                int events_remaining = max_events - numEventsRead;
+                background_file_chunk* chunk = &chunks[file_index];
+                if (parallel) {
+                    unique_lock<mutex> lock(progress.lock);
+                    progress.chunk_read.wait(lock, [&]() {
+                        return progress.chunk_done[file_index] || progress.workers_running == 0;
+                    });
+                    if ( not progress.chunk_done[file_index] ) break;
+                    lock.unlock();
+
+                    if ( (int)chunk->events.size() > events_remaining ) truncate_chunk(chunk,events_remaining);
+                } else {
+                    read_background_file(lcReaders[0], slcio_files[file_index], events_remaining, _zero_threshold,
+                                            &settings, keep_layers, chunk);
+                }
+
+                if (stream) stream->append(chunk->events);
+                else _database->append(chunk->events);
+                _background_stats->merge(chunk->stats);
+                _background_cuts.add(chunk->cuts);
+                if (keep_layers) _layer_tensor->append(chunk->layers);
+
+                numEventsRead += chunk->events.size();
+                cout << "Database read number = " << numEventsRead << endl;
+
+                //release the chunk now that it has been merged
+                bool failed = chunk->failed;
+                *chunk = background_file_chunk();
+                if ( failed ) break;
+            }
+            for ( thread& worker : workers ) worker.join();
+            for ( lcio::LCReader* lcReader : lcReaders ) delete lcReader;
+        }
+
+
+
+        /*
+         * Get the averages and standard deviations of all the pixels
+         * over all events out of the accumulated background statistics.
+         * A pixel which was hit only once has no meaningful deviation,
+         * and is marked with a standard deviation of -1.
+         *
+         * Every pixel's average and deviation shift whenever the number
+         * of events does, so they are all taken again after an append,
+         * but only from the statistics, which is quick.
+         */
+        void beamcal_reconstructor::compute_pixel_statistics() {
+            int pixel_count = get_pixel_count();
+            if ( _energy_averages == NULL ) {
+                _energy_averages = new vector<double>();
+                _energy_std_devs = new vector<double>();
+            }
+            _energy_averages->assign(pixel_count, 0.0);
+            _energy_std_devs->assign(pixel_count, 0.0);
+
+            for (int index = 0; index < pixel_count; index++) {
+                long long hitcount = _background_stats->times_hit(index);
+                if (hitcount == 0) continue;
+
+                double energy_average = _background_stats->average(index);
+                double energy_std_dev = _background_stats->std_dev(index);
+
+                if (hitcount == 1) {
+                    energy_std_dev = -1.0;
+                }
+
+                (*_energy_averages)[index] = energy_average;
+                (*_energy_std_devs)[index] = energy_std_dev;
             }
         }
 
@@ -206,62 +555,156 @@ namespace scipp_ilc {
 
         /*
          * Read in all of the bgd events, store their beamcal hit
-         * information in the _database vector, and get the averages
+         * information in the _database, and get the averages
          * and standard deviations of all the pixels over all events.
+         *
+         * If the database is to be compressed, that is done as soon as
+         * it is complete, and the pixel statistics are then taken again
+         * from the stored (quantized) energies, so that they agree with
+         * everything else computed from the database.
+         *
+         * Given a stream, the database is written out to the stream's
+         * cache file instead, and mapped back from it once complete.
+         * Returns false if that could not be done.
          */
-        static void generate_database(string bgd_list_file_name) {
+        bool beamcal_reconstructor::generate_database(string bgd_list_file_name, int ingest_threads,
+                                                        background_cache_stream* stream) {
             cout << "Generating Database...\n";
 
-             _energy_totals = new unordered_map<int,double>();
-             _square_energy_totals = new unordered_map<int,double>();
-             _energy_averages = new unordered_map<int,double>();
-             _energy_std_devs = new unordered_map<int,double>();
-             _times_hit = new unordered_map<int,int>();
+            _database = new background_database();
+            _background_stats = new pixel_statistics();
+            _background_stats->reset( get_pixel_count() );
+            _background_cuts.reset();
 
             //read in all of the background events in the given
             //bgd file list.
             //NOTE: Depending on the number of bgd events, this
             //one function will take longer than the entire rest
             //of the reconstruction.
-            process_background_events(bgd_list_file_name);
+            process_background_events(bgd_list_file_name, _num_bgd_events, ingest_threads, stream);
+            _background_cuts.report("Background");
+            if (stream) {
+                if ( not stream->finish(*_background_stats, _database) ) return false;
+                compute_pixel_statistics();
+                _database->report_storage();
+            } else {
+                complete_database();
+            }
+            if ( _layer_tensor != NULL ) {
+                cout << "Layer tensor holds " << _layer_tensor->size() << " events in "
+                     << _layer_tensor->get_storage_bytes() << " bytes\n";
+            }
 
-            for ( auto pixel : *_energy_totals ) {
-                int ID = pixel.first;
-                double energy_total = pixel.second;
+            cout << "Database succesfully generated.\n";
+            return true;
+        }
 
-                int hitcount = (*_times_hit)[ID];
-                double squared_energy_total = (*_square_energy_totals)[ID];
 
-                double energy_average = energy_total / _num_bgd_events;
 
-                double average_of_squares = squared_energy_total / _num_bgd_events;
-                double square_of_averages = energy_average * energy_average;
-                double energy_std_dev = sqrt(average_of_squares - square_of_averages);
+        /*
+         * Once every event is in the (in-memory) database: compress it if
+         * it is to be compressed, with the statistics then taken again from
+         * the stored energies, build its columns, and get the pixel
+         * averages and deviations.
+         */
+        void beamcal_reconstructor::complete_database() {
+            if ( _compress_background ) {
+                _database->compress( get_pixel_count() );
+                _background_stats->reset( get_pixel_count() );
+                for (int event = 0; event < _database->size(); event++) _background_stats->add_event(*_database, event);
+            }
+            _database->build_columns( get_pixel_count() );
+            compute_pixel_statistics();
+            _database->report_storage();
+        }
 
-                if (hitcount == 1) {
-                    energy_std_dev = -1.0;
-                }
 
-                (*_energy_averages)[ID] = energy_average;
-                (*_energy_std_devs)[ID] = energy_std_dev;
+        
+        /*
+         * Tell the scanner where everything it needs lives, building
+         * the pixel covariance table first if the chosen significance
+         * backend uses it, and the seed bounds if clusters are grown over
+         * one ring (which are taken from the table, so it is built for
+         * them too). Must be called once the database is complete.
+         */
+        void beamcal_reconstructor::prepare_scan_background() {
+            _scan_background.database = _database;
+            _scan_background.averages = _energy_averages;
+            _scan_background.std_devs = _energy_std_devs;
+            _scan_background.check_tally = _check_tally;
+
+            if ( _scan_background.backend != SIGNIFICANCE_EXACT || _scan_background.clustering == CLUSTER_ONE_RING ) {
+                cout << "Building pixel covariance table...\n";
+                _covariance = new pixel_covariance();
+                _covariance->build( _database, get_pixel_count() );
+                cout << "Pixel covariance table holds " << _covariance->partners.size() << " pixel pairs\n";
             }
+            _scan_background.covariance = _covariance;
 
+            delete _seed_bounds;
+            _seed_bounds = NULL;
+            if ( _scan_background.clustering == CLUSTER_ONE_RING ) {
+                cout << "Bounding seed clusters...\n";
+                _seed_bounds = new seed_bounds();
+                _seed_bounds->build( _covariance, *_energy_std_devs, _calibration_threads );
+            }
+            _scan_background.bounds = _seed_pruning ? _seed_bounds : NULL;
+        }
 
-            delete _energy_totals;
-            delete _square_energy_totals;
-            delete _times_hit;
 
-            cout << "Database succesfully generated.\n";
+
+        /*
+         * Scan every background event with index first_event + offset +
+         * k*stride, and record the significance of its most significant
+         * cluster (the significance of first_event going first in the list).
+         * Each worker has its own scratch, and writes only its own
+         * entries of the significance list. With several workers, each
+         * grows the clusters of its scans on its own thread.
+         */
+        static void calibration_worker(const scan_background* background, int first_event, int offset, int stride,
+                                        vector<float>* significances) {
+            const background_database* database = background->database;
+            background_overlay map;
+            scan_scratch scratch;
+            for (int map_num = first_event + offset; map_num < database->size(); map_num += stride) {
+                map.set_event(database, map_num, get_pixel_count());
+
+                beamcal_cluster* new_cluster;
+                new_cluster = scan_beamcal(*background,&map,&scratch);
+                (*significances)[map_num - first_event] = new_cluster->significance;
+
+                delete new_cluster->id_list;
+                free(new_cluster);
+            }
         }
 
 
-        
+
         /*
-         * Sort from greatest to least significance.
-         * Largest significance cluster is zeroth element in list
+         * Scan every background event from first_event on, on the given
+         * number of threads, and list the significance of each one's most
+         * significant cluster, in event order.
          */
-        static bool compare_cluster( beamcal_cluster* first, beamcal_cluster* second ) {
-            return ( first->significance > second->significance );
+        void beamcal_reconstructor::scan_background_events(int first_event, int calibration_threads,
+                                                            vector<float>* significances) const {
+            int event_count = _database->size() - first_event;
+            significances->assign(event_count, 0.0);
+
+            if ( calibration_threads > event_count ) calibration_threads = event_count;
+            if ( calibration_threads <= 1 ) {
+                calibration_worker(&_scan_background, first_event, 0, 1, significances);
+            } else {
+                cout << "   Calibrating on " << event_count << " background events with "
+                     << calibration_threads << " threads\n";
+                scan_background background = _scan_background;
+                background.seed_threads = 1;
+                vector<thread> workers;
+                for (int i = 0; i < calibration_threads; i++) {
+                    workers.push_back( thread(calibration_worker, &background, first_event, i,
+                                                calibration_threads, significances) );
+                }
+                for ( thread& worker : workers ) worker.join();
+            }
         }
 
 
@@ -269,54 +712,504 @@ namespace scipp_ilc {
         /*
          * Run the clustering/signal identification algorithm for every
          * bgd event stored in the _database. This gives us the highest
-         * significance cluster for each bgd event. We take each of these
-         * clusters, and order them by their significance. Finally, we use
-         * this sorted list to determine the sigma cut which only a certain
-         * fraction (given by _rejection_limit) of the clusters (and thus
-         * of the bgd events themselves) will exceed.
+         * significance cluster for each bgd event. Finally, we use the
+         * significances of these clusters to determine the sigma cut which
+         * only a certain fraction (given by _rejection_limit) of the clusters
+         * (and thus of the bgd events themselves) will exceed.
+         *
+         * The events can be scanned on several threads. Only the significance
+         * of each event's cluster is kept, and the cut is picked out of them
+         * by selection (nth_element) rather than by a full sort. Every event's
+         * significance is computed the same way no matter which thread does it,
+         * so the sigma cut comes out the same for any number of threads.
+         *
+         * The quantile sketch is started off from the same significances,
+         * with the cut as its estimate, so that background events appended
+         * later on can move the cut without the whole list (see
+         * refresh_calibration).
          */
-        static void calibrate_scanner() {
+        void beamcal_reconstructor::calibrate_scanner(int calibration_threads) {
             cout << "Calibrating Scanner...\n";
 
-            vector<beamcal_cluster*> cluster_list;
-            int map_num = 0;
-            for( pixel_map* map : *_database ) {
-                beamcal_cluster* new_cluster;
-                new_cluster = scan_beamcal(map,_energy_averages,_energy_std_devs);
-                cluster_list.push_back(new_cluster);
-                cout << "   Calibrating on background event " << map_num++ << endl;
+            int event_count = _database->size();
+            _calibrated_events = event_count;
+            _significance_sketch.reset(1.0 - _rejection_limit);
+            if ( event_count == 0 ) {
+                cout << "No background events to calibrate on!\n";
+                _sigma_cut = 0.0;
+                return;
             }
 
-            sort(cluster_list.begin(), cluster_list.end(), compare_cluster);
-            
-            int cutoff_index = (int)( cluster_list.size()*_rejection_limit );
-            _sigma_cut = cluster_list[cutoff_index]->significance;
+            vector<float> significances;
+            scan_background_events(0, calibration_threads, &significances);
+
+            //The cut is the (cutoff_index)th largest significance
+            //(the largest being the zeroth).
+            int cutoff_index = (int)( event_count*_rejection_limit );
+            _significance_sketch.seed(&significances, event_count-1 - cutoff_index);
+            nth_element( significances.begin(), significances.begin()+cutoff_index, significances.end(), greater<float>() );
+            _sigma_cut = significances[cutoff_index];
 
             cout << "Scanner calibration complete.\n";
         }
 
 
 
+        /*
+         * Scan the background events appended since the scanner was last
+         * calibrated (with the statistics as they are now), and move the
+         * sigma cut to the sketch's new estimate. The events scanned
+         * before keep the significance they were given then, so nothing
+         * is scanned twice.
+         */
+        void beamcal_reconstructor::refresh_calibration() {
+            if ( _database == NULL || _calibrated_events >= _database->size() ) return;
+
+            vector<float> significances;
+            scan_background_events(_calibrated_events, _calibration_threads, &significances);
+            for ( float significance : significances ) _significance_sketch.add(significance);
+
+            _calibrated_events = _database->size();
+            _sigma_cut = _significance_sketch.estimate();
+            cout << "Sigma cut refreshed to " << _sigma_cut << " over " << _calibrated_events << " background events\n";
+        }
+
+
+
+        /*
+         * Read more background events (at most bgd_events_to_be_read, from
+         * the files of the given list) onto the end of the database, and
+         * bring everything derived from it up to date. The statistics, the
+         * database's columns and the covariance sums only take in the new
+         * events, and the pixel averages and deviations are then taken
+         * from the statistics again. The seed bounds only count the new
+         * events' hits, and take their lowest values from the covariance
+         * sums again. The sigma cut is refreshed once enough new events
+         * have come in (see set_calibration_refresh).
+         *
+         * Must not be called while events are being reconstructed. Only
+         * an uncompressed database held in memory can be appended to, and
+         * the appended events are not written to the background cache.
+         */
+        void beamcal_reconstructor::append_background(string bgd_list_file_name, int bgd_events_to_be_read,
+                                                        int bgd_ingest_threads) {
+            if ( _database == NULL ) {
+                cout << "The background must be initialized before more can be appended to it\n";
+                return;
+            }
+            if ( _database->compressed || _database->is_mapped() ) {
+                cout << "Only an uncompressed background database held in memory can be appended to\n";
+                return;
+            }
+
+            cout << "Appending background events...\n";
+            process_background_events(bgd_list_file_name, bgd_events_to_be_read, bgd_ingest_threads, NULL);
+            _background_cuts.report("Background");
+            compute_pixel_statistics();
+            if ( _covariance != NULL ) _covariance->add_events();
+            if ( _seed_bounds != NULL ) _seed_bounds->add_events( _covariance, *_energy_std_devs, _calibration_threads );
+            _database->report_storage();
+
+            if ( _database->size() - _calibrated_events >= _calibration_refresh ) refresh_calibration();
+        }
+
+
+
+        /*
+         * Fingerprint of everything the database, statistics and sigma
+         * cut depend on: the background sample and geometry, plus the
+         * pixelation, seeding, clustering and calibration settings of this
+         * file.
+         */
+        unsigned long long beamcal_reconstructor::get_cache_key(string bgd_list_file_name) const {
+            unsigned long long key = hash_background_inputs(bgd_list_file_name, _num_bgd_events);
+            for ( float weight : _layer_weights ) key = hash_value(key, weight);
+            key = hash_value(key, (int)_pixelation);
+            key = hash_value(key, _radius_cut);
+            key = hash_value(key, _transform);
+            key = hash_value(key, _cellsize);
+            key = hash_value(key, _spreadfactor);
+            key = hash_value(key, _remove_negative);
+            key = hash_value(key, _rejection_limit);
+            key = hash_value(key, _zero_threshold);
+            key = hash_value(key, _compress_background);
+            key = hash_value(key, _scan_background.max_seeds);
+            key = hash_value(key, (int)_scan_background.clustering);
+            key = hash_value(key, _scan_background.region_threshold);
+            return key;
+        }
+
+
+
+        beamcal_reconstructor::beamcal_reconstructor() :
+            _num_bgd_events(0), _sigma_cut(0.0), _overlay_seed(0),
+            _compress_background(false), _zero_threshold(0.0), _out_of_core(false),
+            _calibration_threads(1), _calibration_refresh(0), _calibrated_events(0),
+            _pixelation(PIXELATION_POINT), _record_hits(false), _keep_layer_tensor(false),
+            _layer_tensor(NULL), _database(NULL), _background_stats(NULL),
+            _energy_averages(NULL), _energy_std_devs(NULL), _covariance(NULL),
+            _seed_bounds(NULL), _seed_pruning(true), _check_tally( new significance_check_tally() ), _signal_cuts( new hit_cut_tally() ) {
+            set_layer_window(_layer_min, _layer_max);
+        }
+
+
+
+        beamcal_reconstructor::~beamcal_reconstructor() {
+            release_background();
+            delete _check_tally;
+            delete _signal_cuts;
+        }
+
+
+
+        /*
+         * Let go of the background database and everything derived
+         * from it.
+         */
+        void beamcal_reconstructor::release_background() {
+            delete _database;
+            delete _background_stats;
+            delete _energy_averages;
+            delete _energy_std_devs;
+            delete _covariance;
+            delete _seed_bounds;
+            delete _layer_tensor;
+            _database = NULL;
+            _background_stats = NULL;
+            _energy_averages = NULL;
+            _energy_std_devs = NULL;
+            _covariance = NULL;
+            _seed_bounds = NULL;
+            _layer_tensor = NULL;
+        }
+
+
+
+        void beamcal_reconstructor::set_significance_backend(significance_backend backend) {
+            _scan_background.backend = backend;
+        }
+
+
+
+        void beamcal_reconstructor::set_max_seeds(int max_seeds) {
+            _scan_background.max_seeds = max_seeds;
+        }
+
+
+
+        void beamcal_reconstructor::set_clustering(cluster_strategy clustering) {
+            _scan_background.clustering = clustering;
+        }
+
+
+
+        void beamcal_reconstructor::set_seed_threads(int seed_threads) {
+            _scan_background.seed_threads = seed_threads;
+        }
+
+
+
+        void beamcal_reconstructor::set_seed_pruning(bool prune) {
+            _seed_pruning = prune;
+            _scan_background.bounds = _seed_pruning ? _seed_bounds : NULL;
+        }
+
+
+
+        void beamcal_reconstructor::set_region_threshold(float region_threshold) {
+            _scan_background.region_threshold = region_threshold;
+        }
+
+
+
+        void beamcal_reconstructor::set_overlay_seed(unsigned long long seed) {
+            _overlay_seed = seed;
+        }
+
+
+
+        void beamcal_reconstructor::set_calibration_refresh(int events) {
+            _calibration_refresh = events;
+        }
+
+
+
+        void beamcal_reconstructor::set_background_storage(bool compress, float zero_threshold, bool out_of_core) {
+            _compress_background = compress;
+            _zero_threshold = zero_threshold;
+            _out_of_core = out_of_core;
+        }
+
+
+
+        /*
+         * Weight of each layer's hits, from layer 0 on. Layers past the
+         * end of the list, or past the last beamcal layer, get no weight.
+         */
+        void beamcal_reconstructor::set_layer_weights(const vector<float>& layer_weights) {
+            _layer_weights.assign(_layer_count, 0.0);
+            for (int layer = 0; layer < _layer_count && layer < (int)layer_weights.size(); layer++) {
+                _layer_weights[layer] = layer_weights[layer];
+            }
+        }
+
+
+
+        void beamcal_reconstructor::set_layer_window(int first_layer, int last_layer) {
+            _layer_weights.assign(_layer_count, 0.0);
+            for (int layer = max(first_layer, 0); layer <= last_layer && layer < _layer_count; layer++) {
+                _layer_weights[layer] = 1.0;
+            }
+        }
+
+
+
+        void beamcal_reconstructor::set_pixelation(pixelation_mode mode) {
+            _pixelation = mode;
+        }
+
+
+
+        void beamcal_reconstructor::set_hit_recording(bool record) {
+            _record_hits = record;
+        }
+
+
+
+        void beamcal_reconstructor::set_layer_tensor(bool keep) {
+            _keep_layer_tensor = keep;
+        }
+
+
+
+        /*
+         * Weight the background's layers anew, and derive everything from
+         * the re-weighted background again: the database (straight from the
+         * layer tensor, without reading any files), the pixel statistics,
+         * the covariance table and the sigma cut. Signal events are then
+         * pixelated with the new weights too.
+         *
+         * Needs the layer tensor, so set_layer_tensor(true) must have been
+         * called before initialize(). Must not be called while events are
+         * being reconstructed. The re-weighted background is not written
+         * to the background cache.
+         */
+        void beamcal_reconstructor::reweight_layers(const vector<float>& layer_weights) {
+            if ( _layer_tensor == NULL ) {
+                cout << "The background layers were not kept apart, so they cannot be re-weighted"
+                     << " (see set_layer_tensor)\n";
+                return;
+            }
+
+            cout << "Re-weighting background layers...\n";
+            set_layer_weights(layer_weights);
+
+            delete _database;
+            delete _covariance;
+            _covariance = NULL;
+            _database = new background_database();
+            _layer_tensor->collapse(_layer_weights, _zero_threshold, get_pixel_count(), _database);
+
+            _background_stats->reset( get_pixel_count() );
+            for (int event = 0; event < _database->size(); event++) _background_stats->add_event(*_database, event);
+            complete_database();
+
+            prepare_scan_background();
+            calibrate_scanner(_calibration_threads);
+            report_significance_check();
+        }
+
+
+
         /*
          * This function does three things: 
          * > setup the geometry,
          * > read in all the background events and setup the base statistics,
          * > get the signal sigma cut (the significance a cluster must have
          *          in order to be called a signal event)
+         *
+         * If a cache file name is given, the last two steps are skipped
+         * whenever the cache holds a database built from the same inputs,
+         * and the cache is (re)written whenever they are not skipped.
+         * An out-of-core database is written to the cache as it is
+         * read, and used straight out of the mapped cache file. With the
+         * layer tensor kept (see set_layer_tensor), the cache is neither
+         * read nor written, so the background is always read anew.
+         *
+         * bgd_ingest_threads sets how many background files are read
+         * at once, and calibration_threads how many background events
+         * are scanned at once; the result is the same for any number
+         * of threads.
          */
-        void initialize_beamcal_reconstructor(string geom_file_name, string bgd_list_file_name, int bgd_events_to_be_read) {
+        void beamcal_reconstructor::initialize(string geom_file_name, string bgd_list_file_name, int bgd_events_to_be_read,
+                                                string bgd_cache_file_name, int bgd_ingest_threads,
+                                                int calibration_threads) {
+            release_background();
             _num_bgd_events = bgd_events_to_be_read;
+            _calibration_threads = calibration_threads;
 
-            //The _adding_to_stats variable is turned on during this sequence only.
-            //It is only used only in the pixelate_beamcal function. However, that
-            //function is used here, and also when processing signal events, and
-            //when processing signal events you don't want to screw with the statistics.
-            _adding_to_stats = true;
             initialize_geometry(geom_file_name); //from simple_list_geometry.h
-            generate_database(bgd_list_file_name);
-            calibrate_scanner();
-            _adding_to_stats = false;
 
+            bool out_of_core = _out_of_core;
+            if ( out_of_core and _keep_layer_tensor ) {
+                cout << "The background layers are kept in memory, so the database is too\n";
+                out_of_core = false;
+            }
+            if ( out_of_core and bgd_cache_file_name.empty() ) {
+                cout << "An out-of-core background database needs a cache file, keeping it in memory\n";
+                out_of_core = false;
+            }
+            if ( out_of_core and _compress_background ) {
+                cout << "An out-of-core background database is stored uncompressed\n";
+                _compress_background = false;
+            }
+
+            //the layer tensor is not cached, so with the tensor wanted the
+            //background is always read, and the cache left alone: its events
+            //are taken from the tensor's layer sums, which need not round
+            //just as the events of a background read without it
+            if ( _keep_layer_tensor and not bgd_cache_file_name.empty() ) {
+                cout << "The background layers are not cached, so the background cache is not used\n";
+                bgd_cache_file_name = "";
+            }
+            unsigned long long cache_key = 0;
+            if ( not bgd_cache_file_name.empty() ) cache_key = get_cache_key(bgd_list_file_name);
+            if ( not bgd_cache_file_name.empty() ) {
+
+                _database = new background_database();
+                _background_stats = new pixel_statistics();
+                if ( read_background_cache(bgd_cache_file_name, cache_key, _database,
+                                            _background_stats, _sigma_cut, &_significance_sketch,
+                                            &_background_cuts, out_of_core) ) {
+                    _calibrated_events = _database->size();
+                    compute_pixel_statistics();
+                    _database->report_storage();
+                    prepare_scan_background();
+                    cout << "Database loaded from background cache " << bgd_cache_file_name << endl;
+                    return;
+                }
+                release_background();
+            }
+
+            if (out_of_core) {
+                background_cache_stream stream;
+                if ( stream.open(bgd_cache_file_name, cache_key, get_pixel_count())
+                        and generate_database(bgd_list_file_name, bgd_ingest_threads, &stream) ) {
+                    prepare_scan_background();
+                    calibrate_scanner(calibration_threads);
+                    report_significance_check();
+                    stream.commit(_sigma_cut, _significance_sketch, _background_cuts);
+                    return;
+                }
+                cout << "Unable to keep the background database out of core, generating it in memory\n";
+                release_background();
+            }
+
+            if (_keep_layer_tensor) _layer_tensor = new layer_tensor();
+            generate_database(bgd_list_file_name, bgd_ingest_threads);
+            prepare_scan_background();
+            calibrate_scanner(calibration_threads);
+            report_significance_check();
+
+            if ( not bgd_cache_file_name.empty() ) {
+                write_background_cache(bgd_cache_file_name, cache_key, _database,
+                                        _background_stats, _sigma_cut, _significance_sketch, _background_cuts);
+            }
+
+        }
+
+
+
+        /*
+         * The splitmix64 finalizer: scrambles every bit of x into every
+         * bit of the result.
+         */
+        static unsigned long long mix_bits(unsigned long long x) {
+            x += 0x9e3779b97f4a7c15ULL;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+
+
+
+        /*
+         * Counter-based choice of background events: the overlay_number-th
+         * background event for a signal event is a hash of the seed, the
+         * signal's run and event numbers, and overlay_number. There is no
+         * generator state to set up or share, and an event gets the same
+         * backgrounds no matter which thread reconstructs it, or when.
+         */
+        static int pick_background_event(unsigned long long seed, lcio::LCEvent* signal_event,
+                                            int overlay_number, int event_count) {
+            unsigned long long signal_key = ( (unsigned long long)(unsigned int)signal_event->getRunNumber() << 32 )
+                                            | (unsigned int)signal_event->getEventNumber();
+            unsigned long long key = mix_bits( seed ^ mix_bits(signal_key) );
+            key = mix_bits( key + (unsigned long long)overlay_number );
+
+            //top 32 bits scaled onto [0,event_count)
+            return (int)( ( (key >> 32) * (unsigned long long)event_count ) >> 32 );
+        }
+
+
+
+        /*
+         * Group the recorded hits by pixel (a counting sort, so each
+         * pixel's hits stay in pixelation order), after letting go of
+         * the last event's pixels.
+         */
+        static void group_hits(signal_hit_record* record, int pixel_count) {
+            vector<int>& positions = record->positions;
+            if ( (int)positions.size() != pixel_count ) positions.assign(pixel_count, -1);
+            for ( int index : record->pixels ) positions[index] = -1;
+
+            record->pixels.clear();
+            for ( auto& entry : record->entries ) {
+                if ( positions[entry.first] >= 0 ) continue;
+                positions[entry.first] = record->pixels.size();
+                record->pixels.push_back(entry.first);
+            }
+
+            //starts[p+1] counts, then starts, then ends pixel p's hits
+            int pixel_total = record->pixels.size();
+            vector<int>& starts = record->starts;
+            starts.assign(pixel_total+2, 0);
+            for ( auto& entry : record->entries ) starts[ positions[entry.first] + 2 ]++;
+            for (int i = 2; i < pixel_total+2; i++) starts[i] += starts[i-1];
+
+            record->hits.resize( record->entries.size() );
+            for ( auto& entry : record->entries ) record->hits[ starts[ positions[entry.first] + 1 ]++ ] = entry.second;
+            starts.pop_back();
+        }
+
+
+
+        /*
+         * Pick a background event from the _database, and lay the signal
+         * event over it, in the scratch's overlay. With hit recording on,
+         * the hits behind each pixel are recorded in the scratch too; with
+         * it off, this costs nothing.
+         */
+        background_overlay* beamcal_reconstructor::overlay_signal(lcio::LCEvent* signal_event, reconstruction_scratch* scratch) const {
+            background_overlay* bgd_populated_beamcal = &scratch->overlay;
+
+            int bgd_index = -1;
+            if ( _database->size() > 0 ) {
+                bgd_index = pick_background_event(_overlay_seed, signal_event, 0, _database->size());
+            }
+            bgd_populated_beamcal->set_event(_database, bgd_index, get_pixel_count());
+            scratch->hit_cuts.reset();
+            pixelation_settings settings = { &_layer_weights, _pixelation, false };
+            if (_record_hits) {
+                recording_overlay recorder = { bgd_populated_beamcal, &scratch->hit_record };
+                scratch->hit_record.entries.clear();
+                pixelate_beamcal( signal_event, settings, &scratch->decoder, &scratch->hit_cuts, &recorder );
+                group_hits( &scratch->hit_record, get_pixel_count() );
+            } else {
+                pixelate_beamcal( signal_event, settings, &scratch->decoder, &scratch->hit_cuts, bgd_populated_beamcal );
+            }
+            _signal_cuts->add(scratch->hit_cuts);
+            return bgd_populated_beamcal;
         }
 
 
@@ -324,24 +1217,312 @@ namespace scipp_ilc {
         /*
          * Attempt to identify the cluster which marks the location of the
          * signal in this event. This function takes in an event which contains
-         * a signal, and then makes a copy of a background event from the 
-         * _database. The signal event is overlayed on top of the bgd event,
-         * and then the scanner is invoked.
+         * a signal, and then picks a background event from the _database.
+         * The signal event is overlayed on top of the bgd event, and then the
+         * scanner is invoked.
+         *
+         * The background event is not copied: the overlay reads it straight
+         * out of the database, and only holds the pixels the signal hit.
+         * Everything written to along the way lives in the scratch.
          */
-        beamcal_cluster* reconstruct_beamcal_event(lcio::LCEvent* signal_event) {
-            //literally copy-pasted this RNG from stack exchange
-            //no idea how it works, but it does the job
-            std::random_device rd; // only used once to initialise (seed) engine
-            std::mt19937 rng(rd()); // random-number engine used (Mersenne-Twister in this case)
-            std::uniform_int_distribution<int> uni(0,_num_bgd_events-1); // guaranteed unbiased
-            int bgd_index = uni(rng);
-            
-            pixel_map bgd_populated_beamcal = *( (*_database)[bgd_index] );
-            pixelate_beamcal( signal_event, &bgd_populated_beamcal );
-            beamcal_cluster* signal_cluster = scan_beamcal(&bgd_populated_beamcal,_energy_averages,_energy_std_devs);
+        beamcal_cluster* beamcal_reconstructor::reconstruct(lcio::LCEvent* signal_event, reconstruction_scratch* scratch) const {
+            background_overlay* bgd_populated_beamcal = overlay_signal(signal_event, scratch);
+            beamcal_cluster* signal_cluster = scan_beamcal(_scan_background, bgd_populated_beamcal, &scratch->scan);
 
             signal_cluster->exceeds_sigma_cut = signal_cluster->significance > _sigma_cut;
             return signal_cluster;
         }
+
+
+
+        /*
+         * Reconstruct every cluster of a signal event, most significant
+         * first: those of every region with CLUSTER_REGIONS, or else the
+         * one cluster reconstruct() finds. Each is checked against the
+         * sigma cut, which (with CLUSTER_REGIONS) the most significant
+         * region of every background event was calibrated on.
+         */
+        void beamcal_reconstructor::reconstruct_clusters(lcio::LCEvent* signal_event, reconstruction_scratch* scratch,
+                                                            vector<beamcal_cluster*>* clusters) const {
+            if ( _scan_background.clustering != CLUSTER_REGIONS ) {
+                clusters->assign( 1, reconstruct(signal_event, scratch) );
+                return;
+            }
+
+            background_overlay* bgd_populated_beamcal = overlay_signal(signal_event, scratch);
+            scan_beamcal_regions(_scan_background, bgd_populated_beamcal, &scratch->scan, clusters);
+            for ( beamcal_cluster* signal_cluster : *clusters ) {
+                signal_cluster->exceeds_sigma_cut = signal_cluster->significance > _sigma_cut;
+            }
+        }
+
+
+
+        /*
+         * Sum up the signal hits that went into a cluster's pixels, going
+         * over only those hits, as recorded when the signal event was last
+         * reconstructed with the scratch. A hit shared out between pixels
+         * counts by the share each of the cluster's pixels got.
+         */
+        cluster_profile beamcal_reconstructor::profile_cluster(lcio::LCEvent* signal_event, const beamcal_cluster* cluster,
+                                                                const reconstruction_scratch* scratch) const {
+            cluster_profile profile;
+            profile.energy = 0.0;
+            profile.layer_energies.assign(_layer_count, 0.0);
+            profile.centroid_x = 0.0;
+            profile.centroid_y = 0.0;
+
+            if ( not _record_hits ) {
+                cout << "Signal hits are not recorded, so clusters cannot be profiled (see set_hit_recording)\n";
+                return profile;
+            }
+            const signal_hit_record& record = scratch->hit_record;
+            lcio::LCCollection* col = signal_event->getCollection("BeamCalHits");
+            if ( col == NULL || cluster->id_list == NULL || record.positions.empty() ) return profile;
+            const cell_id_field& layer_field = scratch->decoder.layer;
+
+            double energy = 0.0;
+            for ( int ID : *cluster->id_list ) {
+                int position = record.positions[ get_pixel_index(ID) ];
+                if ( position < 0 ) continue;
+
+                for (int i = record.starts[position]; i < record.starts[position+1]; i++) {
+                    const pixel_hit& part = record.hits[i];
+                    lcio::SimCalorimeterHit* hit = static_cast<lcio::SimCalorimeterHit*>( col->getElementAt(part.hit) );
+
+                    const float* hit_position = hit->getPosition();
+                    unsigned long long cell_id = ( (unsigned long long)(unsigned int)hit->getCellID1() << 32 )
+                                                    | (unsigned int)hit->getCellID0();
+                    double hit_energy = part.share * hit->getEnergy();
+
+                    energy += hit_energy;
+                    profile.layer_energies[ layer_field.decode(cell_id) ] += hit_energy;
+                    profile.centroid_x += hit_energy * ( hit_position[0] - abs(hit_position[2])*_transform );
+                    profile.centroid_y += hit_energy * hit_position[1];
+                }
+            }
+
+            profile.energy = energy;
+            if ( energy != 0.0 ) {
+                profile.centroid_x /= energy;
+                profile.centroid_y /= energy;
+            }
+            return profile;
+        }
+
+
+
+        /*
+         * Lay the same signal over several background events, and find
+         * the fraction of them in which it is detected. This gives a much
+         * less noisy efficiency per signal event than a single overlay.
+         *
+         * The backgrounds are the first overlay_count picked for this event
+         * by pick_background_event (the first of which is the one used by
+         * reconstruct()), or with an overlay_count of 0, every background
+         * event once. The signal is pixelated just once. The overlays are
+         * then handled in batches: for every signal pixel, its background
+         * energy in every overlay of the batch is gathered from the pixel's
+         * column, and the signal hits are added on across the whole batch
+         * in one loop. Each overlay's energies come out exactly as they do
+         * in reconstruct(), so a single overlay is detected just the same.
+         *
+         * Only that gather is batched. Each overlay is still scanned on its
+         * own, seeds and all (scan_beamcal), since its seeds come mostly
+         * from its own background event's pixels, which no other overlay
+         * of the batch shares.
+         */
+        overlay_efficiency beamcal_reconstructor::reconstruct_overlays(lcio::LCEvent* signal_event, int overlay_count,
+                                                                        reconstruction_scratch* scratch) const {
+            int event_count = _database->size();
+            bool every_event = ( overlay_count <= 0 );
+            if ( every_event ) overlay_count = event_count;
+            if ( event_count == 0 ) overlay_count = 1; //the signal on its own
+
+            //pixelate the signal, and group its hits by pixel
+            vector< pair<int,float> >* signal_hits = &scratch->signal_hits;
+            signal_hits->clear();
+            scratch->hit_cuts.reset();
+            pixelation_settings settings = { &_layer_weights, _pixelation, false };
+            pixelate_beamcal( signal_event, settings, &scratch->decoder, &scratch->hit_cuts, signal_hits );
+            _signal_cuts->add(scratch->hit_cuts);
+            stable_sort( signal_hits->begin(), signal_hits->end(),
+                            [](const pair<int,float>& first, const pair<int,float>& second) {
+                                return first.first < second.first;
+                            } );
+            int hit_count = signal_hits->size();
+
+            overlay_efficiency efficiency;
+            efficiency.overlays = overlay_count;
+            efficiency.detections = 0;
+
+            vector<int>* events = &scratch->overlay_events;
+            vector<float>* energies = &scratch->overlay_energies;
+            background_overlay* overlay = &scratch->overlay;
+            for (int batch_start = 0; batch_start < overlay_count; batch_start += _overlay_batch_size) {
+                int batch = min( _overlay_batch_size, overlay_count - batch_start );
+
+                events->resize(batch);
+                for (int k = 0; k < batch; k++) {
+                    if ( event_count == 0 ) (*events)[k] = -1;
+                    else if ( every_event ) (*events)[k] = batch_start + k;
+                    else (*events)[k] = pick_background_event(_overlay_seed, signal_event, batch_start + k, event_count);
+                }
+
+                //combine every signal pixel with its background, across the batch
+                energies->resize( (long long)hit_count * batch );
+                int pixel_number = 0;
+                for (int hit = 0; hit < hit_count; pixel_number++) {
+                    int index = (*signal_hits)[hit].first;
+                    float* row = energies->data() + (long long)pixel_number * batch;
+
+                    for (int k = 0; k < batch; k++) {
+                        row[k] = 0.0;
+                        if ( (*events)[k] >= 0 ) row[k] += _database->get_column_energy(index, (*events)[k]);
+                    }
+                    for ( ; hit < hit_count && (*signal_hits)[hit].first == index; hit++) {
+                        float energy = (*signal_hits)[hit].second;
+                        for (int k = 0; k < batch; k++) row[k] += energy;
+                    }
+                }
+
+                //scan each overlay of the batch, one at a time
+                for (int k = 0; k < batch; k++) {
+                    overlay->set_event(_database, (*events)[k], get_pixel_count());
+                    pixel_number = 0;
+                    for (int hit = 0; hit < hit_count; pixel_number++) {
+                        int index = (*signal_hits)[hit].first;
+                        overlay->set_energy( index, (*energies)[ (long long)pixel_number * batch + k ] );
+                        while ( hit < hit_count && (*signal_hits)[hit].first == index ) hit++;
+                    }
+
+                    beamcal_cluster* cluster = scan_beamcal(_scan_background, overlay, &scratch->scan);
+                    if ( cluster->significance > _sigma_cut ) efficiency.detections++;
+                    delete cluster->id_list;
+                    free(cluster);
+                }
+            }
+
+            efficiency.detection_fraction = (float)efficiency.detections / efficiency.overlays;
+            return efficiency;
+        }
+
+
+
+        void beamcal_reconstructor::report_significance_check() const {
+            if ( _scan_background.backend != SIGNIFICANCE_CHECK ) return;
+            _check_tally->report();
+        }
+
+
+
+        void beamcal_reconstructor::report_hit_cuts() const {
+            _background_cuts.report("Background");
+            _signal_cuts->report("Signal");
+        }
+
+
+
+        static beamcal_reconstructor* get_default_reconstructor() {
+            if ( _default_reconstructor == NULL ) _default_reconstructor = new beamcal_reconstructor();
+            return _default_reconstructor;
+        }
+
+
+
+        void set_significance_backend(significance_backend backend) {
+            get_default_reconstructor()->set_significance_backend(backend);
+        }
+
+
+
+        void set_max_seeds(int max_seeds) {
+            get_default_reconstructor()->set_max_seeds(max_seeds);
+        }
+
+
+
+        void set_clustering(cluster_strategy clustering) {
+            get_default_reconstructor()->set_clustering(clustering);
+        }
+
+
+
+        void set_seed_threads(int seed_threads) {
+            get_default_reconstructor()->set_seed_threads(seed_threads);
+        }
+
+
+
+        void set_seed_pruning(bool prune) {
+            get_default_reconstructor()->set_seed_pruning(prune);
+        }
+
+
+
+        void set_region_threshold(float region_threshold) {
+            get_default_reconstructor()->set_region_threshold(region_threshold);
+        }
+
+
+
+        void set_hit_recording(bool record) {
+            get_default_reconstructor()->set_hit_recording(record);
+        }
+
+
+
+        void report_significance_check() {
+            get_default_reconstructor()->report_significance_check();
+        }
+
+
+
+        void report_hit_cuts() {
+            get_default_reconstructor()->report_hit_cuts();
+        }
+
+
+
+        void initialize_beamcal_reconstructor(string geom_file_name, string bgd_list_file_name, int bgd_events_to_be_read,
+                                                string bgd_cache_file_name, int bgd_ingest_threads,
+                                                int calibration_threads) {
+            get_default_reconstructor()->initialize(geom_file_name, bgd_list_file_name, bgd_events_to_be_read,
+                                                    bgd_cache_file_name, bgd_ingest_threads, calibration_threads);
+        }
+
+
+
+        void append_beamcal_background(string bgd_list_file_name, int bgd_events_to_be_read, int bgd_ingest_threads) {
+            get_default_reconstructor()->append_background(bgd_list_file_name, bgd_events_to_be_read, bgd_ingest_threads);
+        }
+
+
+
+        beamcal_cluster* reconstruct_beamcal_event(lcio::LCEvent* signal_event) {
+            if ( _default_scratch == NULL ) _default_scratch = new reconstruction_scratch();
+            return get_default_reconstructor()->reconstruct(signal_event, _default_scratch);
+        }
+
+
+
+        void reconstruct_beamcal_clusters(lcio::LCEvent* signal_event, vector<beamcal_cluster*>* clusters) {
+            if ( _default_scratch == NULL ) _default_scratch = new reconstruction_scratch();
+            get_default_reconstructor()->reconstruct_clusters(signal_event, _default_scratch, clusters);
+        }
+
+
+
+        cluster_profile profile_beamcal_cluster(lcio::LCEvent* signal_event, const beamcal_cluster* cluster) {
+            if ( _default_scratch == NULL ) _default_scratch = new reconstruction_scratch();
+            return get_default_reconstructor()->profile_cluster(signal_event, cluster, _default_scratch);
+        }
+
+
+
+        overlay_efficiency reconstruct_beamcal_overlays(lcio::LCEvent* signal_event, int overlay_count) {
+            if ( _default_scratch == NULL ) _default_scratch = new reconstruction_scratch();
+            return get_default_reconstructor()->reconstruct_overlays(signal_event, overlay_count, _default_scratch);
+        }
     }
 }
@@ -1,18 +1,320 @@
 #ifndef BEAMCAL_RECONSTRUCTOR_H
 #define BEAMCAL_RECONSTRUCTOR_H
+#include <string>
 #include <vector>
-#include <unordered_map>
+#include <utility>
 #include "lcio.h"
+#include "background_database.h"
+#include "beamcal_scanner.h"
+#include "quantile_sketch.h"
+#include "cell_id_decoder.h"
 
 namespace scipp_ilc {
     namespace beamcal_recon {
-        typedef std::unordered_map<int,float> pixel_map;
+        struct pixel_statistics;
+        struct pixel_covariance;
+        struct seed_bounds;
+        struct background_cache_stream;
+        struct layer_tensor;
 
-        void initialize_beamcal_reconstructor(std::string geom_file_name, std::string bgd_list_file_name, int bgd_events_to_be_read);
-        extern std::vector<pixel_map*>* _database;
 
-        struct beamcal_cluster;
+
+        /*
+         * One signal hit's part in a pixel: the hit's place in the
+         * BeamCalHits collection, and the part of its energy that went to
+         * the pixel (less than all of it if the hit was spread out, or
+         * shared out by area).
+         */
+        struct pixel_hit {
+            int hit;
+            float share;
+        };
+
+
+
+        /*
+         * Which signal hits went into each pixel, as pixelation records
+         * them when hit recording is on (see set_hit_recording). The hits
+         * of pixel index i are hits[starts[positions[i]]] ...
+         * hits[starts[positions[i]+1]-1], in pixelation order; positions
+         * is -1 for every pixel the signal did not touch.
+         */
+        struct signal_hit_record {
+            //(pixel index, hit) as pixelated, before they are grouped
+            std::vector< std::pair<int,pixel_hit> > entries;
+
+            std::vector<pixel_hit> hits;
+            std::vector<int> starts;
+            std::vector<int> positions;
+            std::vector<int> pixels;    //the touched pixels, in order of their ranges
+        };
+
+
+
+        /*
+         * The signal hits that went into a cluster's pixels, summed up:
+         * their energy as deposited (without the layer weights), how it is
+         * spread over the layers, and its centroid (in the frame the pixels
+         * are laid out in).
+         */
+        struct cluster_profile {
+            float energy;
+            std::vector<float> layer_energies;
+            double centroid_x;
+            double centroid_y;
+        };
+
+
+
+        /*
+         * Working space of a single reconstruction: the overlay of the
+         * signal onto a background event and the scanner's scratch, plus
+         * what reconstruct_overlays() keeps between overlays. Each thread
+         * reconstructing events needs its own.
+         */
+        struct reconstruction_scratch {
+            background_overlay overlay;
+            scan_scratch scan;
+
+            //the signal collection's compiled cell ID encoding, and
+            //how the last signal event's hits fared in pixelation
+            cell_id_decoder decoder;
+            hit_cut_counts hit_cuts;
+
+            //the hits behind each pixel of the last signal
+            //reconstructed, if they are recorded
+            signal_hit_record hit_record;
+
+            //the signal's pixelated hits as (pixel index, energy), grouped
+            //by pixel; within a pixel they are kept in pixelation order
+            std::vector< std::pair<int,float> > signal_hits;
+
+            //the background event of each overlay in the current batch, and
+            //the combined energy of every signal pixel in each of them
+            //(pixel-major: one row of batch size per signal pixel)
+            std::vector<int> overlay_events;
+            std::vector<float> overlay_energies;
+        };
+
+
+
+        /*
+         * How a hit's energy is shared out among the radial pixels: all of
+         * it to the pixel under the hit's position, or to every pixel its
+         * square simulation cell overlaps, in proportion to the area.
+         */
+        enum pixelation_mode {
+            PIXELATION_POINT,
+            PIXELATION_CELL_AREA
+        };
+
+
+
+        /*
+         * How often a signal was found when laid over several background
+         * events, rather than just one.
+         */
+        struct overlay_efficiency {
+            int overlays;
+            int detections;
+            float detection_fraction;
+        };
+
+
+
+        /*
+         * A BeamCal reconstruction setup: its background database and
+         * statistics, the scanner settings, and the sigma cut calibrated
+         * from them. Any number of these can live side by side.
+         *
+         * Once initialize() is done, reconstruct() only reads the object,
+         * so events can be reconstructed from several threads at once,
+         * as long as each thread brings its own scratch.
+         *
+         * More background can be appended to a running reconstructor
+         * (append_background), in between reconstructions. Everything
+         * derived from the background is then updated from the new
+         * events alone, and the sigma cut is tracked by a quantile
+         * sketch rather than found from every event's significance.
+         *
+         * The background can also be kept with its layers apart (a layer
+         * tensor), so that it can be weighted over the layers differently
+         * later on (reweight_layers) without reading it in again.
+         *
+         * The geometry (see simple_list_geometry.h) is shared by every
+         * reconstructor in the process, and is only read after it has
+         * been initialized. It comes from the first reconstructor's
+         * geometry file; a different file given to a later one is
+         * reported as an error and ignored.
+         */
+        class beamcal_reconstructor {
+            public:
+                beamcal_reconstructor();
+                ~beamcal_reconstructor();
+
+                //these must be set before initialize()
+                void set_significance_backend(significance_backend backend);
+                void set_max_seeds(int max_seeds);
+                void set_clustering(cluster_strategy clustering);
+
+                //how many threads grow clusters from the seeds of each scan
+                //(the calibration, when spread over several threads, keeps
+                //to one per scan)
+                void set_seed_threads(int seed_threads);
+
+                //whether seeds whose cluster cannot beat the best one found
+                //are skipped, with CLUSTER_ONE_RING (on by default; like the
+                //seed threads, it can be changed between reconstructions)
+                void set_seed_pruning(bool prune);
+
+                //how significant a pixel must be on its own to be part
+                //of a region, with CLUSTER_REGIONS (2 by default)
+                void set_region_threshold(float region_threshold);
+
+                //seed of the generator choosing background events
+                void set_overlay_seed(unsigned long long seed);
+
+                //whether to compress the background database (see
+                //background_database::compress), the energy below which
+                //background pixels are dropped as they are read, and
+                //whether the database is kept out of core, in the
+                //memory-mapped cache file, rather than in memory (this
+                //needs a cache file, and stores it uncompressed)
+                void set_background_storage(bool compress, float zero_threshold = 0.0, bool out_of_core = false);
+
+                //how many background events have to be appended before the
+                //sigma cut is refreshed (0 to refresh it after every append)
+                void set_calibration_refresh(int events);
+
+                //how the hits of each beamcal layer are weighted when
+                //pixelated (by default, layers 6 to 39 count fully and
+                //the rest not at all), and whether the background is also
+                //kept layer by layer, so it can be re-weighted later on
+                //(the layers are not cached, so keeping them means the
+                //background is read anew, whatever the cache holds)
+                void set_layer_weights(const std::vector<float>& layer_weights);
+                void set_layer_window(int first_layer, int last_layer);
+                void set_layer_tensor(bool keep);
+
+                //must be set before initialize()
+                void set_pixelation(pixelation_mode mode);
+
+                //whether reconstruct() and reconstruct_clusters() record
+                //which signal hits went into each pixel, for profile_cluster
+                void set_hit_recording(bool record);
+
+                void initialize(std::string geom_file_name, std::string bgd_list_file_name, int bgd_events_to_be_read,
+                                std::string bgd_cache_file_name = "", int bgd_ingest_threads = 1,
+                                int calibration_threads = 1);
+
+                void append_background(std::string bgd_list_file_name, int bgd_events_to_be_read,
+                                        int bgd_ingest_threads = 1);
+                void refresh_calibration();
+                void reweight_layers(const std::vector<float>& layer_weights);
+
+                beamcal_cluster* reconstruct(lcio::LCEvent* signal_event, reconstruction_scratch* scratch) const;
+                void reconstruct_clusters(lcio::LCEvent* signal_event, reconstruction_scratch* scratch,
+                                            std::vector<beamcal_cluster*>* clusters) const;
+
+                //a cluster of the signal event last reconstructed with
+                //the scratch, from the hits recorded in it
+                cluster_profile profile_cluster(lcio::LCEvent* signal_event, const beamcal_cluster* cluster,
+                                                const reconstruction_scratch* scratch) const;
+
+                //overlay_count of 0 means every background event once
+                overlay_efficiency reconstruct_overlays(lcio::LCEvent* signal_event, int overlay_count,
+                                                        reconstruction_scratch* scratch) const;
+
+                void report_significance_check() const;
+                void report_hit_cuts() const;
+
+                const background_database* get_database() const { return _database; }
+                const layer_tensor* get_layer_tensor() const { return _layer_tensor; }
+                float get_sigma_cut() const { return _sigma_cut; }
+
+            private:
+                beamcal_reconstructor(const beamcal_reconstructor&) = delete;
+                beamcal_reconstructor& operator=(const beamcal_reconstructor&) = delete;
+
+                void release_background();
+                void process_background_events(std::string bgd_list_file_name, int max_events,
+                                                int ingest_threads, background_cache_stream* stream);
+                void compute_pixel_statistics();
+                bool generate_database(std::string bgd_list_file_name, int ingest_threads,
+                                        background_cache_stream* stream = NULL);
+                void complete_database();
+                void prepare_scan_background();
+                void scan_background_events(int first_event, int calibration_threads,
+                                            std::vector<float>* significances) const;
+                void calibrate_scanner(int calibration_threads);
+                background_overlay* overlay_signal(lcio::LCEvent* signal_event, reconstruction_scratch* scratch) const;
+                unsigned long long get_cache_key(std::string bgd_list_file_name) const;
+
+                int _num_bgd_events;
+                float _sigma_cut;
+                unsigned long long _overlay_seed;
+                bool _compress_background;
+                float _zero_threshold;
+                bool _out_of_core;
+
+                int _calibration_threads;
+                int _calibration_refresh;
+                int _calibrated_events;     //events the sigma cut has taken in
+                quantile_sketch _significance_sketch;
+
+                pixelation_mode _pixelation;
+                bool _record_hits;
+                std::vector<float> _layer_weights;  //one per layer
+                bool _keep_layer_tensor;
+                layer_tensor* _layer_tensor;
+
+                background_database* _database;
+
+                //per-pixel statistics, indexed by dense pixel index
+                pixel_statistics* _background_stats;
+                std::vector<double>* _energy_averages;
+                std::vector<double>* _energy_std_devs;
+
+                pixel_covariance* _covariance;
+                seed_bounds* _seed_bounds;
+                bool _seed_pruning;
+                significance_check_tally* _check_tally;
+
+                //how the hits of the background and signal events fared in
+                //pixelation; the signal tally is added to by reconstructions
+                hit_cut_counts _background_cuts;
+                hit_cut_tally* _signal_cuts;
+                scan_background _scan_background;
+        };
+
+
+
+        /*
+         * The original interface, which works on a single default
+         * reconstructor. reconstruct_beamcal_event() shares one scratch
+         * between all of its callers, so it must not be called from
+         * several threads at once; use beamcal_reconstructor for that.
+         */
+        void set_significance_backend(significance_backend backend);
+        void set_max_seeds(int max_seeds);
+        void set_clustering(cluster_strategy clustering);
+        void set_seed_threads(int seed_threads);
+        void set_seed_pruning(bool prune);
+        void set_region_threshold(float region_threshold);
+        void set_hit_recording(bool record);
+        void report_significance_check();
+        void report_hit_cuts();
+
+        void initialize_beamcal_reconstructor(std::string geom_file_name, std::string bgd_list_file_name, int bgd_events_to_be_read,
+                                                std::string bgd_cache_file_name = "", int bgd_ingest_threads = 1,
+                                                int calibration_threads = 1);
+        void append_beamcal_background(std::string bgd_list_file_name, int bgd_events_to_be_read,
+                                        int bgd_ingest_threads = 1);
+
         beamcal_cluster*  reconstruct_beamcal_event(lcio::LCEvent* signal_event);
+        void reconstruct_beamcal_clusters(lcio::LCEvent* signal_event, std::vector<beamcal_cluster*>* clusters);
+        cluster_profile profile_beamcal_cluster(lcio::LCEvent* signal_event, const beamcal_cluster* cluster);
+        overlay_efficiency reconstruct_beamcal_overlays(lcio::LCEvent* signal_event, int overlay_count);
     }
 }
 #endif
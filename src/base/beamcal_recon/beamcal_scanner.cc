@@ -1,12 +1,17 @@
 #include <iostream>
 #include <utility>
-#include <unordered_set>
+#include <climits>
 #include <cmath>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
 
 #include "beamcal_scanner.h"
-#include "beamcal_reconstructor.h"
 #include "simple_list_geometry.h"
+#include "pixel_covariance.h"
+#include "seed_bounds.h"
 
 
 using namespace std;
@@ -15,87 +20,144 @@ using namespace std;
 namespace scipp_ilc {
     namespace beamcal_recon {
 
+        //how far apart the two backends' significances may be in SIGNIFICANCE_CHECK
+        static const float _check_tolerance = 1e-3;
+
+        //how much the seed limits are loosened, to stay clear of
+        //rounding in the sums the scanner adds up in another order
+        static const double _limit_slack = 1e-4;
+
+
+
+        significance_check_tally::significance_check_tally() :
+            checked_clusters(0), mismatched_significances(0),
+            mismatched_weights(0), largest_significance_difference(0.0) {}
+
+
+
+        void significance_check_tally::report() {
+            lock_guard<mutex> guard(lock);
+            cout << "Significance check: " << checked_clusters << " clusters compared, "
+                 << mismatched_significances << " significance mismatches, "
+                 << mismatched_weights << " weight mismatches, "
+                 << "largest significance difference " << largest_significance_difference << endl;
+        }
+
+
+
+        scan_background::scan_background() :
+            database(NULL), averages(NULL), std_devs(NULL),
+            backend(SIGNIFICANCE_EXACT), covariance(NULL), check_tally(NULL),
+            max_seeds(50), clustering(CLUSTER_SEED_ONLY),
+            bounds(NULL), seed_threads(1), region_threshold(2.0) {}
+
 
 
         static bool compare_pair( pair<int,float> pair1, pair<int,float> pair2 ) {
             //Sort from greatest to least energy.
-            //Highest energy is zeroth element in list
-            return ( pair1.second > pair2.second );
+            //Highest energy is zeroth element in list.
+            //Ties go to the lower pixel index, so the order is fully determined.
+            if ( pair1.second != pair2.second ) return ( pair1.second > pair2.second );
+            return ( pair1.first < pair2.first );
         }
 
 
 
         /*
-         * Identifies the 50 highest (background-average subtracted) energy
-         * layer-compressed pixels. To do this, it first takes all the pixels
-         * from the pixel map, and loads them into a vector. The vector is
-         * then sorted by their (background-average subtracted) energy, and
-         * the top 50 highest are loaded into the seed map.
+         * Offer a hit pixel to the bounded heap of the best seeds found
+         * so far (whose top is the weakest of them). Pixels whose standard
+         * deviation is unusable (-1, hit only once in the background) are
+         * never seeds, so they are turned away before they ever get to the
+         * heap. Once the heap is full, a pixel only costs a comparison
+         * against the weakest seed.
          */
-        static void create_seed_list (pixel_map* pixels,
-                                        unordered_map<int,double>* average_map,
-                                        unordered_map<int,double>* std_dev_map,
-                                        unordered_map<int,float>* seed_list) {
-
-            //Read all pixels in the pixel map, get their bgd-avg subtracted
-            //energy, create an [ID,bgd-sub energy] pair, and load those
-            //pairs into a vector.
-            vector< pair<int, float> > sorted_pixels;
-            for (auto pixel : *pixels) { 
-                int ID = pixel.first;
-                float energy = pixel.second;
-                float bgd_subtracted_energy = energy - (*average_map)[ID];
-                pair<int,float> bgd_subtracted_pair( ID, bgd_subtracted_energy );
-                sorted_pixels.push_back(bgd_subtracted_pair);
-            }
-            sort(sorted_pixels.begin(), sorted_pixels.end(), compare_pair);
-
-            //Load the 50 highest bgd-sub energy pixels into the seed list,
-            //storing the pixels' significance as the hashmap's values.
-            int count = 0;
-            int maximum = 50;
-            for (auto bgd_subtracted_pixel : sorted_pixels) {
-                int ID = bgd_subtracted_pixel.first;
-                float bgd_subtracted_energy = bgd_subtracted_pixel.second;
-                float std_dev = (*std_dev_map)[ID];
-                if (std_dev == -1.0) { continue; }
-
-                float significance = 0.0;
-                significance = bgd_subtracted_energy / std_dev;
-                (*seed_list)[ID] = significance;
+        static void offer_seed(int index, float energy, const double* average, const double* std_dev,
+                                vector< pair<int,float> >* best_pixels, int maximum) {
+            if ( energy == 0.0 ) return;
+            if ( (float)std_dev[index] == -1.0 ) return;
 
-                count++;
-                if (count >= maximum) { break; }
+            pair<int,float> bgd_subtracted_pair( index, energy - average[index] );
+            if ( (int)best_pixels->size() < maximum ) {
+                best_pixels->push_back(bgd_subtracted_pair);
+                push_heap(best_pixels->begin(), best_pixels->end(), compare_pair);
+            } else if ( compare_pair(bgd_subtracted_pair, best_pixels->front()) ) {
+                pop_heap(best_pixels->begin(), best_pixels->end(), compare_pair);
+                best_pixels->back() = bgd_subtracted_pair;
+                push_heap(best_pixels->begin(), best_pixels->end(), compare_pair);
             }
         }
 
 
 
         /*
-         * Calculates the significance of a cluster made up of the IDs in ID_list. Every new cluster
-         * requires a new average and standard deviation be calculated, by finding the the energy sum
-         * of the cluster pixles in every pixel map in the database.
+         * Identifies the max_seeds (50 by default) highest (background-average
+         * subtracted) energy layer-compressed pixels, and loads them into the seed
+         * list as [pixel index, significance] pairs, highest energy first.
+         *
+         * This is done in a single pass over the hit pixels only: those of the
+         * background event the signal was laid over, then those the signal hit.
+         * Each one's bgd-avg subtracted energy is computed and offered to a
+         * bounded heap (see offer_seed). Since ties are broken by pixel index,
+         * the order the pixels are offered in does not change the seeds.
          */
-        float get_significance(vector<int>* ID_list, pixel_map* pixels, float& energy, double& average_background) {
+        static void create_seed_list (const scan_background& background, const background_overlay* pixels,
+                                        vector< pair<int,float> >* seed_list, scan_scratch* scratch) {
 
-            //Calculate average and std_dev for cluster
-            double total_background_energy = 0.0;
-            double total_squared_background_energy = 0.0;
-            int weight = 0;
-            for ( const pixel_map* stored_map : *_database ) {
+            int maximum = background.max_seeds;
+            if ( maximum <= 0 ) return;
 
-                double map_background_energy = 0.0;
-                for ( int ID : *ID_list ) {
-                    if ( stored_map->find(ID) != stored_map->end() ) {
-                        map_background_energy += stored_map->at(ID);
-                    }
+            const double* average = background.averages->data();
+            const double* std_dev = background.std_devs->data();
+
+            //[index,bgd-sub energy] pairs
+            vector< pair<int, float> > best_pixels;
+            best_pixels.reserve(maximum);
+
+            //the background pixels the signal did not touch
+            if ( pixels->event >= 0 ) {
+                const int* event_indices;
+                const float* event_energies;
+                int count = pixels->database->get_event(pixels->event, &event_indices, &event_energies,
+                                                        &scratch->hit_indices, &scratch->hit_energies);
+                for (int i = 0; i < count; i++) {
+                    int index = event_indices[i];
+                    if ( pixels->is_touched[index] ) continue;
+                    offer_seed(index, event_energies[i], average, std_dev, &best_pixels, maximum);
                 }
-                
-                if (map_background_energy != 0.0) weight++;
-                total_background_energy += map_background_energy;
-                total_squared_background_energy += map_background_energy*map_background_energy;
             }
 
+            //the pixels the signal touched
+            for ( int index : pixels->touched ) {
+                offer_seed(index, pixels->touched_energies[index], average, std_dev, &best_pixels, maximum);
+            }
+            sort_heap(best_pixels.begin(), best_pixels.end(), compare_pair);
+
+            //Load the highest bgd-sub energy pixels into the seed list,
+            //along with the pixels' significance.
+            for (auto bgd_subtracted_pixel : best_pixels) {
+                int index = bgd_subtracted_pixel.first;
+                float bgd_subtracted_energy = bgd_subtracted_pixel.second;
+
+                float significance = 0.0;
+                significance = bgd_subtracted_energy / (float)std_dev[index];
+                seed_list->push_back( pair<int,float>(index,significance) );
+            }
+        }
+
+
+
+        /*
+         * The significance of a cluster, given its background totals over the events:
+         * of its energy, of its energy squared, and the number of events in which it saw
+         * any energy (the weight). Every cluster has its own background average and
+         * standard deviation, since its energy in each event is the sum of its pixels'.
+         * The signal energy is only summed (onto energy, over the cluster's pixels)
+         * if there is any background to compare it to.
+         */
+        static float significance_from_totals(double total_background_energy, double total_squared_background_energy,
+                                                int weight, const int* cluster, int cluster_size,
+                                                const background_overlay* pixels, float& energy,
+                                                double& average_background) {
             if ( weight == 0 ) return 0.0;
 
             average_background = total_background_energy / weight;
@@ -105,7 +167,7 @@ namespace scipp_ilc {
 
 
             //calculate significance
-            for ( int ID : *ID_list ) energy += (*pixels)[ID];
+            for (int i = 0; i < cluster_size; i++) energy += pixels->get_energy(cluster[i]);
             if ( energy <= 0.0 ) return 0;
 
             float significance = (float) ( (energy-average_background) / standard_deviation );
@@ -116,50 +178,175 @@ namespace scipp_ilc {
 
 
         /*
-         * This function accrues all pixels adjacent to the pixel designated by "ID".
-         * Everytime it adds an adjacent pixel, it tests to see if the significance of
-         * the new, larger, cluster is larger than the significance before the it added
-         * the adjacent cluster. If it is not, the extra pixel is removed from the cluster,
-         * and the search around "ID" pixel continues.
+         * The significance of the cluster made up of the pixel indices in index_list,
+         * without going over the background events' energies.
+         * A cluster's per-event energy is the sum of its pixels' energies, so its total is the
+         * sum of the pixel totals, and its total of squares is the sum of the pairwise product
+         * totals over every pair of cluster pixels (k^2 table lookups). The weight (number of
+         * events in which the cluster has any energy) comes from the pixels' hit bitsets.
+         * Up to rounding, this gives exactly what the exact backend does (see growing_cluster).
+         */
+        static float covariance_significance(const scan_background& background, scan_scratch* scratch,
+                                            vector<int>* index_list, const background_overlay* pixels,
+                                            float& energy, double& average_background, int& weight_out) {
+            const pixel_covariance* covariance = background.covariance;
+            int cluster_size = index_list->size();
+            const int* cluster = index_list->data();
+
+            double total_background_energy = 0.0;
+            double total_squared_background_energy = 0.0;
+            for (int i = 0; i < cluster_size; i++) {
+                int index = cluster[i];
+                total_background_energy += covariance->totals[index];
+                total_squared_background_energy += covariance->squares[index];
+                for (int j = i+1; j < cluster_size; j++) {
+                    total_squared_background_energy += 2.0 * covariance->get_product(index, cluster[j],
+                                                                        &scratch->column_buffer, &scratch->partner_buffer);
+                }
+            }
+            int weight = covariance->count_hits(cluster, cluster_size);
+
+            weight_out = weight;
+            return significance_from_totals(total_background_energy, total_squared_background_energy, weight,
+                                            cluster, cluster_size, pixels, energy, average_background);
+        }
+
+
+
+        /*
+         * Keep score of how far the covariance backend's significance of a
+         * cluster is from the exact one, for SIGNIFICANCE_CHECK.
+         */
+        static void record_check(const scan_background& background, float closed_significance, int closed_weight,
+                                    float significance, int weight) {
+            double difference = fabs( (double)closed_significance - (double)significance );
+            double scale = max( 1.0, fabs( (double)significance ) );
+            significance_check_tally* tally = background.check_tally;
+            lock_guard<mutex> guard(tally->lock);
+            tally->checked_clusters++;
+            if ( closed_weight != weight ) tally->mismatched_weights++;
+            if ( difference > _check_tolerance*scale ) tally->mismatched_significances++;
+            if ( difference > tally->largest_significance_difference ) tally->largest_significance_difference = difference;
+        }
+
+
+
+        /*
+         * A cluster being grown out from a seed (see grow_cluster). Its
+         * background totals are kept up to date as pixels are taken in,
+         * so that trying one more pixel costs a single pass over that
+         * pixel's column of the database (or, for the covariance backend,
+         * over its hit bits and its pair sums with the cluster's pixels)
+         * instead of a pass over every column of the cluster.
          *
-         * This function can be made recursive by switching on a line of code (see below).
-         * Without recursion, the function will search the pixels immediately adjacent to it.
-         * With recursion turned on, it will search the pixels immediately adjacent to it, and
-         * upon succesfully adding a new adjacent pixel to the cluster, it will then see if it
-         * can add any pixels adjacent to the newly added pixel. And it will check the pixels
-         * adjacent to the pixel adjacent to the "ID" pixels, and so on.
+         * With the exact backend, each event's sum takes the pixels in the
+         * order they were taken in, and the sums are reduced in event
+         * order, so the totals come out the same as summing every column
+         * of the cluster over again. The pixels and per-event sums live in
+         * the scratch.
          */
-        static float cluster_seeker(int ID, float significance, vector<int>* ID_list, pixel_map* pixels,
-                                    unordered_set<int>* searched_IDs, float& energy, double& bgd) {
+        struct growing_cluster {
+            const scan_background* background;
+            const background_overlay* pixels;
+            scan_scratch* scratch;
+            int serial;
 
-            surrounding_ids* surroundings = (*_pixel_graph)[ID];
-            
-            int maximum_pixels = 4;
-            int current_pixels = 1;
-            for ( int neighbor_ID : *(surroundings->list) ) {
-                //searched_IDs->end() means that neighbor_ID was not found
-                if ( searched_IDs->find(neighbor_ID) != searched_IDs->end() ) continue;
-
-                ID_list->push_back(neighbor_ID);
-                float temp_energy = 0.0;
-                double temp_bgd = 0.0;
-                float new_significance = get_significance(ID_list,pixels,temp_energy,temp_bgd);
-
-                if (new_significance > significance) {
-                    searched_IDs->emplace(neighbor_ID);
-                    energy = temp_energy;
-                    bgd = temp_bgd;
-                    significance = new_significance;
-                    //To enable recursive clustering:
-                    //comment out the above line, and uncomment the below line 
-                    //significance = cluster_seeker(neighbor_ID,new_significance,ID_list,pixels,searched_IDs,energy,bgd);
-                    
-                    maximum_pixels++;
-                } else {
-                    ID_list->pop_back();
+            //background totals and signal energy of the cluster,
+            //and of the cluster with the pixel last tried added
+            double total;
+            double squared_total;
+            int weight;
+            float energy_sum;
+            double trial_total;
+            double trial_squared_total;
+            int trial_weight;
+            float trial_energy_sum;
+            bool trial_hit;     //whether the pixel last tried is ever hit
+
+            //what the scan reports for the cluster
+            float significance;
+            float energy;
+            double background_average;
+        };
+
+
+
+        /*
+         * Work out the significance of the cluster with one more pixel,
+         * along with the energy and background average to report for it,
+         * without changing the cluster.
+         */
+        static float try_pixel(growing_cluster* cluster, int index, float& energy, double& average_background) {
+            const scan_background& background = *cluster->background;
+            scan_scratch* scratch = cluster->scratch;
+            cluster->trial_energy_sum = cluster->energy_sum + cluster->pixels->get_energy(index);
+
+            if ( background.backend == SIGNIFICANCE_COVARIANCE ) {
+                const pixel_covariance* covariance = background.covariance;
+                double squared_total = cluster->squared_total + covariance->squares[index];
+                for ( int member : scratch->cluster ) {
+                    squared_total += 2.0 * covariance->get_product(index, member, &scratch->column_buffer,
+                                                                    &scratch->partner_buffer);
                 }
 
-                if (current_pixels > maximum_pixels) { break; }
+                const unsigned long long* hits = covariance->hit_bits.data() + (long long)index * covariance->hit_stride;
+                const unsigned long long* cluster_hits = scratch->cluster_hits.data();
+                unsigned long long* trial_hits = scratch->trial_hits.data();
+                int weight = 0;
+                for (int word = 0; word < covariance->hit_words; word++) {
+                    trial_hits[word] = cluster_hits[word] | hits[word];
+                    weight += __builtin_popcountll(trial_hits[word]);
+                }
+
+                cluster->trial_total = cluster->total + covariance->totals[index];
+                cluster->trial_squared_total = squared_total;
+                cluster->trial_weight = weight;
+            } else {
+                const float* column = background.database->get_column(index, &scratch->column_buffer);
+                cluster->trial_hit = ( column != NULL );
+                cluster->trial_total = cluster->total;
+                cluster->trial_squared_total = cluster->squared_total;
+                cluster->trial_weight = cluster->weight;
+
+                if ( column != NULL ) {
+                    int event_count = background.database->size();
+                    const double* event_energy = scratch->cluster_energies.data();
+                    double* trial_energy = scratch->trial_energies.data();
+                    double total_background_energy = 0.0;
+                    double total_squared_background_energy = 0.0;
+                    int weight = 0;
+                    for (int event = 0; event < event_count; event++) {
+                        double map_background_energy = event_energy[event] + column[event];
+                        trial_energy[event] = map_background_energy;
+
+                        if (map_background_energy != 0.0) weight++;
+                        total_background_energy += map_background_energy;
+                        total_squared_background_energy += map_background_energy*map_background_energy;
+                    }
+                    cluster->trial_total = total_background_energy;
+                    cluster->trial_squared_total = total_squared_background_energy;
+                    cluster->trial_weight = weight;
+                }
+            }
+
+            //the energy reported is only summed up if there is any
+            //background, but the running sum always is
+            energy = cluster->energy_sum;
+            average_background = 0.0;
+            float significance = significance_from_totals(cluster->trial_total, cluster->trial_squared_total,
+                                                            cluster->trial_weight, &index, 1, cluster->pixels,
+                                                            energy, average_background);
+            if ( cluster->trial_weight == 0 ) energy = 0.0;
+
+            if ( background.backend == SIGNIFICANCE_CHECK ) {
+                float closed_energy = 0.0;
+                double closed_background = 0.0;
+                int closed_weight = 0;
+                scratch->cluster.push_back(index);
+                float closed_significance = covariance_significance(background, scratch, &scratch->cluster,
+                                                                    cluster->pixels, closed_energy, closed_background, closed_weight);
+                scratch->cluster.pop_back();
+                record_check(background, closed_significance, closed_weight, significance, cluster->trial_weight);
             }
             return significance;
         }
@@ -167,49 +354,401 @@ namespace scipp_ilc {
 
 
         /*
-         * Identify the most "significant" ( (energy - bgd_average) / standard_deviation ) cluster.
+         * Take the pixel last tried into the cluster.
+         */
+        static void take_pixel(growing_cluster* cluster, int index) {
+            scan_scratch* scratch = cluster->scratch;
+            if ( cluster->background->backend == SIGNIFICANCE_COVARIANCE ) {
+                scratch->cluster_hits.swap(scratch->trial_hits);
+            } else if ( cluster->trial_hit ) {
+                scratch->cluster_energies.swap(scratch->trial_energies);
+            }
+
+            cluster->total = cluster->trial_total;
+            cluster->squared_total = cluster->trial_squared_total;
+            cluster->weight = cluster->trial_weight;
+            cluster->energy_sum = cluster->trial_energy_sum;
+            scratch->cluster.push_back(index);
+            scratch->searched[index] = cluster->serial;
+        }
+
+
+
+        /*
+         * Start a cluster off at a seed pixel, with the seed's own
+         * significance, energy and background average.
+         */
+        static void start_cluster(growing_cluster* cluster, int seed, float seed_significance) {
+            const scan_background& background = *cluster->background;
+            scan_scratch* scratch = cluster->scratch;
+
+            int pixel_count = background.averages->size();
+            if ( (int)scratch->searched.size() != pixel_count || scratch->search_serial == INT_MAX ) {
+                scratch->searched.assign(pixel_count, 0);
+                scratch->search_serial = 0;
+            }
+            cluster->serial = ++scratch->search_serial;
+
+            scratch->cluster.clear();
+            if ( background.backend == SIGNIFICANCE_COVARIANCE ) {
+                int hit_words = background.covariance->hit_words;
+                scratch->cluster_hits.assign(hit_words, 0);
+                scratch->trial_hits.resize(hit_words);
+            } else {
+                int event_count = background.database->size();
+                scratch->cluster_energies.assign(event_count, 0.0);
+                scratch->trial_energies.resize(event_count);
+            }
+            cluster->total = 0.0;
+            cluster->squared_total = 0.0;
+            cluster->weight = 0;
+            cluster->energy_sum = 0.0;
+
+            float energy;
+            double average_background;
+            try_pixel(cluster, seed, energy, average_background);
+            take_pixel(cluster, seed);
+
+            cluster->significance = seed_significance;
+            cluster->energy = cluster->pixels->get_energy(seed);
+            cluster->background_average = (*background.averages)[seed];
+        }
+
+
+
+        /*
+         * Grow the cluster over the neighbors of the given pixel: each one
+         * not in it yet is tried, and taken in if that raises the cluster's
+         * significance. In recursive growth, every pixel taken in has its
+         * own neighbors tried in turn, straight away, before the rest of
+         * the neighbors of the pixel it was reached from.
+         */
+        template <cluster_strategy strategy>
+        static void grow_cluster(growing_cluster* cluster, int index) {
+            const vector<int>& searched = cluster->scratch->searched;
+            for ( int neighbor : _pixel_graph->get(index) ) {
+                if ( searched[neighbor] == cluster->serial ) continue;
+
+                float energy;
+                double average_background;
+                float significance = try_pixel(cluster, neighbor, energy, average_background);
+                if ( significance > cluster->significance ) {
+                    take_pixel(cluster, neighbor);
+                    cluster->significance = significance;
+                    cluster->energy = energy;
+                    cluster->background_average = average_background;
+                    if ( strategy == CLUSTER_RECURSIVE ) grow_cluster<strategy>(cluster, neighbor);
+                }
+            }
+        }
+
+
+
+        /*
+         * The highest significance the cluster grown from a seed over one
+         * ring can reach. Its energy is at most the seed's plus that of
+         * every neighbor with any, and its background average and standard
+         * deviation are at least the seed's bounds (see seed_bounds).
+         */
+        static float seed_limit(const scan_background& background, const background_overlay* pixels,
+                                int index, float seed_significance) {
+            double energy = pixels->get_energy(index);
+            double magnitude = fabs(energy);
+            for ( int neighbor : _pixel_graph->get(index) ) {
+                double neighbor_energy = pixels->get_energy(neighbor);
+                if ( neighbor_energy > 0.0 ) {
+                    energy += neighbor_energy;
+                    magnitude += neighbor_energy;
+                }
+            }
+
+            double excess = energy + _limit_slack*magnitude - background.bounds->lowest_averages[index];
+            if ( excess <= 0.0 ) return seed_significance;
+            double limit = excess / background.bounds->lowest_std_devs[index] * (1.0 + _limit_slack);
+            return max( seed_significance, (float)limit );
+        }
+
+
+
+        /*
+         * List how significant the cluster of each seed can get: exactly
+         * the seed's significance if clusters are not grown, a bound on it
+         * for one ring if the bounds are up to date, and otherwise no limit.
+         */
+        template <cluster_strategy strategy>
+        static void list_seed_limits(const scan_background& background, const background_overlay* pixels,
+                                        const vector< pair<int,float> >* seed_list, scan_scratch* scratch) {
+            const seed_bounds* bounds = background.bounds;
+            bool bounded = ( strategy == CLUSTER_ONE_RING && bounds != NULL
+                             && bounds->event_count == background.database->size() );
+
+            vector<float>& limits = scratch->seed_limits;
+            limits.clear();
+            for ( auto seed : *seed_list ) {
+                if ( strategy == CLUSTER_SEED_ONLY ) limits.push_back(seed.second);
+                else if ( bounded ) limits.push_back( seed_limit(background, pixels, seed.first, seed.second) );
+                else limits.push_back(HUGE_VALF);
+            }
+
+            //NaN limits (of seeds whose significance is NaN, and so never
+            //chosen) go last
+            vector<int>& order = scratch->seed_order;
+            order.resize( limits.size() );
+            for (int position = 0; position < (int)order.size(); position++) order[position] = position;
+            stable_sort( order.begin(), order.end(), [&limits](int first, int second) {
+                return limits[first] > limits[second] || ( limits[first] == limits[first] && limits[second] != limits[second] );
+            } );
+        }
+
+
+
+        /*
+         * The seeds, shared out between the threads growing clusters from
+         * them, and the significance of the best cluster any of them has
+         * found so far.
+         */
+        struct seed_search {
+            const scan_background* background;
+            const background_overlay* pixels;
+            const vector< pair<int,float> >* seed_list;
+            const float* limits;
+            const int* order;       //positions in the seed list, highest limit first
+
+            atomic<int> next_seed;
+            atomic<float> best_significance;
+        };
+
+
+
+        //the best cluster one thread found, whose pixels are
+        //left in the best_cluster of the thread's scratch
+        struct seed_result {
+            float significance;
+            float energy;
+            double background_average;
+            int position;       //of its seed in the seed list
+        };
+
+
+
+        /*
+         * Take seeds off the list, highest limit first, and grow a cluster
+         * around each of them (as far as the strategy says), keeping the
+         * most significant. Once a seed's cluster can not get as
+         * significant as the best one found so far, by any thread, neither
+         * can those of the seeds after it, so the worker is done.
          *
-         * This is done by iterating over the seed pixels, clustering around those pixels
-         * (if you enable clustering that is), and selecting the cluster with the highest
-         * significance value.
+         * Of clusters equally significant, the one of the seed first in
+         * the seed list is kept.
          */
-        static beamcal_cluster* most_significant_cluster (pixel_map* pixels, unordered_map<int,float>* seed_list,
-                                                            unordered_map<int,double>* average_map) {
+        template <cluster_strategy strategy>
+        static void seed_worker(seed_search* search, scan_scratch* scratch, seed_result* result) {
+            const scan_background& background = *search->background;
+            const background_overlay* pixels = search->pixels;
 
-            vector<int>* chosen_cluster = NULL;
-            float chosen_significance = 0.0;
-            float chosen_energy = 0.0;
-            double chosen_bgd = 0.0;
+            result->significance = 0.0;
+            result->energy = 0.0;
+            result->background_average = 0.0;
+            result->position = -1;
 
-            for( auto seed : *seed_list ) {
-                int ID = seed.first;
-                float significance = seed.second;
-                float energy = (*pixels)[ID];
-                double bgd = (*average_map)[ID];
+            growing_cluster cluster;
+            cluster.background = &background;
+            cluster.pixels = pixels;
+            cluster.scratch = scratch;
 
-                unordered_set<int>* searched_IDs = new unordered_set<int>();
-                searched_IDs->emplace(ID);
+            int seed_count = search->seed_list->size();
+            for (int next = search->next_seed++; next < seed_count; next = search->next_seed++) {
+                int position = search->order[next];
+                if ( search->limits[position] < search->best_significance.load() ) break;
 
-                vector<int>* ID_list = new vector<int>();
-                ID_list->push_back(ID);
-                
+                int index = (*search->seed_list)[position].first;
+                float significance = (*search->seed_list)[position].second;
+                float energy = pixels->get_energy(index);
+                double bgd = (*background.averages)[index];
 
-                //uncomment the below line to enable pixel clustering
-                //significance = cluster_seeker(ID,significance,ID_list,pixels,searched_IDs,energy,bgd);
+                if ( strategy != CLUSTER_SEED_ONLY ) {
+                    start_cluster(&cluster, index, significance);
+                    grow_cluster<strategy>(&cluster, index);
+                    significance = cluster.significance;
+                    energy = cluster.energy;
+                    bgd = cluster.background_average;
+                }
 
                 //choose the most significant cluster
-                if ( significance > chosen_significance ) {
-                    delete chosen_cluster;
+                if ( significance > result->significance || ( significance == result->significance
+                                                               && position < result->position ) ) {
+                    result->significance = significance;
+                    result->energy = energy;
+                    result->background_average = bgd;
+                    result->position = position;
+                    if ( strategy == CLUSTER_SEED_ONLY ) scratch->best_cluster.assign(1, index);
+                    else scratch->best_cluster = scratch->cluster;
 
-                    chosen_significance = significance;
-                    chosen_cluster = ID_list;
-                    chosen_energy = energy;
-                    chosen_bgd = bgd;
+                    float best = search->best_significance.load();
+                    while ( significance > best && not search->best_significance.compare_exchange_weak(best, significance) );
+                }
+            }
+        }
 
-                } else {
-                    delete ID_list;
+
+
+        /*
+         * Threads that grow clusters beside the one scanning, kept for as
+         * long as its scratch is. Each scan hands them one round of work:
+         * the first active workers each run work on their own scratch and
+         * result, and the rest sit the round out.
+         */
+        struct seed_pool {
+            mutex lock;
+            condition_variable round_started;
+            condition_variable round_finished;
+            vector<thread> workers;
+            int round;
+            int busy;           //workers not yet done with this round
+            bool stopping;
+
+            void (*work)(seed_search*, scan_scratch*, seed_result*);
+            seed_search* search;
+            scan_scratch** scratches;
+            seed_result* results;
+            int active;
+
+            seed_pool() : round(0), busy(0), stopping(false) {}
+        };
+
+
+
+        /*
+         * Worker number i of the pool, which works on scratches[i+1] and
+         * results[i+1] (the scanning thread itself takes the first).
+         */
+        static void pool_worker(seed_pool* pool, int i) {
+            int round = 0;
+            while (true) {
+                unique_lock<mutex> lock(pool->lock);
+                pool->round_started.wait(lock, [&]{ return pool->stopping || pool->round != round; });
+                if ( pool->stopping ) return;
+                round = pool->round;
+                lock.unlock();
+
+                if ( i < pool->active ) pool->work(pool->search, pool->scratches[i+1], &pool->results[i+1]);
+
+                lock.lock();
+                pool->busy--;
+                if ( pool->busy == 0 ) pool->round_finished.notify_one();
+            }
+        }
+
+
+
+        scan_scratch::~scan_scratch() {
+            if ( seed_workers == NULL ) return;
+            {
+                lock_guard<mutex> lock(seed_workers->lock);
+                seed_workers->stopping = true;
+                seed_workers->round_started.notify_all();
+            }
+            for ( thread& worker : seed_workers->workers ) worker.join();
+            delete seed_workers;
+        }
+
+
+
+        /*
+         * Have the scratch's pool run work on the given number of
+         * threads besides the scanning one, starting any more threads
+         * it needs for that. finish_seed_round waits for them.
+         */
+        static void start_seed_round(scan_scratch* scratch, int active,
+                                        void (*work)(seed_search*, scan_scratch*, seed_result*),
+                                        seed_search* search, scan_scratch** scratches, seed_result* results) {
+            if ( scratch->seed_workers == NULL ) scratch->seed_workers = new seed_pool();
+            seed_pool* pool = scratch->seed_workers;
+
+            lock_guard<mutex> lock(pool->lock);
+            while ( (int)pool->workers.size() < active ) {
+                pool->workers.push_back( thread(pool_worker, pool, (int)pool->workers.size()) );
+            }
+            pool->work = work;
+            pool->search = search;
+            pool->scratches = scratches;
+            pool->results = results;
+            pool->active = active;
+            pool->busy = pool->workers.size();
+            pool->round++;
+            pool->round_started.notify_all();
+        }
+
+
+
+        static void finish_seed_round(scan_scratch* scratch) {
+            seed_pool* pool = scratch->seed_workers;
+            unique_lock<mutex> lock(pool->lock);
+            pool->round_finished.wait(lock, [&]{ return pool->busy == 0; });
+        }
+
+
+
+        /*
+         * Identify the most "significant" ( (energy - bgd_average) / standard_deviation ) cluster.
+         *
+         * This is done by iterating over the seed pixels, growing a cluster around each
+         * of them (as far as the strategy says), and selecting the cluster with the highest
+         * significance value.
+         *
+         * The seeds may be shared out between seed_threads threads (the scanning one and
+         * those of the scratch's pool), each with scratch of its own, and those whose cluster can not beat the best one found are skipped
+         * (see seed_limit). The best cluster of every thread is compared at the end; ties
+         * go to the seed first in the list, so the cluster chosen is the one going over
+         * every seed in list order, one by one, would choose.
+         */
+        template <cluster_strategy strategy>
+        static beamcal_cluster* most_significant_cluster (const scan_background& background, const background_overlay* pixels,
+                                                            vector< pair<int,float> >* seed_list, scan_scratch* scratch) {
+
+            list_seed_limits<strategy>(background, pixels, seed_list, scratch);
+
+            seed_search search;
+            search.background = &background;
+            search.pixels = pixels;
+            search.seed_list = seed_list;
+            search.limits = scratch->seed_limits.data();
+            search.order = scratch->seed_order.data();
+            search.next_seed = 0;
+            search.best_significance = 0.0;
+
+            int threads = background.seed_threads;
+            if ( strategy == CLUSTER_SEED_ONLY || threads > (int)seed_list->size() ) threads = seed_list->size();
+            if ( strategy == CLUSTER_SEED_ONLY || threads < 1 ) threads = 1;
+
+            vector<seed_result> results(threads);
+            vector<scan_scratch*> scratches(1, scratch);
+            for (int i = 1; i < threads; i++) {
+                if ( (int)scratch->seed_scratch.size() < i ) scratch->seed_scratch.emplace_back( new scan_scratch() );
+                scratches.push_back( scratch->seed_scratch[i-1].get() );
+            }
+
+            if ( threads > 1 ) {
+                start_seed_round(scratch, threads-1, seed_worker<strategy>, &search, scratches.data(), results.data());
+            }
+            seed_worker<strategy>(&search, scratch, &results[0]);
+            if ( threads > 1 ) finish_seed_round(scratch);
+
+            int chosen = 0;
+            for (int i = 1; i < threads; i++) {
+                if ( results[i].position < 0 ) continue;
+                if ( results[chosen].position < 0 || results[i].significance > results[chosen].significance
+                     || ( results[i].significance == results[chosen].significance
+                          && results[i].position < results[chosen].position ) ) {
+                    chosen = i;
                 }
-                delete searched_IDs;
+            }
+
+            vector<int>* chosen_cluster = NULL;
+            if ( results[chosen].position >= 0 ) {
+                //the outside world knows pixels by their ID, not their index
+                chosen_cluster = new vector<int>( scratches[chosen]->best_cluster );
+                for ( int& index : *chosen_cluster ) index = get_pixel_ID(index);
             }
 
             
@@ -219,35 +758,280 @@ namespace scipp_ilc {
             new_cluster = (beamcal_cluster*) malloc( sizeof(beamcal_cluster) );
 
             new_cluster->id_list = chosen_cluster;
-            new_cluster->significance = chosen_significance;
-            new_cluster->energy = chosen_energy;
-            new_cluster->background_average = chosen_bgd;
+            new_cluster->significance = results[chosen].significance;
+            new_cluster->energy = results[chosen].energy;
+            new_cluster->background_average = results[chosen].background_average;
+
+            return new_cluster;
+        }
+
+
+
+        /*
+         * Offer a hit pixel to the list of pixels above the region
+         * threshold, with its significance worked out as a seed's is.
+         * Besides the pixels that can not be seeds, those whose background
+         * never varied are left out: any energy at all would make them
+         * infinitely significant.
+         */
+        static void offer_region_pixel(int index, float energy, const double* average, const double* std_dev,
+                                        float threshold, vector< pair<int,float> >* region_pixels) {
+            if ( energy == 0.0 ) return;
+            if ( (float)std_dev[index] == -1.0 || (float)std_dev[index] == 0.0 ) return;
+
+            float bgd_subtracted_energy = energy - average[index];
+            float significance = bgd_subtracted_energy / (float)std_dev[index];
+            if ( significance > threshold ) region_pixels->push_back( pair<int,float>(index,significance) );
+        }
+
+
+
+        static int find_region(vector<int>& parents, int index) {
+            while ( parents[index] != index ) {
+                parents[index] = parents[ parents[index] ];
+                index = parents[index];
+            }
+            return index;
+        }
+
+
+
+        /*
+         * List the hit pixels above the region threshold, and join every
+         * two of them that are neighbors into the same region. Each region
+         * is rooted at its lowest pixel index, so regions and their pixels
+         * come out in index order once region_members is sorted.
+         */
+        static void label_regions(const scan_background& background, const background_overlay* pixels,
+                                    scan_scratch* scratch) {
+            const double* average = background.averages->data();
+            const double* std_dev = background.std_devs->data();
+            float threshold = background.region_threshold;
+            vector< pair<int,float> >& region_pixels = scratch->region_pixels;
+            region_pixels.clear();
+
+            //the background pixels the signal did not touch
+            if ( pixels->event >= 0 ) {
+                const int* event_indices;
+                const float* event_energies;
+                int count = pixels->database->get_event(pixels->event, &event_indices, &event_energies,
+                                                        &scratch->hit_indices, &scratch->hit_energies);
+                for (int i = 0; i < count; i++) {
+                    int index = event_indices[i];
+                    if ( pixels->is_touched[index] ) continue;
+                    offer_region_pixel(index, event_energies[i], average, std_dev, threshold, &region_pixels);
+                }
+            }
+
+            //the pixels the signal touched
+            for ( int index : pixels->touched ) {
+                offer_region_pixel(index, pixels->touched_energies[index], average, std_dev, threshold, &region_pixels);
+            }
+            sort( region_pixels.begin(), region_pixels.end() );
+
+            vector<int>& parents = scratch->region_parents;
+            int pixel_count = background.averages->size();
+            if ( (int)parents.size() != pixel_count ) parents.assign(pixel_count, -1);
+            for ( auto pixel : region_pixels ) parents[pixel.first] = pixel.first;
+
+            for ( auto pixel : region_pixels ) {
+                for ( int neighbor : _pixel_graph->get(pixel.first) ) {
+                    if ( parents[neighbor] < 0 ) continue;
+                    int root = find_region(parents, pixel.first);
+                    int neighbor_root = find_region(parents, neighbor);
+                    if ( root < neighbor_root ) parents[neighbor_root] = root;
+                    else if ( neighbor_root < root ) parents[root] = neighbor_root;
+                }
+            }
+
+            vector< pair<int,int> >& members = scratch->region_members;
+            members.clear();
+            for (int i = 0; i < (int)region_pixels.size(); i++) {
+                members.push_back( pair<int,int>( find_region(parents, region_pixels[i].first), i ) );
+            }
+            sort( members.begin(), members.end() );
+
+            //leave every pixel out of the forest again for the next scan
+            for ( auto pixel : region_pixels ) parents[pixel.first] = -1;
+        }
+
+
+
+        //a region's cluster: its pixels are region_members[first] ...
+        //region_members[first+size-1]
+        struct region_score {
+            float significance;
+            float energy;
+            double background_average;
+            int first;
+            int size;
+        };
+
+
+
+        /*
+         * Score every region as a cluster, and rank them, most significant
+         * first; ties go to the region with the lowest pixel index. Regions
+         * no more significant than 0 are left out, as the seeds' clusters
+         * are.
+         *
+         * A region of one pixel has that pixel's own significance. Larger
+         * regions take their background from the database's columns, as
+         * the exact backend does, whatever the backend: the pixels of a
+         * region are mostly too far apart for the covariance table.
+         */
+        static void score_regions(const scan_background& background, const background_overlay* pixels,
+                                    scan_scratch* scratch, vector<region_score>* scores) {
+            const vector< pair<int,float> >& region_pixels = scratch->region_pixels;
+            const vector< pair<int,int> >& members = scratch->region_members;
+            int event_count = background.database->size();
+
+            scores->clear();
+            int first = 0;
+            while ( first < (int)members.size() ) {
+                int size = 1;
+                while ( first+size < (int)members.size() && members[first+size].first == members[first].first ) size++;
+
+                region_score score;
+                score.first = first;
+                score.size = size;
+                if ( size == 1 ) {
+                    int index = region_pixels[ members[first].second ].first;
+                    score.significance = region_pixels[ members[first].second ].second;
+                    score.energy = pixels->get_energy(index);
+                    score.background_average = (*background.averages)[index];
+                } else {
+                    vector<int>& cluster = scratch->cluster;
+                    vector<double>& event_energy = scratch->cluster_energies;
+                    cluster.clear();
+                    event_energy.assign(event_count, 0.0);
+                    for (int i = first; i < first+size; i++) {
+                        int index = region_pixels[ members[i].second ].first;
+                        cluster.push_back(index);
+
+                        const float* column = background.database->get_column(index, &scratch->column_buffer);
+                        if ( column == NULL ) continue;
+                        for (int event = 0; event < event_count; event++) event_energy[event] += column[event];
+                    }
+
+                    double total_background_energy = 0.0;
+                    double total_squared_background_energy = 0.0;
+                    int weight = 0;
+                    for (int event = 0; event < event_count; event++) {
+                        double map_background_energy = event_energy[event];
+                        if (map_background_energy != 0.0) weight++;
+                        total_background_energy += map_background_energy;
+                        total_squared_background_energy += map_background_energy*map_background_energy;
+                    }
+
+                    score.energy = 0.0;
+                    score.background_average = 0.0;
+                    score.significance = significance_from_totals(total_background_energy, total_squared_background_energy,
+                                                                    weight, cluster.data(), size, pixels,
+                                                                    score.energy, score.background_average);
+                }
+                if ( score.significance > 0.0 ) scores->push_back(score);
+                first += size;
+            }
+
+            stable_sort( scores->begin(), scores->end(), [](const region_score& first, const region_score& second) {
+                return first.significance > second.significance;
+            } );
+        }
+
+
+
+        static beamcal_cluster* make_region_cluster(const region_score& score, const scan_scratch* scratch) {
+            //the outside world knows pixels by their ID, not their index
+            vector<int>* id_list = new vector<int>();
+            for (int i = score.first; i < score.first + score.size; i++) {
+                int index = scratch->region_pixels[ scratch->region_members[i].second ].first;
+                id_list->push_back( get_pixel_ID(index) );
+            }
+
+            beamcal_cluster* new_cluster;
+            new_cluster = (beamcal_cluster*) malloc( sizeof(beamcal_cluster) );
+
+            new_cluster->id_list = id_list;
+            new_cluster->significance = score.significance;
+            new_cluster->energy = score.energy;
+            new_cluster->background_average = score.background_average;
 
             return new_cluster;
         }
 
 
 
+        /*
+         * Find every cluster on the beamcal in one go, rather than only
+         * the most significant: the hit pixels more significant on their
+         * own than the region threshold are labeled by connected region
+         * over the pixel graph (with union-find), and each region is
+         * scored as a cluster (see score_regions).
+         *
+         * The clusters are listed most significant first. They belong to
+         * the caller, as scan_beamcal's cluster does.
+         */
+        void scan_beamcal_regions(const scan_background& background, const background_overlay* pixels, scan_scratch* scratch,
+                                    vector<beamcal_cluster*>* clusters) {
+            label_regions(background, pixels, scratch);
+
+            vector<region_score> scores;
+            score_regions(background, pixels, scratch, &scores);
+
+            clusters->clear();
+            for ( const region_score& score : scores ) clusters->push_back( make_region_cluster(score, scratch) );
+        }
+
+
+
         /*
          * Tries to identify the location of a signal event on the beamcal.
-         * It requires two hashmaps: an one the averages for every pixel,
-         * and one with the standard deviations for every pixel.
+         * It requires the background: the bgd events themselves, the averages
+         * for every pixel, and the standard deviations for every pixel.
          * The scanning process is done in two steps: First, it identifies a
          * number of "seed" pixels using a simple algorithm. Second, it uses
          * a more rigorous clustering algorithm on the chosen seed pixels.
          * This second algorithm will determine if a signal event is present,
-         * and return its location.
+         * and return its location. With CLUSTER_REGIONS there are no seeds:
+         * the most significant region (see scan_beamcal_regions) is returned.
+         *
+         * The pixels are a background event with the signal laid over it
+         * (see background_overlay), so nothing needs to be copied to scan
+         * it. Nothing but the scratch space is written to, so scans with
+         * separate scratch may run at the same time.
          */
-        beamcal_cluster* scan_beamcal(pixel_map* pixels, unordered_map<int,double>* average_map, 
-                                    unordered_map<int,double>* std_dev_map) {
+        beamcal_cluster* scan_beamcal(const scan_background& background, const background_overlay* pixels, scan_scratch* scratch) {
+
+            //the most significant region is the cluster
+            if ( background.clustering == CLUSTER_REGIONS ) {
+                label_regions(background, pixels, scratch);
+                vector<region_score> scores;
+                score_regions(background, pixels, scratch, &scores);
+                if ( not scores.empty() ) return make_region_cluster(scores[0], scratch);
+
+                beamcal_cluster* new_cluster = (beamcal_cluster*) malloc( sizeof(beamcal_cluster) );
+                new_cluster->id_list = NULL;
+                new_cluster->significance = 0.0;
+                new_cluster->energy = 0.0;
+                new_cluster->background_average = 0.0;
+                return new_cluster;
+            }
 
             //Step 1: identify seed pixels
-            unordered_map<int,float>* seed_list = new pixel_map();
-            create_seed_list(pixels,average_map,std_dev_map,seed_list);
+            vector< pair<int,float> >* seed_list = &scratch->seed_list;
+            seed_list->clear();
+            create_seed_list(background,pixels,seed_list,scratch);
 
             //Step 2: use more advanced clustering algorithm to find
             //signal event amid seed pixels.
-            return most_significant_cluster(pixels,seed_list,average_map);
+            if ( background.clustering == CLUSTER_ONE_RING ) {
+                return most_significant_cluster<CLUSTER_ONE_RING>(background,pixels,seed_list,scratch);
+            }
+            if ( background.clustering == CLUSTER_RECURSIVE ) {
+                return most_significant_cluster<CLUSTER_RECURSIVE>(background,pixels,seed_list,scratch);
+            }
+            return most_significant_cluster<CLUSTER_SEED_ONLY>(background,pixels,seed_list,scratch);
         }
     }
 }
@@ -1,13 +1,18 @@
 #ifndef BEAMCAL_SCANNER_H
 #define BEAMCAL_SCANNER_H
 
-#include <unordered_map>
 #include <vector>
+#include <utility>
+#include <mutex>
+#include <memory>
+
+#include "background_database.h"
 
 namespace scipp_ilc {
     namespace beamcal_recon {
 
         struct beamcal_cluster {
+            //pixel IDs (ring*_IDlimit + sector) of the cluster
             std::vector<int>* id_list;
             float significance;
             float energy;
@@ -20,8 +25,152 @@ namespace scipp_ilc {
 
 
 
-        beamcal_cluster* scan_beamcal(std::unordered_map<int,float>* pixels, std::unordered_map<int,double>* average_map, 
-                                    std::unordered_map<int,double>* std_dev_map);
+        //How the scanner gets a cluster's background mean and spread:
+        //by scanning every background event (exact), from the precomputed
+        //pixel pair sums (covariance), or both, reporting any disagreement
+        //and returning the exact result (check).
+        enum significance_backend {
+            SIGNIFICANCE_EXACT,
+            SIGNIFICANCE_COVARIANCE,
+            SIGNIFICANCE_CHECK
+        };
+
+        struct pixel_covariance;
+        struct seed_bounds;
+        struct seed_pool;
+
+
+
+        //How far the scanner grows a cluster out from each seed pixel:
+        //not at all (the seed alone), over the seed's neighbors, or on
+        //out from every neighbor it takes in, for as long as taking in
+        //a pixel raises the cluster's significance. Or, without seeds,
+        //every connected region of pixels significant enough on their
+        //own is a cluster (see scan_beamcal_regions).
+        enum cluster_strategy {
+            CLUSTER_SEED_ONLY,
+            CLUSTER_ONE_RING,
+            CLUSTER_RECURSIVE,
+            CLUSTER_REGIONS
+        };
+
+
+
+        /*
+         * Running tally of the SIGNIFICANCE_CHECK comparisons. Several
+         * scans may add to the same tally at once.
+         */
+        struct significance_check_tally {
+            std::mutex lock;
+            long long checked_clusters;
+            long long mismatched_significances;
+            long long mismatched_weights;
+            double largest_significance_difference;
+
+            significance_check_tally();
+            void report();
+        };
+
+
+
+        /*
+         * Everything a scan compares the beamcal against: the background
+         * events and their per-pixel statistics, plus how the scan goes
+         * about it. A scan only ever reads this, so any number of scans
+         * can share the same one at once.
+         */
+        struct scan_background {
+            const background_database* database;
+            const std::vector<double>* averages;
+            const std::vector<double>* std_devs;
+
+            significance_backend backend;
+            const pixel_covariance* covariance;     //unused by SIGNIFICANCE_EXACT
+            significance_check_tally* check_tally;  //only used by SIGNIFICANCE_CHECK
+
+            //number of seed pixels the scanner clusters around,
+            //and how it clusters around them
+            int max_seeds;
+            cluster_strategy clustering;
+
+            //bounds on how significant the cluster grown from each seed
+            //can get, to skip seeds that cannot beat the best cluster found
+            //(only used by CLUSTER_ONE_RING, and only if they are up to
+            //date with the database), and how many threads grow clusters
+            const seed_bounds* bounds;
+            int seed_threads;
+
+            //how significant a pixel must be on its own to be part of a
+            //region (see scan_beamcal_regions)
+            float region_threshold;
+
+            scan_background();
+        };
+
+
+
+        /*
+         * Working space of a single scan. Keeping one around (one per
+         * thread) saves reallocating it for every scan.
+         */
+        struct scan_scratch {
+            std::vector< std::pair<int,float> > seed_list;
+
+            //a background event, decoded (if the database is compressed)
+            std::vector<int> hit_indices;
+            std::vector<float> hit_energies;
+
+            //the cluster being grown, its energy in each background event
+            //(or, for the covariance backend, the union of its pixels' hit
+            //bits), and the same for the cluster with one more pixel
+            std::vector<int> cluster;
+            std::vector<double> cluster_energies;
+            std::vector<double> trial_energies;
+            std::vector<unsigned long long> cluster_hits;
+            std::vector<unsigned long long> trial_hits;
+            std::vector<float> column_buffer;
+            std::vector<float> partner_buffer;
+
+            //searched[index] == search_serial if the pixel is already
+            //part of the cluster grown from the current seed
+            std::vector<int> searched;
+            int search_serial;
+
+            //the most significant cluster grown here so far, how
+            //significant the cluster of each seed can get, and the
+            //order the seeds are taken in
+            std::vector<int> best_cluster;
+            std::vector<float> seed_limits;
+            std::vector<int> seed_order;
+
+            //scratch for the threads growing clusters beside this one,
+            //and the threads themselves, started by the first scan that
+            //needs them and kept until the scratch goes
+            std::vector< std::unique_ptr<scan_scratch> > seed_scratch;
+            seed_pool* seed_workers;
+
+            //the pixels above the region threshold (as [pixel index,
+            //significance] pairs, by index), the parent of each of them
+            //in the union-find forest (-1 for every other pixel), and
+            //each one's [region root, place in region_pixels], which
+            //sorted groups them by region
+            std::vector< std::pair<int,float> > region_pixels;
+            std::vector<int> region_parents;
+            std::vector< std::pair<int,int> > region_members;
+
+            scan_scratch() : search_serial(0), seed_workers(NULL) {}
+            ~scan_scratch();
+            scan_scratch(const scan_scratch&) = delete;
+            scan_scratch& operator=(const scan_scratch&) = delete;
+        };
+
+
+
+        beamcal_cluster* scan_beamcal(const scan_background& background, const background_overlay* pixels, scan_scratch* scratch);
+
+        //every region's cluster, most significant first
+        void scan_beamcal_regions(const scan_background& background, const background_overlay* pixels, scan_scratch* scratch,
+                                    std::vector<beamcal_cluster*>* clusters);
     }
 }
 #endif
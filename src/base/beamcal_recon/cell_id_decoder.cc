@@ -0,0 +1,126 @@
+#undef _GLIBCXX_USE_CXX11_ABI
+#define _GLIBCXX_USE_CXX11_ABI 0
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+
+#include "cell_id_decoder.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+
+
+        /*
+         * Each field of the encoding is "name:width" or "name:offset:width",
+         * a negative width marking a signed field. A field without an offset
+         * starts right after the one before it.
+         *
+         * Returns whether the encoding has a layer field; has_cell_xy
+         * tells whether it has both cell index fields.
+         */
+        bool cell_id_decoder::compile(const string& new_encoding) {
+            if ( compiled && new_encoding == encoding ) return has_layer;
+            encoding = new_encoding;
+            compiled = true;
+            has_layer = false;
+            has_cell_xy = false;
+            bool has_x = false, has_y = false;
+
+            int offset = 0;
+            stringstream fields(encoding);
+            string field;
+            while ( getline(fields, field, ',') ) {
+                vector<string> parts;
+                stringstream field_parts(field);
+                string part;
+                while ( getline(field_parts, part, ':') ) {
+                    part.erase( 0, part.find_first_not_of(" \t") );
+                    part.erase( part.find_last_not_of(" \t") + 1 );
+                    parts.push_back(part);
+                }
+                if ( parts.size() < 2 or parts.size() > 3 ) {
+                    cout << "Unable to read cell ID field \"" << field << "\" of encoding " << encoding << endl;
+                    has_layer = false;
+                    return false;
+                }
+                if ( parts.size() == 3 ) offset = atoi( parts[1].c_str() );
+                int width = atoi( parts.back().c_str() );
+
+                cell_id_field decoded;
+                decoded.offset = offset;
+                decoded.width = abs(width);
+                decoded.is_signed = ( width < 0 );
+                if ( decoded.width == 0 || offset < 0 || offset + decoded.width > 64 ) {
+                    cout << "Cell ID field \"" << field << "\" of encoding " << encoding
+                         << " does not fit in 64 bits\n";
+                    has_layer = false;
+                    return false;
+                }
+                decoded.mask = ( decoded.width == 64 ) ? ~0ULL : ( 1ULL << decoded.width ) - 1;
+
+                if ( parts[0] == "layer" ) {
+                    layer = decoded;
+                    has_layer = true;
+                } else if ( parts[0] == "x" ) {
+                    cell_x = decoded;
+                    has_x = true;
+                } else if ( parts[0] == "y" ) {
+                    cell_y = decoded;
+                    has_y = true;
+                }
+                offset += decoded.width;
+            }
+            has_cell_xy = has_x && has_y;
+
+            if ( not has_layer ) cout << "Cell ID encoding " << encoding << " has no layer field\n";
+            return has_layer;
+        }
+
+
+
+        void hit_cut_counts::reset() {
+            hits = 0;
+            negative_z = 0;
+            layer = 0;
+            radius = 0;
+        }
+
+
+
+        void hit_cut_counts::add(const hit_cut_counts& other) {
+            hits += other.hits;
+            negative_z += other.negative_z;
+            layer += other.layer;
+            radius += other.radius;
+        }
+
+
+
+        void hit_cut_counts::report(string what) const {
+            cout << what << " hits: " << hits << " read, "
+                 << negative_z << " cut on z < 0, "
+                 << layer << " cut on layer, "
+                 << radius << " cut on radius, "
+                 << hits - negative_z - layer - radius << " pixelated\n";
+        }
+
+
+
+        void hit_cut_tally::add(const hit_cut_counts& other) {
+            lock_guard<mutex> guard(lock);
+            counts.add(other);
+        }
+
+
+
+        void hit_cut_tally::report(string what) {
+            lock_guard<mutex> guard(lock);
+            counts.report(what);
+        }
+    }
+}
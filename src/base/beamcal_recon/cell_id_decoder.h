@@ -0,0 +1,85 @@
+#ifndef CELL_ID_DECODER_H
+#define CELL_ID_DECODER_H
+
+#include <string>
+#include <mutex>
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        /*
+         * A single field of a 64 bit cell ID, as a shift and a mask.
+         * Signed fields are sign extended.
+         */
+        struct cell_id_field {
+            int offset;
+            int width;
+            bool is_signed;
+            unsigned long long mask;
+
+            long long decode(unsigned long long cell_id) const {
+                unsigned long long value = (cell_id >> offset) & mask;
+                if ( is_signed && ( value >> (width-1) ) ) value |= ~mask;
+                return (long long)value;
+            }
+        };
+
+
+
+        /*
+         * The fields of a collection's cell ID encoding string (such as
+         * "system:8,barrel:3,layer:8,slice:5,x:32:-16,y:-16"), compiled
+         * into shifts and masks, so that decoding a hit's layer takes no
+         * string lookups. Only the fields the pixelation needs are kept:
+         * the layer, and the x and y indices of the hit's square cell.
+         *
+         * Compiling the encoding string it already holds does nothing, so
+         * a decoder can be handed every collection's string, and only does
+         * any work when the encoding changes.
+         */
+        struct cell_id_decoder {
+            std::string encoding;
+            bool compiled;
+            bool has_layer;
+            bool has_cell_xy;
+            cell_id_field layer;
+            cell_id_field cell_x;
+            cell_id_field cell_y;
+
+            cell_id_decoder() : compiled(false), has_layer(false), has_cell_xy(false) {}
+
+            bool compile(const std::string& new_encoding);
+        };
+
+
+
+        /*
+         * How many beamcal hits pixelation went through, and how many of
+         * them each cut threw out, in the order the cuts are made.
+         */
+        struct hit_cut_counts {
+            long long hits;
+            long long negative_z;
+            long long layer;
+            long long radius;
+
+            hit_cut_counts() { reset(); }
+
+            void reset();
+            void add(const hit_cut_counts& other);
+            void report(std::string what) const;
+        };
+
+
+
+        //hit cut counts added to from several threads at once
+        struct hit_cut_tally {
+            std::mutex lock;
+            hit_cut_counts counts;
+
+            void add(const hit_cut_counts& other);
+            void report(std::string what);
+        };
+    }
+}
+#endif
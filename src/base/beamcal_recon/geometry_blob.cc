@@ -0,0 +1,248 @@
+#undef _GLIBCXX_USE_CXX11_ABI
+#define _GLIBCXX_USE_CXX11_ABI 0
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "background_cache.h"
+#include "geometry_blob.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+/*
+ * Parsing the geometry file and deriving the pixel index and pixel graph
+ * from it is the same work every job, so the first job to read a geometry
+ * file compiles the result into a binary blob next to it, which later jobs
+ * just memory-map.
+ *
+ * Like the background cache, the blob is a blob_header followed by one
+ * section per table, each written out as it is in memory. The header
+ * carries a key fingerprinting the geometry file it was compiled from, so
+ * that editing the file (or changing the format) makes the blob stale.
+ */
+
+        static const char _blob_magic[8] = {'B','C','A','L','G','E','O','\0'};
+        static const unsigned int _blob_version = 2;
+
+        static const long long _blob_alignment = 64;
+
+        //the sections, in the order they are laid out in the file
+        enum blob_section_id {
+            RING_RADII_SECTION,
+            SECTOR_COUNTS_SECTION,
+            RING_OFFSETS_SECTION,
+            NEIGHBOR_OFFSETS_SECTION,
+            NEIGHBORS_SECTION,
+            HALF_TURN_SECTION,
+            CENTERS_SECTION,
+            AREAS_SECTION,
+            BLOB_SECTION_COUNT
+        };
+
+        struct blob_section {
+            long long start;
+            long long bytes;
+        };
+
+        struct blob_header {
+            char magic[8];
+            unsigned int version;
+            float sector_offset;
+            unsigned long long key;
+            long long ring_count;
+            long long pixel_count;
+            long long neighbor_count;
+            blob_section sections[BLOB_SECTION_COUNT];
+        };
+
+
+
+        /*
+         * Fingerprint the geometry file by its name, size and
+         * modification time, as the background cache does its inputs.
+         */
+        unsigned long long hash_geometry_file(string geom_file_name) {
+            unsigned long long hash = 14695981039346656037ULL;
+            hash = hash_value(hash, _blob_version);
+            hash = hash_bytes(hash, geom_file_name.c_str(), geom_file_name.size()+1);
+
+            struct stat file_status;
+            if ( stat(geom_file_name.c_str(), &file_status) == 0 ) {
+                long long file_size = file_status.st_size;
+                long long file_time = file_status.st_mtime;
+                hash = hash_value(hash, file_size);
+                hash = hash_value(hash, file_time);
+            }
+            return hash;
+        }
+
+
+
+        /*
+         * Check that every section lies within the file and has
+         * the size the header's counts call for.
+         */
+        static bool check_blob_sections(const blob_header& header, long long file_size) {
+            long long expected[BLOB_SECTION_COUNT];
+            expected[RING_RADII_SECTION] = header.ring_count*sizeof(float);
+            expected[SECTOR_COUNTS_SECTION] = header.ring_count*sizeof(short);
+            expected[RING_OFFSETS_SECTION] = (header.ring_count+1)*sizeof(int);
+            expected[NEIGHBOR_OFFSETS_SECTION] = (header.pixel_count+1)*sizeof(int);
+            expected[NEIGHBORS_SECTION] = header.neighbor_count*sizeof(int);
+            expected[HALF_TURN_SECTION] = header.pixel_count*sizeof(int);
+            expected[CENTERS_SECTION] = 2*header.pixel_count*sizeof(double);
+            expected[AREAS_SECTION] = header.pixel_count*sizeof(double);
+
+            for (int section = 0; section < BLOB_SECTION_COUNT; section++) {
+                const blob_section& part = header.sections[section];
+                if ( part.start < (long long)sizeof(blob_header) || part.start % _blob_alignment != 0 ) return false;
+                if ( part.start + part.bytes > file_size ) return false;
+                if ( part.bytes != expected[section] ) return false;
+            }
+            return true;
+        }
+
+
+
+        template<typename T>
+        static void map_section(database_array<T>* array, const char* base, const blob_section& section) {
+            array->map( (const T*) (base + section.start), section.bytes / sizeof(T) );
+        }
+
+
+
+        /*
+         * Memory-map the blob, and if it was compiled from the same
+         * geometry file (same key), point the tables at it. The ring
+         * tables are small, and copied out. Returns false if the blob
+         * could not be used, in which case nothing has been loaded.
+         */
+        bool read_geometry_blob(string blob_file_name, unsigned long long key, geometry_tables* tables) {
+            int fd = open(blob_file_name.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat file_status;
+            if ( fstat(fd, &file_status) != 0 || (size_t)file_status.st_size < sizeof(blob_header) ) {
+                close(fd);
+                return false;
+            }
+            size_t file_size = file_status.st_size;
+
+            void* mapping = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                cout << "Unable to map geometry blob " << blob_file_name << endl;
+                return false;
+            }
+            const char* base = (const char*) mapping;
+
+            blob_header header;
+            memcpy(&header, base, sizeof(blob_header));
+
+            bool valid = true;
+            if ( memcmp(header.magic, _blob_magic, sizeof(_blob_magic)) != 0 ) valid = false;
+            else if ( header.version != _blob_version ) valid = false;
+            else if ( header.key != key ) valid = false;
+            else if ( header.ring_count <= 0 || header.pixel_count <= 0 || header.neighbor_count < 0 ) valid = false;
+            else if ( not check_blob_sections(header, file_size) ) valid = false;
+
+            if (not valid) {
+                cout << "Geometry blob " << blob_file_name << " is stale, recompiling it\n";
+                munmap(mapping, file_size);
+                return false;
+            }
+
+            const blob_section* sections = header.sections;
+            const float* radii = (const float*) (base + sections[RING_RADII_SECTION].start);
+            const short* sector_counts = (const short*) (base + sections[SECTOR_COUNTS_SECTION].start);
+            tables->sector_offset = header.sector_offset;
+            tables->ring_radii.assign( radii, radii + header.ring_count );
+            tables->sector_counts.assign( sector_counts, sector_counts + header.ring_count );
+
+            map_section( &tables->ring_offsets, base, sections[RING_OFFSETS_SECTION] );
+            map_section( &tables->neighbor_offsets, base, sections[NEIGHBOR_OFFSETS_SECTION] );
+            map_section( &tables->neighbors, base, sections[NEIGHBORS_SECTION] );
+            map_section( &tables->half_turn_indices, base, sections[HALF_TURN_SECTION] );
+            map_section( &tables->pixel_centers, base, sections[CENTERS_SECTION] );
+            map_section( &tables->pixel_areas, base, sections[AREAS_SECTION] );
+            tables->mapping = shared_ptr<const void>( mapping,
+                                    [file_size](const void* data) { munmap((void*)data, file_size); } );
+            return true;
+        }
+
+
+
+        /*
+         * Write the tables out to the blob, under a temporary name
+         * first, so that concurrent jobs never see a half-written blob.
+         */
+        bool write_geometry_blob(string blob_file_name, unsigned long long key, const geometry_tables& tables) {
+            blob_header header;
+            memset(&header, 0, sizeof(blob_header));
+            memcpy(header.magic, _blob_magic, sizeof(_blob_magic));
+            header.version = _blob_version;
+            header.key = key;
+            header.sector_offset = tables.sector_offset;
+            header.ring_count = tables.ring_radii.size();
+            header.pixel_count = tables.pixel_areas.size();
+            header.neighbor_count = tables.neighbors.size();
+
+            const void* data[BLOB_SECTION_COUNT];
+            blob_section* sections = header.sections;
+            data[RING_RADII_SECTION] = tables.ring_radii.data();
+            sections[RING_RADII_SECTION].bytes = tables.ring_radii.size()*sizeof(float);
+            data[SECTOR_COUNTS_SECTION] = tables.sector_counts.data();
+            sections[SECTOR_COUNTS_SECTION].bytes = tables.sector_counts.size()*sizeof(short);
+            data[RING_OFFSETS_SECTION] = tables.ring_offsets.data();
+            sections[RING_OFFSETS_SECTION].bytes = tables.ring_offsets.size()*sizeof(int);
+            data[NEIGHBOR_OFFSETS_SECTION] = tables.neighbor_offsets.data();
+            sections[NEIGHBOR_OFFSETS_SECTION].bytes = tables.neighbor_offsets.size()*sizeof(int);
+            data[NEIGHBORS_SECTION] = tables.neighbors.data();
+            sections[NEIGHBORS_SECTION].bytes = tables.neighbors.size()*sizeof(int);
+            data[HALF_TURN_SECTION] = tables.half_turn_indices.data();
+            sections[HALF_TURN_SECTION].bytes = tables.half_turn_indices.size()*sizeof(int);
+            data[CENTERS_SECTION] = tables.pixel_centers.data();
+            sections[CENTERS_SECTION].bytes = tables.pixel_centers.size()*sizeof(double);
+            data[AREAS_SECTION] = tables.pixel_areas.data();
+            sections[AREAS_SECTION].bytes = tables.pixel_areas.size()*sizeof(double);
+
+            long long position = sizeof(blob_header);
+            for (int section = 0; section < BLOB_SECTION_COUNT; section++) {
+                position = (position + _blob_alignment - 1) / _blob_alignment * _blob_alignment;
+                sections[section].start = position;
+                position += sections[section].bytes;
+            }
+
+            string temp_file_name = blob_file_name + ".tmp." + to_string( getpid() );
+            int fd = open(temp_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                cout << "Unable to write geometry blob " << blob_file_name << endl;
+                return false;
+            }
+
+            bool written = ftruncate(fd, position) == 0;
+            written = written && write_bytes(fd, &header, sizeof(blob_header), 0);
+            for (int section = 0; section < BLOB_SECTION_COUNT; section++) {
+                written = written && write_bytes(fd, data[section], sections[section].bytes, sections[section].start);
+            }
+            written = ( close(fd) == 0 ) && written;
+
+            if ( not written || rename(temp_file_name.c_str(), blob_file_name.c_str()) != 0 ) {
+                cout << "Unable to write geometry blob " << blob_file_name << endl;
+                remove(temp_file_name.c_str());
+                return false;
+            }
+            cout << "Compiled the geometry into " << blob_file_name << endl;
+            return true;
+        }
+    }
+}
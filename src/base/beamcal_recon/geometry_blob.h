@@ -0,0 +1,54 @@
+#ifndef GEOMETRY_BLOB_H
+#define GEOMETRY_BLOB_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "background_database.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        /*
+         * Everything the geometry is made of: the layout as given in the
+         * geometry file (ring radii, sector counts and sector offset), and
+         * the tables derived from it. The pixels are numbered by dense
+         * index (see simple_list_geometry.h).
+         *
+         * > ring_offsets[r] is the index of ring r's first pixel, and
+         *   ring_offsets[last ring + 1] the pixel count,
+         * > the neighbors of pixel i (by index, in the order of the pixel
+         *   graph) are neighbors[neighbor_offsets[i]] ...
+         *   neighbors[neighbor_offsets[i+1]-1], and half_turn_indices[i]
+         *   is where the outer ones start,
+         * > pixel i is centered on (pixel_centers[2i], pixel_centers[2i+1]),
+         *   and covers pixel_areas[i] square millimeters.
+         *
+         * Read from a geometry blob, the derived tables stay mapped.
+         */
+        struct geometry_tables {
+            float sector_offset;
+            std::vector<float> ring_radii;
+            std::vector<short> sector_counts;
+
+            database_array<int> ring_offsets;
+            database_array<int> neighbor_offsets;
+            database_array<int> neighbors;
+            database_array<int> half_turn_indices;
+            database_array<double> pixel_centers;
+            database_array<double> pixel_areas;
+
+            std::shared_ptr<const void> mapping;
+
+            geometry_tables() : sector_offset(0.0) {}
+        };
+
+        //fingerprint of the geometry file the blob is compiled from
+        unsigned long long hash_geometry_file(std::string geom_file_name);
+
+        bool read_geometry_blob(std::string blob_file_name, unsigned long long key, geometry_tables* tables);
+        bool write_geometry_blob(std::string blob_file_name, unsigned long long key, const geometry_tables& tables);
+    }
+}
+#endif
@@ -0,0 +1,199 @@
+#include <algorithm>
+
+#include "layer_tensor.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+
+
+        void layered_event::reset(int pixel_count, int layers) {
+            layer_count = layers;
+            energies.assign( (long long)pixel_count * layer_count, 0.0 );
+            is_touched.assign(pixel_count, 0);
+            touched.clear();
+        }
+
+
+
+        void layered_event::clear() {
+            for ( int index : touched ) {
+                is_touched[index] = 0;
+                fill( energies.begin() + (long long)index * layer_count,
+                      energies.begin() + (long long)(index+1) * layer_count, 0.0 );
+            }
+            touched.clear();
+        }
+
+
+
+        void layered_event::add_energy(int index, int layer, float energy) {
+            if ( not is_touched[index] ) {
+                is_touched[index] = 1;
+                touched.push_back(index);
+            }
+            energies[ (long long)index * layer_count + layer ] += energy;
+        }
+
+
+
+        /*
+         * Append a pixelated event, keeping each hit pixel's layers from
+         * the first to the last one with any energy. Pixels that end up
+         * without energy in any layer are left out, as in the database.
+         */
+        void layer_tensor::add_event(const layered_event& event) {
+            layer_count = event.layer_count;
+
+            vector<int> hit_pixels( event.touched );
+            sort( hit_pixels.begin(), hit_pixels.end() );
+            for ( int index : hit_pixels ) {
+                const float* layers = event.energies.data() + (long long)index * layer_count;
+                int first = 0, last = layer_count-1;
+                while ( first < layer_count && layers[first] == 0.0 ) first++;
+                if ( first == layer_count ) continue;
+                while ( layers[last] == 0.0 ) last--;
+
+                float sum = 0.0;
+                for (int layer = first; layer <= last; layer++) {
+                    sum += layers[layer];
+                    layer_sums.push_back(sum);
+                }
+                indices.push_back(index);
+                first_layers.push_back(first);
+                row_offsets.push_back( layer_sums.size() );
+            }
+            offsets.push_back( indices.size() );
+        }
+
+
+
+        /*
+         * Append every event of another tensor, in order.
+         */
+        void layer_tensor::append(const layer_tensor& other) {
+            if ( other.size() == 0 ) return;
+            layer_count = other.layer_count;
+
+            long long base = indices.size();
+            long long row_base = layer_sums.size();
+            indices.insert( indices.end(), other.indices.begin(), other.indices.end() );
+            first_layers.insert( first_layers.end(), other.first_layers.begin(), other.first_layers.end() );
+            layer_sums.insert( layer_sums.end(), other.layer_sums.begin(), other.layer_sums.end() );
+            for (unsigned int hit = 1; hit < other.row_offsets.size(); hit++) {
+                row_offsets.push_back( row_base + other.row_offsets[hit] );
+            }
+            for (int event = 1; event <= other.size(); event++) {
+                offsets.push_back( base + other.offsets[event] );
+            }
+        }
+
+
+
+        /*
+         * Drop every event past the first event_count.
+         */
+        void layer_tensor::truncate(int event_count) {
+            if ( event_count >= size() ) return;
+            offsets.resize(event_count+1);
+            indices.resize( offsets.back() );
+            first_layers.resize( offsets.back() );
+            row_offsets.resize( offsets.back()+1 );
+            layer_sums.resize( row_offsets.back() );
+        }
+
+
+
+        /*
+         * Energy of a hit pixel with each layer weighted
+         * by layer_weights[layer].
+         */
+        float layer_tensor::get_energy(long long hit, const vector<float>& layer_weights) const {
+            const float* sums = layer_sums.data() + row_offsets[hit];
+            int length = row_offsets[hit+1] - row_offsets[hit];
+            const float* weights = layer_weights.data() + first_layers[hit];
+
+            float energy = 0.0;
+            float previous = 0.0;
+            for (int i = 0; i < length; i++) {
+                energy += weights[i] * (sums[i] - previous);
+                previous = sums[i];
+            }
+            return energy;
+        }
+
+
+
+        /*
+         * Energy of a hit pixel between two layers (inclusive).
+         */
+        float layer_tensor::get_window_energy(long long hit, int first_layer, int last_layer) const {
+            const float* sums = layer_sums.data() + row_offsets[hit];
+            int length = row_offsets[hit+1] - row_offsets[hit];
+            int first = first_layers[hit];
+
+            //the running sum up to the end of the window, less
+            //the running sum up to just before its start
+            int end = min(last_layer - first, length-1);
+            if ( end < 0 ) return 0.0;
+            float energy = sums[end];
+            int before = min(first_layer - first - 1, length-1);
+            if ( before >= 0 ) energy -= sums[before];
+            return energy;
+        }
+
+
+
+        /*
+         * Set the energy of each of the event's hit pixels in pixels (which
+         * must be large enough), with the layers weighted by layer_weights
+         * (one weight per layer). If the weights just pick out a window of
+         * layers, each pixel takes a single subtraction; otherwise a pass
+         * along its row.
+         */
+        void layer_tensor::get_event(int event, const vector<float>& layer_weights, pixel_map* pixels) const {
+            int first_layer = 0, last_layer = layer_count-1;
+            while ( first_layer < layer_count && layer_weights[first_layer] == 0.0 ) first_layer++;
+            while ( last_layer >= first_layer && layer_weights[last_layer] == 0.0 ) last_layer--;
+            bool window = true;
+            for (int layer = first_layer; layer <= last_layer; layer++) {
+                if ( layer_weights[layer] != 1.0 ) window = false;
+            }
+
+            for (long long hit = offsets[event]; hit < offsets[event+1]; hit++) {
+                if (window) (*pixels)[ indices[hit] ] = get_window_energy(hit, first_layer, last_layer);
+                else (*pixels)[ indices[hit] ] = get_energy(hit, layer_weights);
+            }
+        }
+
+
+
+        /*
+         * Derive a database from the tensor, with the layers weighted
+         * by layer_weights. Pixels below zero_threshold are left out,
+         * as they are when reading background files.
+         */
+        void layer_tensor::collapse(const vector<float>& layer_weights, float zero_threshold, int pixel_count,
+                                    background_database* database) const {
+            pixel_map pixels(pixel_count, 0.0);
+            for (int event = 0; event < size(); event++) {
+                get_event(event, layer_weights, &pixels);
+                database->add_event(pixels, zero_threshold);
+                for (long long hit = offsets[event]; hit < offsets[event+1]; hit++) pixels[ indices[hit] ] = 0.0;
+            }
+        }
+
+
+
+        /*
+         * Memory taken up by the tensor, in bytes.
+         */
+        long long layer_tensor::get_storage_bytes() const {
+            return offsets.size()*sizeof(long long) + indices.size()*sizeof(int) + first_layers.size()
+                    + row_offsets.size()*sizeof(long long) + layer_sums.size()*sizeof(float);
+        }
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef LAYER_TENSOR_H
+#define LAYER_TENSOR_H
+
+#include <vector>
+
+#include "background_database.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        /*
+         * The energy of every pixel of a single event, layer by layer,
+         * collected while the event is pixelated. Only the pixels that
+         * were hit are cleared again, so it can be reused from event to
+         * event for little more than the cost of the hits.
+         */
+        struct layered_event {
+            int layer_count;
+            std::vector<float> energies;    //energies[index*layer_count + layer]
+            std::vector<int> touched;
+            std::vector<char> is_touched;
+
+            layered_event() : layer_count(0) {}
+
+            void reset(int pixel_count, int layers);
+            void clear();
+            void add_energy(int index, int layer, float energy);
+        };
+
+
+
+        /*
+         * The background events with the beamcal layers kept apart, so
+         * that the database can be derived again for any choice of layers
+         * without reading the slcio files over.
+         *
+         * It is stored like the database, sorted-sparse: the hit pixels of
+         * event i are offsets[i] ... offsets[i+1]-1. Each hit pixel has a
+         * row of running sums of its energy through the layers, from the
+         * first layer it was hit in down to the last. The energy between
+         * any two layers is then the difference of two sums, and any
+         * weighting of the layers one pass along the row.
+         */
+        struct layer_tensor {
+            int layer_count;
+            std::vector<long long> offsets;
+            std::vector<int> indices;
+
+            //the row of hit pixel h is layer_sums[row_offsets[h]] ...
+            //layer_sums[row_offsets[h+1]-1], starting at layer first_layers[h]
+            std::vector<unsigned char> first_layers;
+            std::vector<long long> row_offsets;
+            std::vector<float> layer_sums;
+
+            layer_tensor() : layer_count(0), offsets(1,0), row_offsets(1,0) {}
+
+            int size() const { return offsets.size() - 1; }
+
+            void add_event(const layered_event& event);
+            void append(const layer_tensor& other);
+            void truncate(int event_count);
+
+            float get_energy(long long hit, const std::vector<float>& layer_weights) const;
+            float get_window_energy(long long hit, int first_layer, int last_layer) const;
+            void get_event(int event, const std::vector<float>& layer_weights, pixel_map* pixels) const;
+            void collapse(const std::vector<float>& layer_weights, float zero_threshold, int pixel_count,
+                            background_database* database) const;
+
+            long long get_storage_bytes() const;
+        };
+    }
+}
+#endif
@@ -0,0 +1,181 @@
+#include <algorithm>
+
+#include "simple_list_geometry.h"
+#include "pixel_covariance.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+
+
+        /*
+         * Sum of products of two pixel columns, straight off the database.
+         */
+        static double column_product(const float* first, const float* second, int event_count) {
+            double product = 0.0;
+            for (int event = 0; event < event_count; event++) {
+                product += (double)first[event] * (double)second[event];
+            }
+            return product;
+        }
+
+
+
+        /*
+         * Fill in the single pixel sums, and the pair sums of every pixel
+         * with each pixel within two steps of it. Requires the database's
+         * columns to have been built.
+         */
+        void pixel_covariance::build(const background_database* bgd_database, int pixel_count) {
+            database = bgd_database;
+            event_count = database->size();
+
+            //where columns are decoded into, if the database is compressed
+            vector<float> column_buffer, partner_buffer;
+
+            totals.assign(pixel_count, 0.0);
+            squares.assign(pixel_count, 0.0);
+            negative_energies = false;
+            hit_words = (event_count + 63) / 64;
+            hit_stride = hit_words;
+            hit_bits.assign( (long long)pixel_count * hit_stride, 0 );
+            for (int index = 0; index < pixel_count; index++) {
+                const float* column = database->get_column(index, &column_buffer);
+                if ( column == NULL ) continue;
+
+                unsigned long long* bits = hit_bits.data() + (long long)index * hit_stride;
+                for (int event = 0; event < event_count; event++) {
+                    totals[index] += column[event];
+                    squares[index] += (double)column[event] * (double)column[event];
+                    if ( column[event] != 0.0 ) bits[event/64] |= 1ULL << (event%64);
+                    if ( column[event] < 0.0 ) negative_energies = true;
+                }
+            }
+
+            //every pixel within two hops of each pixel
+            const pixel_graph* neighborhoods = get_pixel_neighborhoods(2);
+
+            pair_start.assign(1, 0);
+            partners.clear();
+            products.clear();
+            vector<int> row;
+            for (int index = 0; index < pixel_count; index++) {
+                const float* column = database->get_column(index, &column_buffer);
+
+                row.clear();
+                if ( column != NULL ) {
+                    pixel_neighbors neighborhood = neighborhoods->get(index);
+                    row.assign( neighborhood.begin(), neighborhood.end() );
+                }
+                sort( row.begin(), row.end() );
+
+                for ( int partner : row ) {
+                    if ( partner <= index ) continue;
+                    const float* partner_column = database->get_column(partner, &partner_buffer);
+                    if ( partner_column == NULL ) continue;
+
+                    partners.push_back(partner);
+                    products.push_back( column_product(column, partner_column, event_count) );
+                }
+                pair_start.push_back( partners.size() );
+            }
+        }
+
+
+
+        /*
+         * Fold in the events appended to the database since the sums were
+         * last brought up to date. Each sum takes the events in the same
+         * order as build() does, so the result is the same as building the
+         * table over again (apart from which pairs it holds). The hit bit
+         * rows are moved out to twice their length when they fill up.
+         */
+        void pixel_covariance::add_events() {
+            int pixel_count = totals.size();
+            int new_event_count = database->size();
+            if ( new_event_count <= event_count ) return;
+
+            int words = (new_event_count + 63) / 64;
+            if ( words > hit_stride ) {
+                int stride = max(words, 2*hit_stride);
+                vector<unsigned long long> moved( (long long)pixel_count * stride, 0 );
+                for (int index = 0; index < pixel_count; index++) {
+                    copy( hit_bits.begin() + (long long)index * hit_stride,
+                          hit_bits.begin() + (long long)index * hit_stride + hit_words,
+                          moved.begin() + (long long)index * stride );
+                }
+                hit_bits.swap(moved);
+                hit_stride = stride;
+            }
+            hit_words = words;
+
+            vector<int> index_buffer;
+            vector<float> energy_buffer;
+            const int* event_indices;
+            const float* event_energies;
+            vector<float> pixel_energies(pixel_count, 0.0);
+            for (int event = event_count; event < new_event_count; event++) {
+                int count = database->get_event(event, &event_indices, &event_energies, &index_buffer, &energy_buffer);
+                for (int i = 0; i < count; i++) pixel_energies[ event_indices[i] ] = event_energies[i];
+
+                for (int i = 0; i < count; i++) {
+                    int index = event_indices[i];
+                    double energy = event_energies[i];
+                    totals[index] += energy;
+                    squares[index] += energy * energy;
+                    hit_bits[ (long long)index * hit_stride + event/64 ] |= 1ULL << (event%64);
+                    if ( energy < 0.0 ) negative_energies = true;
+
+                    for (long long pair = pair_start[index]; pair < pair_start[index+1]; pair++) {
+                        products[pair] += energy * (double)pixel_energies[ partners[pair] ];
+                    }
+                }
+                for (int i = 0; i < count; i++) pixel_energies[ event_indices[i] ] = 0.0;
+            }
+            event_count = new_event_count;
+        }
+
+
+
+        /*
+         * Sum over events of x_first*x_second. Taken from the table when
+         * the pair is in it, otherwise worked out from the two columns.
+         */
+        double pixel_covariance::get_product(int first, int second, vector<float>* first_buffer,
+                                                vector<float>* second_buffer) const {
+            if ( first == second ) return squares[first];
+            if ( second < first ) swap(first, second);
+
+            const int* row_begin = partners.data() + pair_start[first];
+            const int* row_end = partners.data() + pair_start[first+1];
+            const int* found = lower_bound(row_begin, row_end, second);
+            if ( found != row_end && *found == second ) return products[ found - partners.data() ];
+
+            const float* first_column = database->get_column(first, first_buffer);
+            const float* second_column = database->get_column(second, second_buffer);
+            if ( first_column == NULL || second_column == NULL ) return 0.0;
+            return column_product(first_column, second_column, database->size());
+        }
+
+
+
+        /*
+         * Number of events in which at least one of the cluster's pixels
+         * was hit, from the union of their hit bitsets.
+         */
+        long long pixel_covariance::count_hits(const int* cluster, int cluster_size) const {
+            long long count = 0;
+            for (int word = 0; word < hit_words; word++) {
+                unsigned long long any_hit = 0;
+                for (int i = 0; i < cluster_size; i++) {
+                    any_hit |= hit_bits[ (long long)cluster[i] * hit_stride + word ];
+                }
+                count += __builtin_popcountll(any_hit);
+            }
+            return count;
+        }
+    }
+}
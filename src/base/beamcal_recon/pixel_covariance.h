@@ -0,0 +1,65 @@
+#ifndef PIXEL_COVARIANCE_H
+#define PIXEL_COVARIANCE_H
+
+#include <vector>
+
+#include "background_database.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        /*
+         * Background sums over all events, for single pixels and for pairs
+         * of nearby pixels: the energy total of each pixel, and the total of
+         * products of each pair's energies. The per-event energy of a cluster
+         * is the sum of its pixels' energies, so these are enough to get the
+         * cluster's background mean and variance without going over the
+         * events again.
+         *
+         * The number of events in which a cluster has any energy at all is
+         * the size of the union of its pixels' hit events, which no pairwise
+         * table can give exactly. So each pixel also keeps a bitset of the
+         * events it was hit in, and the union is counted from those, 64
+         * events at a time.
+         *
+         * Pairs are stored for every pixel and each pixel within two steps
+         * of it on the pixel graph. That covers every pair within a cluster
+         * of a seed plus its neighbors. Other pairs are worked out from the
+         * database's pixel columns when they are asked for.
+         *
+         * As background events are appended to the database, add_events
+         * folds them in. The pairs stay those of the pixels that were hit
+         * when the table was built; any others are still worked out from
+         * the columns.
+         */
+        struct pixel_covariance {
+            const background_database* database;
+            int event_count;     //events summed so far
+
+            std::vector<double> totals;      //sum over events of x_i
+            std::vector<double> squares;     //sum over events of x_i*x_i
+            bool negative_energies;          //whether any x_i summed was below zero
+
+            //bit e of pixel i's row is set if x_i != 0 in event e; rows
+            //are hit_stride words long, of which hit_words are in use
+            int hit_words;
+            int hit_stride;
+            std::vector<unsigned long long> hit_bits;
+
+            //pairs (i,j) with i < j, stored as rows by i: the partners of i are
+            //partners[pair_start[i]] ... partners[pair_start[i+1]-1], in order
+            std::vector<long long> pair_start;
+            std::vector<int> partners;
+            std::vector<double> products;    //sum over events of x_i*x_j
+
+            void build(const background_database* bgd_database, int pixel_count);
+            void add_events();
+            //pairs not in the table are worked out from the two columns,
+            //decoded into the given buffers if the database is compressed
+            double get_product(int first, int second, std::vector<float>* first_buffer,
+                                std::vector<float>* second_buffer) const;
+            long long count_hits(const int* cluster, int cluster_size) const;
+        };
+    }
+}
+#endif
@@ -0,0 +1,103 @@
+#include <cmath>
+
+#include "pixel_statistics.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+
+
+        /*
+         * Combine the moments of two disjoint sets of values
+         * into the moments of their union (Chan et al.).
+         */
+        static void merge_moments(pixel_moments* into, const pixel_moments& other) {
+            if ( other.count == 0 ) return;
+            if ( into->count == 0 ) {
+                *into = other;
+                return;
+            }
+
+            long long count = into->count + other.count;
+            double delta = other.mean - into->mean;
+            into->mean += delta * ( (double)other.count / count );
+            into->m2 += other.m2 + delta*delta * ( (double)into->count * other.count / count );
+            into->count = count;
+        }
+
+
+
+        void pixel_statistics::reset(int pixel_count) {
+            event_count = 0;
+            moments.assign( pixel_count, pixel_moments() );
+        }
+
+
+
+        /*
+         * Welford update of every pixel hit during the given event.
+         */
+        void pixel_statistics::add_event(const background_database& database, int event) {
+            vector<int> index_buffer;
+            vector<float> energy_buffer;
+            const int* event_indices;
+            const float* event_energies;
+            int count = database.get_event(event, &event_indices, &event_energies, &index_buffer, &energy_buffer);
+            for (int i = 0; i < count; i++) {
+                pixel_moments& pixel = moments[ event_indices[i] ];
+                double energy = event_energies[i];
+
+                pixel.count++;
+                double delta = energy - pixel.mean;
+                pixel.mean += delta / pixel.count;
+                pixel.m2 += delta * (energy - pixel.mean);
+            }
+            event_count++;
+        }
+
+
+
+        /*
+         * Fold in the statistics of another, disjoint, set of events.
+         */
+        void pixel_statistics::merge(const pixel_statistics& other) {
+            if ( moments.size() < other.moments.size() ) moments.resize( other.moments.size() );
+            for (unsigned int index = 0; index < other.moments.size(); index++) {
+                merge_moments( &moments[index], other.moments[index] );
+            }
+            event_count += other.event_count;
+        }
+
+
+
+        /*
+         * Average energy of the pixel over every event,
+         * including those where it was not hit.
+         */
+        double pixel_statistics::average(int index) const {
+            if ( event_count == 0 ) return 0.0;
+            const pixel_moments& pixel = moments[index];
+            return pixel.mean * ( (double)pixel.count / event_count );
+        }
+
+
+
+        /*
+         * Standard deviation of the pixel energy over every event, including
+         * those where it was not hit. The events without a hit are a group of
+         * zeros, which is merged with the hit moments just like any other
+         * group would be.
+         */
+        double pixel_statistics::std_dev(int index) const {
+            if ( event_count == 0 ) return 0.0;
+            const pixel_moments& pixel = moments[index];
+
+            long long misses = event_count - pixel.count;
+            double m2 = pixel.m2 + pixel.mean*pixel.mean * ( (double)pixel.count * misses / event_count );
+            return sqrt( m2 / event_count );
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef PIXEL_STATISTICS_H
+#define PIXEL_STATISTICS_H
+
+#include <vector>
+
+#include "background_database.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        //Running moments of the energy of a single pixel,
+        //over only the events in which the pixel was hit.
+        struct pixel_moments {
+            long long count;
+            double mean;
+            double m2; //sum of squared deviations from the mean
+
+            pixel_moments() : count(0), mean(0.0), m2(0.0) {}
+        };
+
+
+        /*
+         * Per-pixel background statistics, accumulated one event at a time
+         * with Welford's algorithm, and combinable with Chan et al.'s
+         * pairwise update. Only hit pixels are accumulated; the events in
+         * which a pixel was not hit are folded in as zeros when the average
+         * or standard deviation is asked for.
+         */
+        struct pixel_statistics {
+            long long event_count;
+            std::vector<pixel_moments> moments; //indexed by dense pixel index
+
+            pixel_statistics() : event_count(0) {}
+
+            void reset(int pixel_count);
+            void add_event(const background_database& database, int event);
+            void merge(const pixel_statistics& other);
+
+            long long times_hit(int index) const { return moments[index].count; }
+            double average(int index) const;
+            double std_dev(int index) const;
+        };
+    }
+}
+#endif
@@ -0,0 +1,135 @@
+#include <algorithm>
+
+#include "quantile_sketch.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+
+
+        /*
+         * How far along the values each marker should sit:
+         * the minimum, quantile/2, the quantile, (1+quantile)/2, the maximum.
+         */
+        static double marker_fraction(double quantile, int marker) {
+            static const double weights[5][2] = { {0.0,0.0}, {0.0,0.5}, {0.0,1.0}, {0.5,0.5}, {1.0,0.0} };
+            return weights[marker][0] + weights[marker][1]*quantile;
+        }
+
+
+
+        void quantile_sketch::reset(double new_quantile) {
+            quantile = new_quantile;
+            count = 0;
+            for (int marker = 0; marker < 5; marker++) {
+                heights[marker] = 0.0;
+                positions[marker] = marker;
+                desired[marker] = 0.0;
+            }
+        }
+
+
+
+        /*
+         * Start the sketch off from a whole set of values at once, with the
+         * quantile marker on the value of the given rank (in increasing
+         * order), so the estimate starts out exactly where a full selection
+         * would put it. The other markers are placed by selection too. The
+         * values are reordered. If the rank leaves no room for the markers
+         * around it, the values are just added one by one.
+         */
+        void quantile_sketch::seed(vector<float>* values, long long rank) {
+            long long value_count = values->size();
+            long long ranks[5] = { 0, rank/2, rank, (rank + value_count-1)/2, value_count-1 };
+
+            reset(quantile);
+            if ( value_count < 5 || ranks[1] < 1 || ranks[3] <= rank || ranks[3] >= value_count-1 ) {
+                for ( float value : *values ) add(value);
+                return;
+            }
+
+            for (int marker = 0; marker < 5; marker++) {
+                nth_element( values->begin(), values->begin()+ranks[marker], values->end() );
+                heights[marker] = (*values)[ ranks[marker] ];
+                positions[marker] = ranks[marker];
+                desired[marker] = (value_count-1) * marker_fraction(quantile, marker);
+            }
+            count = value_count;
+        }
+
+
+
+        /*
+         * Take in one more value. The first five are kept as they are;
+         * after that, the value lands between two markers, every marker
+         * above it moves up one position, and any of the middle three
+         * that is now a position or more off where it should be is moved
+         * one position toward there.
+         */
+        void quantile_sketch::add(double value) {
+            if ( count < 5 ) {
+                heights[count++] = value;
+                if ( count == 5 ) {
+                    sort(heights, heights+5);
+                    for (int marker = 0; marker < 5; marker++) desired[marker] = 4 * marker_fraction(quantile, marker);
+                }
+                return;
+            }
+
+            int cell;
+            if ( value < heights[0] ) {
+                heights[0] = value;
+                cell = 0;
+            } else if ( value >= heights[4] ) {
+                heights[4] = value;
+                cell = 3;
+            } else {
+                cell = 0;
+                while ( value >= heights[cell+1] ) cell++;
+            }
+
+            for (int marker = cell+1; marker < 5; marker++) positions[marker] += 1.0;
+            for (int marker = 0; marker < 5; marker++) desired[marker] += marker_fraction(quantile, marker);
+            count++;
+
+            for (int marker = 1; marker <= 3; marker++) {
+                double offset = desired[marker] - positions[marker];
+                double below = positions[marker-1] - positions[marker];
+                double above = positions[marker+1] - positions[marker];
+                if ( not (offset >= 1.0 && above > 1.0) && not (offset <= -1.0 && below < -1.0) ) continue;
+
+                double step = ( offset > 0.0 ) ? 1.0 : -1.0;
+                double height = heights[marker] + step / (above - below)
+                                    * ( (step - below) * (heights[marker+1] - heights[marker]) / above
+                                      + (above - step) * (heights[marker] - heights[marker-1]) / (-below) );
+                if ( not (heights[marker-1] < height && height < heights[marker+1]) ) {
+                    int neighbor = marker + (int)step;
+                    height = heights[marker] + step * (heights[neighbor] - heights[marker])
+                                                / (positions[neighbor] - positions[marker]);
+                }
+                heights[marker] = height;
+                positions[marker] += step;
+            }
+        }
+
+
+
+        /*
+         * The current estimate of the quantile. Until there are five
+         * values, it is picked straight out of them, the same way the
+         * scanner calibration picks its cut.
+         */
+        double quantile_sketch::estimate() const {
+            if ( count >= 5 ) return heights[2];
+            if ( count == 0 ) return 0.0;
+
+            vector<double> values(heights, heights+count);
+            sort( values.begin(), values.end() );
+            long long rank = count-1 - (long long)( count*(1.0 - quantile) );
+            return values[ max(rank, 0LL) ];
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef QUANTILE_SKETCH_H
+#define QUANTILE_SKETCH_H
+
+#include <vector>
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        /*
+         * A running estimate of one quantile of a stream of values, by the
+         * P-square algorithm (Jain and Chlamtac, 1985). Five markers track
+         * the minimum, the quantile, the maximum, and two points halfway
+         * in between; each new value moves them along by at most one
+         * position, bending them onto a parabola through their neighbors.
+         * Takes constant memory, and constant time per value.
+         *
+         * Positions are counted from 0, and marker 2 is the estimate. The
+         * sketch is plain data, so it can be written out as it is.
+         */
+        struct quantile_sketch {
+            double quantile;
+            long long count;
+            double heights[5];
+            double positions[5];
+            double desired[5];
+
+            void reset(double new_quantile);
+            void seed(std::vector<float>* values, long long rank);
+            void add(double value);
+            double estimate() const;
+        };
+    }
+}
+#endif
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include "simple_list_geometry.h"
+#include "seed_bounds.h"
+
+
+using namespace std;
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        //pixels with more hit neighbors than this are left unbounded,
+        //rather than going over 2^count subsets of them
+        static const int _max_bounded_neighbors = 12;
+
+        //how far below its sums a cluster's average of squares is taken
+        //to be, to cover the rounding of sums added up in another order
+        static const double _rounding_margin = 1e-9;
+
+
+
+        /*
+         * The subsets of one seed's hit neighbors, gone over depth first.
+         * Position 0 is the seed and position i+1 its i-th hit neighbor.
+         * Level l holds the hit bit union of a subset of l neighbors (and
+         * the seed), and the positions of the subset's pixels.
+         */
+        struct subset_search {
+            const pixel_covariance* covariance;
+            const int* pixels;
+            int member_count;
+            int* weights;
+
+            //the span of hit bit words being counted, and which
+            //bits of its first word are of events to be counted
+            int first_word;
+            int words;
+            unsigned long long first_mask;
+            vector<unsigned long long> unions;
+
+            vector<double> products;        //pair products of the positions
+            vector<int> chosen;
+
+            double lowest_average;
+            double lowest_std_dev;
+        };
+
+
+
+        /*
+         * Add the hits in the events being counted to the weight of every
+         * subset made by adding neighbors from next_member on to the
+         * subset at the given level.
+         */
+        static void count_subsets(subset_search* search, int level, int next_member, int mask) {
+            const pixel_covariance* covariance = search->covariance;
+            for (int member = next_member; member < search->member_count; member++) {
+                const unsigned long long* hits = covariance->hit_bits.data()
+                                                 + (long long)search->pixels[member+1] * covariance->hit_stride
+                                                 + search->first_word;
+                const unsigned long long* unions = search->unions.data() + (long long)level * search->words;
+                unsigned long long* extended_unions = search->unions.data() + (long long)(level+1) * search->words;
+
+                int weight = 0;
+                for (int word = 0; word < search->words; word++) {
+                    extended_unions[word] = unions[word] | hits[word];
+                    weight += __builtin_popcountll(extended_unions[word]);
+                }
+                if ( search->words > 0 ) weight -= __builtin_popcountll( extended_unions[0] & ~search->first_mask );
+
+                int extended_mask = mask | (1 << member);
+                search->weights[extended_mask] += weight;
+                count_subsets(search, level+1, member+1, extended_mask);
+            }
+        }
+
+
+
+        /*
+         * Lower the bounds to the average and standard deviation of a
+         * cluster with the given background totals, for any weight the
+         * scanner can give it (see seed_bounds).
+         */
+        static void offer_totals(subset_search* search, double total, double squared_total, int weight) {
+            if ( weight == 0 ) return;
+            int lightest = search->covariance->negative_energies ? 1 : weight;
+
+            double average = ( total >= 0.0 ) ? total / weight : total / lightest;
+
+            //the variance is concave in 1/weight, so it is lowest at an end
+            double variance = HUGE_VAL;
+            for ( int end : {weight, lightest} ) {
+                double average_of_squares = squared_total / end * (1.0 - _rounding_margin);
+                double end_average = total / end;
+                variance = min( variance, average_of_squares - end_average*end_average );
+            }
+            double standard_deviation = sqrt( max(0.0, variance) );
+
+            if ( average < search->lowest_average ) search->lowest_average = average;
+            if ( standard_deviation < search->lowest_std_dev ) search->lowest_std_dev = standard_deviation;
+        }
+
+
+
+        /*
+         * Offer every subset made by adding neighbors from next_member on
+         * to the subset at the given level, with the given totals.
+         */
+        static void bound_subsets(subset_search* search, int level, int next_member, int mask,
+                                    double total, double squared_total) {
+            const pixel_covariance* covariance = search->covariance;
+            int positions = search->member_count + 1;
+            for (int member = next_member; member < search->member_count; member++) {
+                int position = member + 1;
+                double extended_squared_total = squared_total + covariance->squares[ search->pixels[position] ];
+                for (int i = 0; i <= level; i++) {
+                    extended_squared_total += 2.0 * search->products[ search->chosen[i] * positions + position ];
+                }
+                double extended_total = total + covariance->totals[ search->pixels[position] ];
+
+                int extended_mask = mask | (1 << member);
+                offer_totals(search, extended_total, extended_squared_total, search->weights[extended_mask]);
+
+                search->chosen[level+1] = position;
+                bound_subsets(search, level+1, member+1, extended_mask, extended_total, extended_squared_total);
+            }
+        }
+
+
+
+        /*
+         * Bring the bounds of every pixel index + k*stride up to date,
+         * counting the weights from event first_event on (from the first
+         * event, for seeds that are new or whose hit neighbors changed).
+         */
+        static void bound_worker(const pixel_covariance* covariance, const vector<double>* std_devs,
+                                    int first_event, int offset, int stride, seed_bounds* bounds) {
+            int pixel_count = std_devs->size();
+
+            subset_search search;
+            search.covariance = covariance;
+            search.unions.resize( (long long)(_max_bounded_neighbors+1) * covariance->hit_words );
+            search.chosen.resize(_max_bounded_neighbors+1);
+
+            vector<int> pixels;
+            vector<float> column_buffer, partner_buffer;
+            for (int index = offset; index < pixel_count; index += stride) {
+                vector<int>& members = bounds->members[index];
+                vector<int>& weights = bounds->subset_weights[index];
+                bounds->lowest_averages[index] = -HUGE_VAL;
+                bounds->lowest_std_devs[index] = 0.0;
+
+                //the seed and its neighbors that were ever hit
+                pixels.assign(1, index);
+                bool bounded = ( (float)(*std_devs)[index] != -1.0 && covariance->squares[index] > 0.0 );
+                if ( bounded ) {
+                    for ( int neighbor : _pixel_graph->get(index) ) {
+                        if ( covariance->squares[neighbor] > 0.0 ) pixels.push_back(neighbor);
+                    }
+                    if ( (int)pixels.size() > _max_bounded_neighbors + 1 ) bounded = false;
+                }
+                if ( !bounded ) {
+                    members.clear();
+                    weights.clear();
+                    continue;
+                }
+
+                int member_count = pixels.size() - 1;
+                int start = first_event;
+                if ( weights.size() != (1u << member_count) || !equal(members.begin(), members.end(), pixels.begin()+1) ) {
+                    members.assign( pixels.begin()+1, pixels.end() );
+                    weights.assign(1 << member_count, 0);
+                    start = 0;
+                }
+
+                //count the new events' hits
+                search.pixels = pixels.data();
+                search.member_count = member_count;
+                search.weights = weights.data();
+                search.first_word = start / 64;
+                search.words = covariance->hit_words - search.first_word;
+                search.first_mask = ~0ULL << (start % 64);
+
+                const unsigned long long* hits = covariance->hit_bits.data()
+                                                 + (long long)index * covariance->hit_stride + search.first_word;
+                int weight = 0;
+                for (int word = 0; word < search.words; word++) {
+                    search.unions[word] = hits[word];
+                    weight += __builtin_popcountll(hits[word]);
+                }
+                if ( search.words > 0 ) weight -= __builtin_popcountll( hits[0] & ~search.first_mask );
+                weights[0] += weight;
+                count_subsets(&search, 0, 0, 0);
+
+                //and take the lowest values from the sums
+                int positions = member_count + 1;
+                search.products.resize(positions * positions);
+                for (int i = 0; i < positions; i++) {
+                    for (int j = i+1; j < positions; j++) {
+                        double product = covariance->get_product(pixels[i], pixels[j], &column_buffer, &partner_buffer);
+                        search.products[i*positions + j] = product;
+                        search.products[j*positions + i] = product;
+                    }
+                }
+                search.lowest_average = HUGE_VAL;
+                search.lowest_std_dev = HUGE_VAL;
+                search.chosen[0] = 0;
+                offer_totals(&search, covariance->totals[index], covariance->squares[index], weights[0]);
+                bound_subsets(&search, 0, 0, 0, covariance->totals[index], covariance->squares[index]);
+
+                bounds->lowest_averages[index] = search.lowest_average;
+                bounds->lowest_std_devs[index] = search.lowest_std_dev;
+            }
+        }
+
+
+
+        /*
+         * Run bound_worker over every pixel, on the given number of threads.
+         */
+        static void run_bound_workers(const pixel_covariance* covariance, const vector<double>& std_devs,
+                                        int first_event, int threads, seed_bounds* bounds) {
+            if ( threads <= 1 ) {
+                bound_worker(covariance, &std_devs, first_event, 0, 1, bounds);
+                return;
+            }
+
+            vector<thread> workers;
+            for (int i = 0; i < threads; i++) {
+                workers.push_back( thread(bound_worker, covariance, &std_devs, first_event, i, threads, bounds) );
+            }
+            for ( thread& worker : workers ) worker.join();
+        }
+
+
+
+        /*
+         * Pixels that cannot be seeds, or have too many hit neighbors, are
+         * left with bounds that hold for any cluster (-inf and 0).
+         */
+        void seed_bounds::build(const pixel_covariance* covariance, const vector<double>& std_devs, int threads) {
+            int pixel_count = std_devs.size();
+            lowest_averages.assign(pixel_count, -HUGE_VAL);
+            lowest_std_devs.assign(pixel_count, 0.0);
+            members.assign( pixel_count, vector<int>() );
+            subset_weights.assign( pixel_count, vector<int>() );
+
+            run_bound_workers(covariance, std_devs, 0, threads, this);
+            event_count = covariance->event_count;
+        }
+
+
+
+        /*
+         * Bring the bounds up to the events the covariance sums have
+         * taken in since, which must already be folded into them.
+         */
+        void seed_bounds::add_events(const pixel_covariance* covariance, const vector<double>& std_devs, int threads) {
+            if ( covariance->event_count == event_count ) return;
+            run_bound_workers(covariance, std_devs, event_count, threads, this);
+            event_count = covariance->event_count;
+        }
+    }
+}
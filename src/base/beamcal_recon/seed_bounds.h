@@ -0,0 +1,54 @@
+#ifndef SEED_BOUNDS_H
+#define SEED_BOUNDS_H
+
+#include <vector>
+
+#include "pixel_covariance.h"
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+
+        /*
+         * How low the background can make a cluster's average and standard
+         * deviation, for every cluster the scanner could grow out of each
+         * seed pixel over one ring (the seed, plus any of its neighbors).
+         * Together with the signal energy around the seed, these bound the
+         * significance the seed's cluster can reach, before it is grown.
+         *
+         * Only the neighbors ever hit in the background change a cluster's
+         * background, so the bounds are taken over every subset of those:
+         * at most a few hundred per pixel. A subset's background total and
+         * total of squares come from the pixel covariance sums (the pixel
+         * totals, and the pair products of the seed and its neighbors), so
+         * no event is gone over for them. Its weight is the number of
+         * events in which any of its pixels was hit, counted from the hit
+         * bitsets and kept for every subset. Without negative energies,
+         * that is exactly the weight of both significance backends; with
+         * them, the exact backend's weight can be anywhere from 1 up to it,
+         * and the bounds are taken over that whole range.
+         *
+         * As background events are appended, add_events counts only the
+         * new events' hits into the weights, and takes the lowest values
+         * from the sums again. Seeds whose hit neighbors have changed are
+         * counted over from the start.
+         */
+        struct seed_bounds {
+            int event_count;     //events the bounds hold for
+            std::vector<double> lowest_averages;
+            std::vector<double> lowest_std_devs;
+
+            //the hit neighbors of each bounded seed, and the weight of the
+            //seed with each subset of them (indexed by the subset's bit mask)
+            std::vector< std::vector<int> > members;
+            std::vector< std::vector<int> > subset_weights;
+
+            seed_bounds() : event_count(0) {}
+
+            //bounds for the pixels that can be seeds (those whose standard
+            //deviation is usable), worked out on the given number of threads
+            void build(const pixel_covariance* covariance, const std::vector<double>& std_devs, int threads);
+            void add_events(const pixel_covariance* covariance, const std::vector<double>& std_devs, int threads);
+        };
+    }
+}
+#endif
@@ -6,48 +6,161 @@
 #include <fstream>
 #include <cmath>
 #include <vector>
-#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+
+#include <sys/stat.h>
 
 #include "polar_coords.h"
+#include "scipp_ilc_globals.h"
+#include "marlin/tinyxml.h"
+
+#include "beamcal_layout.h"
+#include "geometry_blob.h"
 #include "simple_list_geometry.h"
 
 using namespace std;
 
 namespace scipp_ilc {
     namespace beamcal_recon {
-        //static int _LastRing;
-        //static float _sector_offset;
-        //static float sectorMultiplier;
-        //static float* _ring_to_radius_table;
-        //static short* SectorCountTable;
-
-        int _LastRing = 56;
-        static float _sector_offset = 0.05;
-        static float _ring_to_radius_table[] = {3.5, 7.0, 10.5, 14.0, 17.5, 
-                                        21.0, 24.5, 28.0, 31.5, 35.0,
-                                        38.5, 42.0, 45.5, 49.0, 52.5,
-                                        56.0, 59.5, 63.0, 66.5, 70.0,
-                                        73.5, 77.0, 80.5, 84.0, 87.5,
-                                        91.0, 94.5, 98.0, 101.5, 105.0,
-                                        108.5, 112.0, 115.5, 119.0, 122.5,
-                                        126.0, 129.5, 133.0, 136.5, 140.0,
-                                        143.5, 147.0, 150.5, 154.0, 157.5,
-                                        161.0, 164.5, 168.0, 171.5, 175.0,
-                                        178.5, 182.0, 185.5, 189.0, 192.5,
-                                        196.0, 199.5};
-
-        static short SectorCountTable[] = {6, 13, 19, 25, 31, 38, 44, 50, 57,
-                                            63, 69, 75, 82, 88, 94, 101, 107,
-                                            113, 119, 126, 132, 138, 145, 151,
-                                            157, 163, 170, 176, 182, 188, 195,
-                                            201, 207, 214, 220, 226, 232, 239,
-                                            245, 251, 258, 264, 270, 276, 283,
-                                            289, 295, 302, 308, 314, 320, 327,
-                                            333, 339, 346, 352, 358};
+        //The built-in layout is sidloi3, written down once in
+        //beamcal_layout.h; these tables start out as it, and stay
+        //that way unless a geometry file says otherwise
+        static vector<float> sidloi3RingRadii() {
+            vector<float> radii;
+            for (int ring = 0; ring <= sidloi3_layout::last_ring; ring++) {
+                radii.push_back( sidloi3_layout::ring_radius(ring) );
+            }
+            return radii;
+        }
+
+        static vector<short> sidloi3SectorCounts() {
+            vector<short> sector_counts;
+            for (int ring = 0; ring <= sidloi3_layout::last_ring; ring++) {
+                sector_counts.push_back( sidloi3_layout::sector_count(ring) );
+            }
+            return sector_counts;
+        }
+
+        int _LastRing = sidloi3_layout::last_ring;
+        static float _sector_offset = sidloi3_layout::sector_offset;
+        static vector<float> _ring_to_radius_table = sidloi3RingRadii();
+        static vector<short> SectorCountTable = sidloi3SectorCounts();
 
         const int _IDlimit = 10000;
 
-        std::unordered_map<int,surrounding_ids*>* _pixel_graph;
+        //the fewest sectors a ring may have (see checkRing)
+        static const int _min_sector_count = 3;
+
+        const pixel_graph* _pixel_graph = NULL;
+
+        //the geometry file the geometry was initialized from
+        static string _geom_file_name;
+
+        //Dense pixel indexing: the pixels of ring r are numbered
+        //_ring_pixel_offset[r] ... _ring_pixel_offset[r+1]-1,
+        //so every pixel of the beamcal gets an index in
+        //0 ... _pixel_count-1 with no gaps.
+        static vector<int> _ring_pixel_offset;
+        static vector<int> _index_to_ID;
+        static int _pixel_count;
+
+        //Whether the geometry is the sidloi3 layout compiled into
+        //beamcal_layout.h, so lookups can go through that instead
+        //(see useCompiledLayout).
+        static bool _sidloi3_compiled = false;
+
+        //The tables derived from the layout that go into the geometry
+        //blob (see geometry_blob.h), pixel centers and areas included.
+        static geometry_tables _geometry;
+
+        //The pixel graph over _geometry's neighbor tables, and the
+        //neighborhoods of more than one hop, once they are asked for.
+        static const int _max_neighborhood_hops = 3;
+        static pixel_graph _neighbor_graph;
+        static pixel_graph _neighborhood_graphs[_max_neighborhood_hops+1];
+        static vector<int> _neighborhood_offsets[_max_neighborhood_hops+1];
+        static vector<int> _neighborhood_pixels[_max_neighborhood_hops+1];
+        static mutex _neighborhood_mutex;
+
+        //The radial pixels overlapped by every square simulation cell
+        //within the table (cells -_cell_table_half ... _cell_table_half-1
+        //along x and y), with the fraction of the cell's area in each.
+        //The pixels of cell c are _cell_pixels[_cell_offsets[c]] ...
+        //_cell_pixels[_cell_offsets[c+1]-1].
+        static int _cell_table_half;
+        static vector<int> _cell_offsets;
+        static vector<int> _cell_pixels;
+        static vector<float> _cell_fractions;
+
+        //Lanes of the batch pixel lookup (getIDs), handled together with
+        //the compiler's generic vector extensions, as many as fit in the
+        //target's SIMD registers.
+#ifdef __AVX__
+        static const int _lane_count = 4;
+#else
+        static const int _lane_count = 2;
+#endif
+        typedef double double_lanes __attribute__(( vector_size(_lane_count*sizeof(double)) ));
+        typedef long long mask_lanes __attribute__(( vector_size(_lane_count*sizeof(long long)) ));
+
+        //Coefficients of the odd polynomial approximating atan on [0,1]
+        //(Abramowitz and Stegun 4.4.49), and the bound on its error, which
+        //is certified when the geometry is initialized (see certifyAtan).
+        static const double _atan_coefficients[] = { 0.9998660, -0.3302995, 0.1801410, -0.0851330, 0.0208351 };
+        static double _atan_error_bound;
+
+        //Squared ring radii (with an infinite one past the last ring), and
+        //how close to them a squared radius must come for the batch lookup
+        //to hand it over to getRing. The squared radii are cut into bins
+        //narrower than any ring, each holding the number of ring radii
+        //below its start, so that at most one more radius can lie in it.
+        static vector<double> _ring_radius_squared;
+        static vector<double> _ring_radius_tolerance;
+        static vector<int> _ring_bins;
+        static double _ring_bin_scale;
+
+
+
+        /*
+         * Read-only access to the geometry tables, for code
+         * that needs to know the layout as a whole (e.g. to
+         * tell whether a cached database matches it).
+         */
+        int get_sector_count(int ring) {
+            return SectorCountTable[ring];
+        }
+
+        float get_ring_radius(int ring) {
+            return _ring_to_radius_table[ring];
+        }
+
+        float get_sector_offset() {
+            return _sector_offset;
+        }
+
+
+
+        /*
+         * Conversions between the sparse pixel ID (ring*_IDlimit + sector),
+         * which is what the rest of the world sees, and the dense pixel index,
+         * which is what the pixel arrays are indexed by.
+         */
+        int get_pixel_count() {
+            return _pixel_count;
+        }
+
+        int get_pixel_index(int ID) {
+            int ring = ID/_IDlimit;
+            int sector = ID%_IDlimit;
+            return _ring_pixel_offset[ring] + sector;
+        }
+
+        int get_pixel_ID(int index) {
+            return _index_to_ID[index];
+        }
+
+
         
         /*
          * Use binary ( ln(n) time complexity ) search to find
@@ -106,14 +219,26 @@ namespace scipp_ilc {
 
 
         /*
-         * Obtain the pixel ID that corresponds to the
-         * given polar coordinates.
+         * The run time geometry, as a layout lookup (see beamcal_layout.h),
+         * for code templated on the layout.
          */
-        static int getIDpolar(double radius, double phi) {
-            int ring = getRing(radius);
-            int sector = getSector(ring,phi);
-            int ID = _IDlimit*ring + sector;
-            return ID;
+        int layout_lookup<runtime_layout>::last_ring() { return _LastRing; }
+        int layout_lookup<runtime_layout>::sector_count(int ring) { return SectorCountTable[ring]; }
+        float layout_lookup<runtime_layout>::ring_radius(int ring) { return _ring_to_radius_table[ring]; }
+        int layout_lookup<runtime_layout>::ring_offset(int ring) { return _ring_pixel_offset[ring]; }
+        int layout_lookup<runtime_layout>::get_ring(double radius) { return getRing(radius); }
+        int layout_lookup<runtime_layout>::get_sector(int ring, double phi) { return getSector(ring,phi); }
+        double layout_lookup<runtime_layout>::get_phi(int ring, int sector) { return getPhi(ring,sector); }
+
+        int layout_lookup<runtime_layout>::get_index(double x, double y) {
+            double r,phi;
+            scipp_ilc::cartesian_to_polar(x,y,r,phi);
+            int ring = getRing(r);
+            return _ring_pixel_offset[ring] + getSector(ring,phi);
+        }
+
+        bool has_compiled_layout() {
+            return _sidloi3_compiled;
         }
 
 
@@ -122,45 +247,224 @@ namespace scipp_ilc {
          * Obtain the pixel ID that corresponds to the
          * given cartesian coordinates.
          */
-        int getID(double x, double y) {
+        template <typename lookup>
+        static int layout_ID(double x, double y) {
             double r,phi;
             scipp_ilc::cartesian_to_polar(x,y,r,phi);
-            int ID = getIDpolar(r,phi);
+            int ring = lookup::get_ring(r);
+            int sector = lookup::get_sector(ring,phi);
+            int ID = _IDlimit*ring + sector;
             return ID;
         }
 
+        int getID(double x, double y) {
+            if (_sidloi3_compiled) return layout_ID< layout_lookup<sidloi3_layout> >(x,y);
+            return layout_ID< layout_lookup<runtime_layout> >(x,y);
+        }
+
 
 
         /*
-         * Obtain the x,y point corresponding to the center of
-         * the pixel given by ID
+         * Obtain the dense pixel index that corresponds to
+         * the given cartesian coordinates.
          */
-        void get_pixel_center(int ID, double& x, double& y) {
-            int ringID = ID/_IDlimit;
-            int sectorID = ID%_IDlimit;
+        int getIndex(double x, double y) {
+            if (_sidloi3_compiled) return layout_lookup<sidloi3_layout>::get_index(x,y);
+            return layout_lookup<runtime_layout>::get_index(x,y);
+        }
+
+
+
+        /*
+         * atan2(y,x) on [0, 2 pi), like cartesian_to_polar, for a whole
+         * set of lanes at once and without branches: the polynomial on
+         * [0,1], and then reflections to get the octant. Off by at most
+         * _atan_error_bound.
+         */
+        static double_lanes fast_phi(double_lanes x, double_lanes y) {
+            double_lanes zero = {0.0};
+            double_lanes abs_x = (x < zero) ? -x : x;
+            double_lanes abs_y = (y < zero) ? -y : y;
+            mask_lanes steep = abs_y > abs_x;
+            double_lanes numerator = steep ? abs_x : abs_y;
+            double_lanes denominator = steep ? abs_y : abs_x;
+            double_lanes one = zero + 1.0;
+            double_lanes z = numerator / ( (denominator == zero) ? one : denominator );
+
+            double_lanes z2 = z*z;
+            double_lanes angle = zero + _atan_coefficients[4];
+            for (int k = 3; k >= 0; k--) angle = angle*z2 + _atan_coefficients[k];
+            angle = angle*z;
+
+            angle = steep ? M_PI/2 - angle : angle;
+            angle = (x < zero) ? M_PI - angle : angle;
+            angle = (y < zero) ? 2.0*M_PI - angle : angle;
+            return angle;
+        }
 
 
-            //get radial center
-            double outer_radius = _ring_to_radius_table[ringID];
-            double inner_radius = 0;
-            if ( ringID != 0 ) {
-                inner_radius = _ring_to_radius_table[ringID-1];
+
+        /*
+         * The ring and sector of every point in a set of lanes, or -1 for
+         * the points too close to a ring or sector edge for the fast
+         * computation to be sure of. The ring takes no search: the bin of
+         * the squared radius gives it, give or take the one radius that
+         * may lie in the bin, which a single comparison settles. The sector
+         * comes from the fast atan2. A point is only handed back when its
+         * radius or angle is within the error of an edge, so any other
+         * point gets exactly what getRing and getSector would give it.
+         *
+         * Every step is done on all the lanes at once, with masks in place
+         * of branches. Only the table lookups (bin, ring radii, sector
+         * count and offset) are loaded lane by lane, as the vector
+         * extensions have no gather. The offset angle is never negative, so truncating it
+         * floors it, as getSector does.
+         */
+        static void locate_lanes(double_lanes x, double_lanes y, int* rings, int* sectors) {
+            double_lanes zero = {0.0};
+            mask_lanes no = {0};
+            double_lanes radius_squared = x*x + y*y;
+            double_lanes phi = fast_phi(x, y);
+
+            //the number of ring radii up to the point's radius, which
+            //is the ring getRing gives (past the last ring, the last)
+            double_lanes last_bin = zero + (double)(_ring_bins.size() - 1);
+            double_lanes scaled = radius_squared * _ring_bin_scale;
+            mask_lanes bins = __builtin_convertvector( (scaled < last_bin) ? scaled : last_bin, mask_lanes );
+            mask_lanes radii_below;
+            double_lanes radius_above;
+            for (int lane = 0; lane < _lane_count; lane++) {
+                radii_below[lane] = _ring_bins[ bins[lane] ];
+                radius_above[lane] = _ring_radius_squared[ radii_below[lane] ];
             }
+            radii_below -= ( radius_squared >= radius_above );
+
+            mask_lanes edges_below = (radii_below > no) ? radii_below - 1 : no;
+            double_lanes edge_radius, edge_tolerance, below_radius, below_tolerance, sector_count, ring_offset;
+            mask_lanes lane_rings = (radii_below < no + _LastRing) ? radii_below : no + _LastRing;
+            for (int lane = 0; lane < _lane_count; lane++) {
+                edge_radius[lane] = _ring_radius_squared[ radii_below[lane] ];
+                edge_tolerance[lane] = _ring_radius_tolerance[ radii_below[lane] ];
+                below_radius[lane] = _ring_radius_squared[ edges_below[lane] ];
+                below_tolerance[lane] = _ring_radius_tolerance[ edges_below[lane] ];
+                sector_count[lane] = SectorCountTable[ lane_rings[lane] ];
+                ring_offset[lane] = _sector_offset * (int)lane_rings[lane];     //in float, as getSector has it
+            }
+            double_lanes edge_distance = radius_squared - edge_radius;
+            double_lanes below_distance = radius_squared - below_radius;
+            mask_lanes near_edge = ( ((edge_distance < zero) ? -edge_distance : edge_distance) <= edge_tolerance )
+                                 | ( ((below_distance < zero) ? -below_distance : below_distance) <= below_tolerance );
+
+            double_lanes offset_phi = phi - ring_offset;
+            offset_phi = (offset_phi < zero) ? offset_phi + 2.0*M_PI : offset_phi;
+            offset_phi = (offset_phi > 2.0*M_PI) ? offset_phi - 2.0*M_PI : offset_phi;
+
+            double_lanes position = (offset_phi/(2.0*M_PI)) * sector_count;
+            double_lanes margin = (_atan_error_bound/(2.0*M_PI)) * sector_count;
+            double_lanes sector = __builtin_convertvector( __builtin_convertvector(position, mask_lanes), double_lanes );
+            mask_lanes unsure = near_edge | ( position - sector <= margin ) | ( sector + 1.0 - position <= margin )
+                              | ( sector < zero ) | ( sector >= sector_count );
+
+            mask_lanes lane_sectors = __builtin_convertvector(sector, mask_lanes);
+            lane_rings = unsure ? no - 1 : lane_rings;
+            lane_sectors = unsure ? no - 1 : lane_sectors;
+            for (int lane = 0; lane < _lane_count; lane++) {
+                rings[lane] = lane_rings[lane];
+                sectors[lane] = lane_sectors[lane];
+            }
+        }
 
-            double radius = (outer_radius - inner_radius) / 2;
 
 
-            //get polar angular center
-            double ring_circumferance = 2*outer_radius*M_PI;
-            double sector_count = SectorCountTable[ringID];
-            double pixel_arc_length = ring_circumferance / sector_count;
-            double phi_offset = _sector_offset*ringID;
+        /*
+         * Batch versions of getID and getIndex: the pixel of each of count
+         * points, computed lane by lane (see locate_lanes). The few points
+         * that lie right at a pixel edge go through getID/getIndex one by
+         * one, so the results always agree with them exactly. Returns how
+         * many points that was.
+         */
+        template <bool dense_index>
+        static int locate_points(const double* x, const double* y, int count, int* pixels) {
+            int exact_points = 0;
+            for (int first = 0; first < count; first += _lane_count) {
+                int lanes = min(_lane_count, count - first);
+                double_lanes lane_x = {0.0};
+                double_lanes lane_y = {0.0};
+                for (int lane = 0; lane < lanes; lane++) {
+                    lane_x[lane] = x[first+lane];
+                    lane_y[lane] = y[first+lane];
+                }
 
-            double phi = pixel_arc_length*sectorID + pixel_arc_length/2 + phi_offset;
+                int rings[_lane_count], sectors[_lane_count];
+                locate_lanes(lane_x, lane_y, rings, sectors);
+                for (int lane = 0; lane < lanes; lane++) {
+                    int point = first + lane;
+                    if ( rings[lane] < 0 ) {
+                        exact_points++;
+                        pixels[point] = dense_index ? getIndex(x[point], y[point]) : getID(x[point], y[point]);
+                    } else if (dense_index) {
+                        pixels[point] = _ring_pixel_offset[ rings[lane] ] + sectors[lane];
+                    } else {
+                        pixels[point] = _IDlimit*rings[lane] + sectors[lane];
+                    }
+                }
+            }
+            return exact_points;
+        }
 
+        int getIDs(const double* x, const double* y, int count, int* IDs) {
+            return locate_points<false>(x, y, count, IDs);
+        }
 
-            //convert to cartesian coordinates
-            polar_to_cartesian(radius,phi,x,y);
+        int getIndices(const double* x, const double* y, int count, int* indices) {
+            return locate_points<true>(x, y, count, indices);
+        }
+
+        float get_atan_error_bound() {
+            return _atan_error_bound;
+        }
+
+
+
+        /*
+         * The radial pixels (as dense indices) that the square simulation
+         * cell (cell_x, cell_y) overlaps, and the fraction of the cell's area
+         * that lies in each. Cell (i,j) covers i to i+1 cell sizes along x
+         * and j to j+1 along y, as in the lcdd's GridXYZ segmentation.
+         * Returns how many pixels there are, or 0 for a cell outside
+         * the table.
+         */
+        int get_cell_pixels(int cell_x, int cell_y, const int** indices, const float** fractions) {
+            if ( cell_x < -_cell_table_half || cell_x >= _cell_table_half ) return 0;
+            if ( cell_y < -_cell_table_half || cell_y >= _cell_table_half ) return 0;
+
+            int cell = (cell_y + _cell_table_half) * 2*_cell_table_half + (cell_x + _cell_table_half);
+            *indices = _cell_pixels.data() + _cell_offsets[cell];
+            *fractions = _cell_fractions.data() + _cell_offsets[cell];
+            return _cell_offsets[cell+1] - _cell_offsets[cell];
+        }
+
+
+
+        /*
+         * Obtain the x,y point corresponding to the center of
+         * the pixel given by ID: halfway between its ring's edges,
+         * and halfway around its sector.
+         */
+        void get_pixel_center(int ID, double& x, double& y) {
+            int index = get_pixel_index(ID);
+            x = _geometry.pixel_centers[2*index];
+            y = _geometry.pixel_centers[2*index+1];
+        }
+
+
+
+        /*
+         * The area of the pixel with the given dense index,
+         * in square millimeters.
+         */
+        double get_pixel_area(int index) {
+            return _geometry.pixel_areas[index];
         }
 
 
@@ -168,24 +472,27 @@ namespace scipp_ilc {
         /* 
          * Identifying pixels that surround other pixels with a radial pixel scheme is hard.
          * So, in order to avoid painfully repeating the process for every pixel that is
-         * looked at, I am creating a hashmap here which caches that information.
-         * The hashmap's keys correspond to the ID of the pixel you want to know the 
-         * sorrounding pixels of. The values are the IDs of the surrounding pixels...
-         * sort of. The values are actually two vectors, and consist of the IDs of the
-         * surrounding pixels. The reason the IDs are broken up into two seperate
-         * lists is that it allows you to rapidly identify pixels on a ring outside
-         * the current one, or inside it. 
+         * looked at, I am creating a table here which caches that information.
+         * It holds a row per pixel, in dense index order, listing the indices of the
+         * surrounding pixels, all rows back to back (see pixel_graph). Each row is
+         * broken up into two halves at its half_turn_index, which allows you to
+         * rapidly identify pixels on a ring outside the current one, or inside it.
          *
          * p.s. I'm calling this a graph because 'graph' is a computer science term.
          *      look it up.
          */
+        template <typename lookup>
         static void makeGraph() {
-           _pixel_graph = new unordered_map<int,surrounding_ids*>();
-
-            for( int ring = 0; ring <= _LastRing; ring++) {
-                for ( int sector = 0; sector < SectorCountTable[ring]; sector++ ) {
-                    int ID = ring*_IDlimit + sector;
-
+            vector<int>& neighbor_offsets = _geometry.neighbor_offsets.values;
+            vector<int>& neighbors = _geometry.neighbors.values;
+            vector<int>& half_turn_indices = _geometry.half_turn_indices.values;
+            neighbor_offsets.assign(1, 0);
+            neighbors.clear();
+            half_turn_indices.clear();
+            vector<int> pixel_list;
+
+            for( int ring = 0; ring <= lookup::last_ring(); ring++) {
+                for ( int sector = 0; sector < lookup::sector_count(ring); sector++ ) {
                     /*Identify phi boundries*/
 
                     //create ring variables
@@ -195,39 +502,39 @@ namespace scipp_ilc {
                     //create sector variables
                     int clockwiseMost_sector = sector-1;
                     if (clockwiseMost_sector < 0) {
-                        clockwiseMost_sector += SectorCountTable[ring];
+                        clockwiseMost_sector += lookup::sector_count(ring);
                     }
 
                     int anticlockwiseMost_sector = sector+1;
-                    if (anticlockwiseMost_sector >= SectorCountTable[ring]) {
-                        anticlockwiseMost_sector -= SectorCountTable[ring];
+                    if (anticlockwiseMost_sector >= lookup::sector_count(ring)) {
+                        anticlockwiseMost_sector -= lookup::sector_count(ring);
                     }
 
                     //get phi boundries
-                    double clockwise_boundry = getPhi(ring, sector);
-                    double anticlockwise_boundry = getPhi(ring, anticlockwiseMost_sector);
+                    double clockwise_boundry = lookup::get_phi(ring, sector);
+                    double anticlockwise_boundry = lookup::get_phi(ring, anticlockwiseMost_sector);
 
 
-                    /*create ID lists*/
+                    /*create neighbor lists*/
 
-                    //create inner ID list.
+                    //create inner neighbor list.
                     //Note that the anticlockwise-most sector on the same ring is included
                     /*
                      * Additionally, note that these are added in reverse order.
-                     * That way, when iterating through the surrounding ID list,
-                     * the IDs are read in an order that performs a perfect anti-clockwise
+                     * That way, when iterating through the surrounding pixel list,
+                     * the pixels are read in an order that performs a perfect anti-clockwise
                      * rotation around the sector in question. I chose an anticlockwise
                      * direction for this in order to match the direction of increasing phi
                      * in polar coordinates.
                      */
-                    vector<int>* pixel_list = new vector<int>();
-                    int anticlockwiseMost_ID = ring*_IDlimit + anticlockwiseMost_sector;
-                    pixel_list->push_back(anticlockwiseMost_ID);
+                    pixel_list.clear();
+                    int anticlockwiseMost_pixel = lookup::ring_offset(ring) + anticlockwiseMost_sector;
+                    pixel_list.push_back(anticlockwiseMost_pixel);
 
                     if (inner_ring >= 0) {
                         //identify first and last inner sectors
-                        int inner_anticlockwiseMost_sector = getSector(inner_ring, anticlockwise_boundry);
-                        int inner_clockwiseMost_sector = getSector(inner_ring, clockwise_boundry);
+                        int inner_anticlockwiseMost_sector = lookup::get_sector(inner_ring, anticlockwise_boundry);
+                        int inner_clockwiseMost_sector = lookup::get_sector(inner_ring, clockwise_boundry);
 
                         //add inner sectors to innerlist
                         if(inner_clockwiseMost_sector <= inner_anticlockwiseMost_sector) {
@@ -235,8 +542,8 @@ namespace scipp_ilc {
                                     inner_sector >= inner_clockwiseMost_sector;
                                     inner_sector--) {
 
-                                int inner_ID = (inner_ring)*_IDlimit + inner_sector;
-                                pixel_list->push_back(inner_ID);
+                                int inner_pixel = lookup::ring_offset(inner_ring) + inner_sector;
+                                pixel_list.push_back(inner_pixel);
                             }
                         } else {
                             //in this case, we have to go around the corner;
@@ -246,38 +553,38 @@ namespace scipp_ilc {
                                     inner_sector >= 0;
                                     inner_sector--) {
 
-                                int inner_ID = (inner_ring)*_IDlimit + inner_sector;
-                                pixel_list->push_back(inner_ID);
+                                int inner_pixel = lookup::ring_offset(inner_ring) + inner_sector;
+                                pixel_list.push_back(inner_pixel);
                             }
-                            for(int inner_sector = SectorCountTable[inner_ring]-1;
+                            for(int inner_sector = lookup::sector_count(inner_ring)-1;
                                     inner_sector >= inner_clockwiseMost_sector;
                                     inner_sector--) {
 
-                                int inner_ID = (inner_ring)*_IDlimit + inner_sector;
-                                pixel_list->push_back(inner_ID);
+                                int inner_pixel = lookup::ring_offset(inner_ring) + inner_sector;
+                                pixel_list.push_back(inner_pixel);
                             }
                         }
                     }
-                    int clockwiseMost_index = pixel_list->size();
+                    int clockwiseMost_index = pixel_list.size();
 
 
-                    //create outer ID list.
+                    //create outer neighbor list.
                     //Note that the clockwise-most sector on the same ring is included at index 0.
-                    int clockwiseMost_ID = ring*_IDlimit + clockwiseMost_sector;
-                    pixel_list->push_back(clockwiseMost_ID);
+                    int clockwiseMost_pixel = lookup::ring_offset(ring) + clockwiseMost_sector;
+                    pixel_list.push_back(clockwiseMost_pixel);
 
-                    if (outer_ring <= _LastRing) {
+                    if (outer_ring <= lookup::last_ring()) {
                         //identify first and last outer sectors
-                        int outer_anticlockwiseMost_sector = getSector(outer_ring, anticlockwise_boundry);
-                        int outer_clockwiseMost_sector = getSector(outer_ring, clockwise_boundry);
+                        int outer_anticlockwiseMost_sector = lookup::get_sector(outer_ring, anticlockwise_boundry);
+                        int outer_clockwiseMost_sector = lookup::get_sector(outer_ring, clockwise_boundry);
                         //add outer sectors to pixel_list
                         if(outer_clockwiseMost_sector <= outer_anticlockwiseMost_sector) {
                             for (int outer_sector = outer_clockwiseMost_sector;
                                     outer_sector <= outer_anticlockwiseMost_sector;
                                     outer_sector++) {
 
-                                int outer_ID = (outer_ring)*_IDlimit + outer_sector;
-                                pixel_list->push_back(outer_ID);
+                                int outer_pixel = lookup::ring_offset(outer_ring) + outer_sector;
+                                pixel_list.push_back(outer_pixel);
                             }
                         }
                         else {
@@ -285,63 +592,591 @@ namespace scipp_ilc {
                             //i.e. from the clockwise-most to the max,
                             //and then from zero to the anticlockwise-most
                             for(int	outer_sector = outer_clockwiseMost_sector;
-                                    outer_sector <= SectorCountTable[outer_ring]-1;
+                                    outer_sector <= lookup::sector_count(outer_ring)-1;
                                     outer_sector++) {
 
-                                int outer_ID = (outer_ring)*_IDlimit + outer_sector;
-                                pixel_list->push_back(outer_ID);
+                                int outer_pixel = lookup::ring_offset(outer_ring) + outer_sector;
+                                pixel_list.push_back(outer_pixel);
                             }
                             for(int	outer_sector = 0;
                                     outer_sector <= outer_anticlockwiseMost_sector;
                                     outer_sector++){
 
-                                int outer_ID = (outer_ring)*_IDlimit + outer_sector;
-                                pixel_list->push_back(outer_ID);
+                                int outer_pixel = lookup::ring_offset(outer_ring) + outer_sector;
+                                pixel_list.push_back(outer_pixel);
                             }
                         }
                     }
 
 
-                    //add surroundings to the hashmap
-                    surrounding_ids* surroundings;
-                    surroundings = (surrounding_ids*) malloc( sizeof(surrounding_ids) );
-                    surroundings->list = pixel_list;
-                    surroundings->half_turn_index = clockwiseMost_index;
+                    //add surroundings to the table
+                    neighbors.insert( neighbors.end(), pixel_list.begin(), pixel_list.end() );
+                    neighbor_offsets.push_back( neighbors.size() );
+                    half_turn_indices.push_back(clockwiseMost_index);
+                }
+            }
+        }
+
+
 
-                    _pixel_graph->emplace(ID,surroundings);
+        /*
+         * Build the dense pixel index out of a prefix sum
+         * over the sector counts of each ring.
+         */
+        static void makePixelIndex() {
+            _ring_pixel_offset.assign(_LastRing+2, 0);
+            _index_to_ID.clear();
+
+            for (int ring = 0; ring <= _LastRing; ring++) {
+                _ring_pixel_offset[ring+1] = _ring_pixel_offset[ring] + SectorCountTable[ring];
+                for (int sector = 0; sector < SectorCountTable[ring]; sector++) {
+                    _index_to_ID.push_back( ring*_IDlimit + sector );
                 }
             }
+            _pixel_count = _ring_pixel_offset[_LastRing+1];
+        }
+
+
+
+        /*
+         * Fill in the rest of the tables that go into the geometry
+         * blob (the pixel graph is made straight into it): the layout
+         * and pixel index as they are, plus the center and area of
+         * every pixel.
+         */
+        static void compileGeometry() {
+            _geometry.sector_offset = _sector_offset;
+            _geometry.ring_radii = _ring_to_radius_table;
+            _geometry.sector_counts = SectorCountTable;
+            _geometry.ring_offsets.values = _ring_pixel_offset;
+
+            vector<double>& centers = _geometry.pixel_centers.values;
+            vector<double>& areas = _geometry.pixel_areas.values;
+            centers.clear();
+            areas.clear();
+
+            for (int index = 0; index < _pixel_count; index++) {
+                int ring = _index_to_ID[index] / _IDlimit;
+                int sector = _index_to_ID[index] % _IDlimit;
+                double outer_radius = _ring_to_radius_table[ring];
+                double inner_radius = ( ring > 0 ) ? _ring_to_radius_table[ring-1] : 0.0;
+                double phi = getPhi(ring, sector) + M_PI / SectorCountTable[ring];
+
+                double x, y;
+                polar_to_cartesian( (inner_radius + outer_radius) / 2.0, phi, x, y );
+                centers.push_back(x);
+                centers.push_back(y);
+                areas.push_back( M_PI * (outer_radius*outer_radius - inner_radius*inner_radius)
+                                    / SectorCountTable[ring] );
+            }
+        }
+
+
+
+        /*
+         * Take the layout, pixel index and pixel graph
+         * out of a geometry blob rather than building them.
+         */
+        static void useGeometryBlob() {
+            _sector_offset = _geometry.sector_offset;
+            _ring_to_radius_table = _geometry.ring_radii;
+            SectorCountTable = _geometry.sector_counts;
+            _LastRing = SectorCountTable.size() - 1;
+            makePixelIndex();
         }
 
 
 
         /*
-         * Right, so... I never actually got around to writing
-         * this part. You really only need this if you intend
-         * to start testing a whole bunch of different geometry
-         * styles, and even then I wonder if writing this function
-         * would actually be faster than just altering the arrays
-         * up top and recompiling the code.
+         * Point the pixel graph at the neighbor tables,
+         * wherever they came from.
+         */
+        static void usePixelGraph() {
+            _neighbor_graph.offsets = _geometry.neighbor_offsets.data();
+            _neighbor_graph.neighbors = _geometry.neighbors.data();
+            _neighbor_graph.half_turn_indices = _geometry.half_turn_indices.data();
+            _neighborhood_graphs[1] = _neighbor_graph;
+            _pixel_graph = &_neighbor_graph;
+        }
+
+
+
+        /*
+         * Every pixel within the given number of hops of each pixel, found
+         * by a breadth first search over the pixel graph, so that each
+         * row starts with the direct neighbors, followed by those two hops
+         * away, and so on. The neighborhoods are only built the first time
+         * they are asked for, after which they are shared by every thread.
+         */
+        const pixel_graph* get_pixel_neighborhoods(int hops) {
+            if ( hops < 1 || hops > _max_neighborhood_hops ) {
+                cout << "Pixel neighborhoods only go up to " << _max_neighborhood_hops << " hops\n";
+                return NULL;
+            }
+
+            lock_guard<mutex> lock(_neighborhood_mutex);
+            if ( _neighborhood_graphs[hops].offsets != NULL ) return &_neighborhood_graphs[hops];
+
+            vector<int>& offsets = _neighborhood_offsets[hops];
+            vector<int>& pixels = _neighborhood_pixels[hops];
+            offsets.assign(1, 0);
+            pixels.clear();
+
+            vector<int> visited(_pixel_count, -1);
+            for (int index = 0; index < _pixel_count; index++) {
+                visited[index] = index;
+                int hop_start = pixels.size();
+                for ( int neighbor : _pixel_graph->get(index) ) {
+                    if ( visited[neighbor] == index ) continue;
+                    visited[neighbor] = index;
+                    pixels.push_back(neighbor);
+                }
+                for (int hop = 2; hop <= hops; hop++) {
+                    int hop_end = pixels.size();
+                    for (int position = hop_start; position < hop_end; position++) {
+                        for ( int neighbor : _pixel_graph->get( pixels[position] ) ) {
+                            if ( visited[neighbor] == index ) continue;
+                            visited[neighbor] = index;
+                            pixels.push_back(neighbor);
+                        }
+                    }
+                    hop_start = hop_end;
+                }
+                offsets.push_back( pixels.size() );
+            }
+
+            _neighborhood_graphs[hops].neighbors = pixels.data();
+            _neighborhood_graphs[hops].half_turn_indices = NULL;
+            _neighborhood_graphs[hops].offsets = offsets.data();
+            return &_neighborhood_graphs[hops];
+        }
+
+
+
+        /*
+         * Area of the part of the triangle (origin, a, b) within the circle
+         * of the given radius around the origin, signed like the triangle
+         * (positive if a to b runs anticlockwise). The edge a-b is cut where
+         * it crosses the circle; the pieces inside the circle count as
+         * triangles, and the pieces outside as circular sectors.
+         */
+        static double triangle_circle_area(double ax, double ay, double bx, double by, double radius) {
+            double dx = bx - ax;
+            double dy = by - ay;
+            double a = dx*dx + dy*dy;
+            double b = ax*dx + ay*dy;
+            double c = ax*ax + ay*ay - radius*radius;
+
+            double cuts[4];
+            int cut_count = 0;
+            cuts[cut_count++] = 0.0;
+            double discriminant = b*b - a*c;
+            if ( a > 0.0 && discriminant > 0.0 ) {
+                double root = sqrt(discriminant);
+                double first = (-b - root) / a;
+                double second = (-b + root) / a;
+                if ( 0.0 < first && first < 1.0 ) cuts[cut_count++] = first;
+                if ( 0.0 < second && second < 1.0 ) cuts[cut_count++] = second;
+            }
+            cuts[cut_count++] = 1.0;
+
+            double area = 0.0;
+            for (int k = 0; k+1 < cut_count; k++) {
+                double px = ax + cuts[k]*dx, py = ay + cuts[k]*dy;
+                double qx = ax + cuts[k+1]*dx, qy = ay + cuts[k+1]*dy;
+                double mx = (px + qx) / 2, my = (py + qy) / 2;
+                double cross = px*qy - py*qx;
+                if ( mx*mx + my*my <= radius*radius ) area += cross / 2;
+                else area += radius*radius * atan2(cross, px*qx + py*qy) / 2;
+            }
+            return area;
+        }
+
+
+
+        /*
+         * Area of the part of a convex polygon (anticlockwise) within
+         * the circle of the given radius around the origin.
+         */
+        static double polygon_circle_area(const vector< pair<double,double> >& polygon, double radius) {
+            double area = 0.0;
+            for (unsigned int k = 0; k < polygon.size(); k++) {
+                const pair<double,double>& a = polygon[k];
+                const pair<double,double>& b = polygon[ (k+1) % polygon.size() ];
+                area += triangle_circle_area(a.first, a.second, b.first, b.second, radius);
+            }
+            return area;
+        }
+
+
+
+        /*
+         * Cut a convex polygon down to the half plane
+         * normal_x*x + normal_y*y >= 0 (Sutherland-Hodgman).
+         */
+        static void clip_polygon(vector< pair<double,double> >* polygon, double normal_x, double normal_y) {
+            vector< pair<double,double> > clipped;
+            for (unsigned int k = 0; k < polygon->size(); k++) {
+                const pair<double,double>& a = (*polygon)[k];
+                const pair<double,double>& b = (*polygon)[ (k+1) % polygon->size() ];
+                double side_a = normal_x*a.first + normal_y*a.second;
+                double side_b = normal_x*b.first + normal_y*b.second;
+
+                if ( side_a >= 0.0 ) clipped.push_back(a);
+                if ( (side_a >= 0.0) != (side_b >= 0.0) ) {
+                    double t = side_a / (side_a - side_b);
+                    clipped.push_back( pair<double,double>( a.first + t*(b.first - a.first),
+                                                            a.second + t*(b.second - a.second) ) );
+                }
+            }
+            polygon->swap(clipped);
+        }
+
+
+
+        /*
+         * For every square simulation cell near enough to the beamcal, work
+         * out the exact area it shares with each radial pixel: the cell is
+         * cut down to the pixel's sector (a wedge, which is convex, as every
+         * ring has at least three sectors; see checkRing), and the area of
+         * what is left between the ring's inner and outer circles is then
+         * exact.
+         *
+         * Only the rings between the cell's nearest and farthest points
+         * are tried, and in each only the sectors spanned by the cell's
+         * corners (plus one on either side), but never more than the
+         * ring has.
+         */
+        static void makeCellTable() {
+            double size = _BeamCal_cell_size;
+            double cell_area = size*size;
+            _cell_table_half = (int)ceil(_radius_cut / size) + 1;
+            int width = 2*_cell_table_half;
+
+            _cell_offsets.assign(1, 0);
+            _cell_pixels.clear();
+            _cell_fractions.clear();
+
+            for (int cell_y = -_cell_table_half; cell_y < _cell_table_half; cell_y++) {
+                for (int cell_x = -_cell_table_half; cell_x < _cell_table_half; cell_x++) {
+                    double x0 = cell_x*size, x1 = (cell_x+1)*size;
+                    double y0 = cell_y*size, y1 = (cell_y+1)*size;
+                    vector< pair<double,double> > square;
+                    square.push_back( pair<double,double>(x0,y0) );
+                    square.push_back( pair<double,double>(x1,y0) );
+                    square.push_back( pair<double,double>(x1,y1) );
+                    square.push_back( pair<double,double>(x0,y1) );
+
+                    double near_x = max( x0, min(0.0, x1) );
+                    double near_y = max( y0, min(0.0, y1) );
+                    double near_radius = hypot(near_x, near_y);
+                    double far_radius = hypot( max(fabs(x0),fabs(x1)), max(fabs(y0),fabs(y1)) );
+                    bool around_origin = ( near_radius == 0.0 );
+
+                    //the angles the cell spans, if it is clear of the origin
+                    double phi_low = 0.0, phi_high = 0.0;
+                    if ( not around_origin ) {
+                        double center_phi = atan2( (y0+y1)/2, (x0+x1)/2 );
+                        phi_low = phi_high = center_phi;
+                        for ( const pair<double,double>& corner : square ) {
+                            double delta = atan2(corner.second, corner.first) - center_phi;
+                            if ( delta > M_PI ) delta -= 2.0*M_PI;
+                            if ( delta < -M_PI ) delta += 2.0*M_PI;
+                            phi_low = min(phi_low, center_phi + delta);
+                            phi_high = max(phi_high, center_phi + delta);
+                        }
+                        if ( phi_low < 0.0 ) phi_low += 2.0*M_PI;
+                        if ( phi_high < 0.0 ) phi_high += 2.0*M_PI;
+                    }
+
+                    if ( near_radius <= _ring_to_radius_table[_LastRing] ) {
+                        for (int ring = getRing(near_radius); ring <= getRing(far_radius); ring++) {
+                            int sectorCount = SectorCountTable[ring];
+                            int first_sector = 0;
+                            int sector_span = sectorCount;
+                            if ( not around_origin ) {
+                                //sectors from the one at phi_low on to the one at
+                                //phi_high, which may be past the last sector
+                                int low_sector = getSector(ring, phi_low);
+                                int corner_span = getSector(ring, phi_high) - low_sector;
+                                if ( corner_span < 0 ) corner_span += sectorCount;
+                                first_sector = low_sector - 1;
+                                sector_span = min(corner_span + 3, sectorCount);
+                            }
+
+                            for (int k = 0; k < sector_span; k++) {
+                                int sector = (first_sector + k + sectorCount) % sectorCount;
+                                double clockwise_phi = _sector_offset*ring + 2.0*M_PI*sector / sectorCount;
+                                double anticlockwise_phi = clockwise_phi + 2.0*M_PI / sectorCount;
+
+                                vector< pair<double,double> > wedge = square;
+                                clip_polygon( &wedge, -sin(clockwise_phi), cos(clockwise_phi) );
+                                clip_polygon( &wedge, sin(anticlockwise_phi), -cos(anticlockwise_phi) );
+                                if ( wedge.size() < 3 ) continue;
+
+                                double area = polygon_circle_area(wedge, _ring_to_radius_table[ring]);
+                                if ( ring > 0 ) area -= polygon_circle_area(wedge, _ring_to_radius_table[ring-1]);
+                                if ( area <= 1e-9*cell_area ) continue;
+
+                                _cell_pixels.push_back( _ring_pixel_offset[ring] + sector );
+                                _cell_fractions.push_back( area / cell_area );
+                            }
+                        }
+                    }
+                    _cell_offsets.push_back( _cell_pixels.size() );
+                }
+            }
+            cout << "Cell table maps " << width*width << " cells onto "
+                 << _cell_pixels.size() << " pixel overlaps\n";
+        }
+
+
+
+        /*
+         * Certify the error bound of the fast atan on [0,1]: its error e(z)
+         * is sampled every h, and between samples can change by no more
+         * than h/2 times the largest |e'(z)|, which is at most 1 (from
+         * atan) plus the sum of k|a_k| (from the polynomial). The bound has
+         * to stay below the narrowest sector, or the batch lookup could not
+         * tell sectors apart at all; it is, by three orders of magnitude.
          *
-         * However, if you do need an actual geometry file, I would
-         * suggest an xml-style file, and using Marlin's tinyxmlparser.h
-         * file in order to read it. Do NOT use XercesC to read xml files,
-         * unless you either already know how to use XercesC, or are insane.
+         * Also tabulates what the batch lookup needs of the rings: their
+         * squared radii, and the bins of squared radius, each half as wide
+         * as the narrowest ring is in squared radius.
          */
-        static void readGeomFile(string geom_file_name) {    
-            cout << geom_file_name << endl;
+        static void certifyAtan() {
+            double slope_bound = 1.0;
+            for (int k = 0; k < 5; k++) slope_bound += (2*k+1) * fabs(_atan_coefficients[k]);
+
+            const int samples = 1000000;
+            double step = 1.0 / samples;
+            double largest_error = 0.0;
+            for (int i = 0; i <= samples; i++) {
+                double z = i*step;
+                double z2 = z*z;
+                double angle = _atan_coefficients[4];
+                for (int k = 3; k >= 0; k--) angle = angle*z2 + _atan_coefficients[k];
+                largest_error = max( largest_error, fabs(angle*z - atan(z)) );
+            }
+            _atan_error_bound = largest_error + slope_bound*step/2 + 1e-12;
+
+            double narrowest_sector = 2.0*M_PI;
+            for (int ring = 0; ring <= _LastRing; ring++) {
+                narrowest_sector = min( narrowest_sector, 2.0*M_PI / SectorCountTable[ring] );
+            }
+            if ( _atan_error_bound >= narrowest_sector ) {
+                cout << "The fast atan is off by up to " << _atan_error_bound
+                     << ", more than the narrowest sector (" << narrowest_sector << ")\n";
+            }
+
+            _ring_radius_squared.clear();
+            _ring_radius_tolerance.clear();
+            double narrowest_ring = HUGE_VAL;
+            for (int ring = 0; ring <= _LastRing; ring++) {
+                double radius = _ring_to_radius_table[ring];
+                double inner_squared = ( ring > 0 ) ? _ring_radius_squared.back() : 0.0;
+                narrowest_ring = min( narrowest_ring, radius*radius - inner_squared );
+                _ring_radius_squared.push_back(radius*radius);
+                _ring_radius_tolerance.push_back(radius*radius * 1e-12);
+            }
+            _ring_radius_squared.push_back(HUGE_VAL);
+            _ring_radius_tolerance.push_back(0.0);
+
+            _ring_bin_scale = 2.0 / narrowest_ring;
+            int bin_count = (int)( _ring_radius_squared[_LastRing] * _ring_bin_scale ) + 2;
+            _ring_bins.assign(bin_count, 0);
+            for (int bin = 0; bin < bin_count; bin++) {
+                double bin_start = bin / _ring_bin_scale;
+                int radii_below = 0;
+                while ( _ring_radius_squared[radii_below] <= bin_start ) radii_below++;
+                _ring_bins[bin] = radii_below;
+            }
+        }
+
+
+
+        /*
+         * Whether a ring of the given outer radius and number of sectors
+         * can follow a ring of outer radius inner_radius (0 for the first
+         * ring), saying what is wrong with it if not. The tables derived
+         * from the layout need every sector to have two different
+         * neighbors on its own ring, and the cell table a sector narrower
+         * than half the ring, so rings need at least three sectors.
+         */
+        static bool checkRing(string source, int ring, float inner_radius, float radius, int sectors) {
+            if ( radius > inner_radius && sectors >= _min_sector_count && sectors < _IDlimit ) return true;
+            cout << "Ring " << ring << " of " << source << " has radius " << radius
+                 << " and " << sectors << " sectors; radii must increase, and sectors be "
+                 << _min_sector_count << " to " << _IDlimit-1 << endl;
+            return false;
+        }
+
+
+
+        /*
+         * Read the layout out of an xml geometry file, which
+         * looks like
+         *
+         *   <beamcal_geometry sector_offset="0.05">
+         *       <ring radius="3.5" sectors="6"/>
+         *       <ring radius="7.0" sectors="13"/>
+         *       ...
+         *   </beamcal_geometry>
+         *
+         * with one ring element per ring, from the inside out: the radius
+         * of its outer edge (in mm) and its number of sectors. Each ring's
+         * sectors are turned by sector_offset (in radians) more than those
+         * of the ring inside it. The layout is only taken on if the whole
+         * file makes sense; returns whether it was.
+         */
+        static bool readGeomFile(string geom_file_name) {
+            marlin::TiXmlDocument document(geom_file_name.c_str());
+            if ( not document.LoadFile() ) {
+                cout << "Unable to parse geometry file " << geom_file_name << ": " << document.ErrorDesc() << endl;
+                return false;
+            }
+
+            const marlin::TiXmlElement* root = document.RootElement();
+            float sector_offset = 0.0;
+            if ( root == NULL || string(root->Value()) != "beamcal_geometry"
+                    || root->QueryFloatAttribute("sector_offset", &sector_offset) != marlin::TIXML_SUCCESS ) {
+                cout << "Geometry file " << geom_file_name << " has no beamcal_geometry with a sector_offset\n";
+                return false;
+            }
+
+            vector<float> radii;
+            vector<short> sector_counts;
+            for (const marlin::TiXmlElement* ring = root->FirstChildElement("ring");
+                    ring != NULL; ring = ring->NextSiblingElement("ring")) {
+                float radius;
+                int sectors;
+                if ( ring->QueryFloatAttribute("radius", &radius) != marlin::TIXML_SUCCESS
+                        || ring->QueryIntAttribute("sectors", &sectors) != marlin::TIXML_SUCCESS ) {
+                    cout << "Ring " << radii.size() << " of " << geom_file_name << " needs a radius and sectors\n";
+                    return false;
+                }
+                if ( not checkRing(geom_file_name, radii.size(), radii.empty() ? 0.0 : radii.back(), radius, sectors) ) {
+                    return false;
+                }
+                radii.push_back(radius);
+                sector_counts.push_back(sectors);
+            }
+            if ( radii.empty() ) {
+                cout << "Geometry file " << geom_file_name << " has no rings\n";
+                return false;
+            }
+
+            _sector_offset = sector_offset;
+            _ring_to_radius_table = radii;
+            SectorCountTable = sector_counts;
+            _LastRing = radii.size() - 1;
+            cout << "Read " << radii.size() << " rings from " << geom_file_name << endl;
+            return true;
+        }
+
+
+
+        /*
+         * Set up the layout from the geometry file, or from the blob
+         * compiled from it by an earlier job if there is one that is up
+         * to date. Without a (readable) geometry file, the built-in layout
+         * is kept. Returns whether the derived tables came out of a blob;
+         * if not, and the file was read, blob_file_name is where to put one.
+         */
+        static bool loadGeometry(string geom_file_name, string* blob_file_name) {
+            blob_file_name->clear();
+            struct stat file_status;
+            if ( stat(geom_file_name.c_str(), &file_status) != 0 ) {
+                cout << "No geometry file at " << geom_file_name << ", using the built-in sidloi3 layout\n";
+                return false;
+            }
+
+            string blob_name = geom_file_name + ".bin";
+            unsigned long long key = hash_geometry_file(geom_file_name);
+            if ( read_geometry_blob(blob_name, key, &_geometry) ) {
+                //held to the same rules as the geometry file
+                bool usable = not _geometry.sector_counts.empty();
+                for (int ring = 0; usable && ring < (int)_geometry.sector_counts.size(); ring++) {
+                    usable = checkRing( blob_name, ring, ( ring > 0 ) ? _geometry.ring_radii[ring-1] : 0.0,
+                                        _geometry.ring_radii[ring], _geometry.sector_counts[ring] );
+                }
+                if (usable) {
+                    cout << "Mapped the compiled geometry from " << blob_name << endl;
+                    return true;
+                }
+                cout << "Not using the compiled geometry in " << blob_name << endl;
+            }
+
+            if ( not readGeomFile(geom_file_name) ) {
+                cout << "Using the built-in sidloi3 layout\n";
+                return false;
+            }
+            *blob_file_name = blob_name;
+            return false;
+        }
+
+
+
+        /*
+         * Check whether the geometry is exactly the sidloi3 layout that
+         * beamcal_layout.h compiles in, and if so have the lookups use it.
+         */
+        static void useCompiledLayout() {
+            typedef layout_lookup<sidloi3_layout> compiled;
+
+            bool matches = ( _LastRing == compiled::last_ring() )
+                            && ( _sector_offset == sidloi3_layout::sector_offset );
+            for (int ring = 0; matches && ring <= _LastRing; ring++) {
+                matches = ( SectorCountTable[ring] == compiled::sector_count(ring) )
+                            && ( _ring_to_radius_table[ring] == compiled::ring_radius(ring) )
+                            && ( _ring_pixel_offset[ring] == compiled::ring_offset(ring) );
+            }
+            _sidloi3_compiled = matches;
+            cout << "Pixel lookups use the " << ( matches ? "compiled sidloi3" : "run time" ) << " layout\n";
         }
 
 
 
         /*
          * Read in the geometry file and use that to establish
-         * the geometry parameters, then generate the pixel graph.
+         * the geometry parameters, then generate the pixel graph
+         * (or map both in from the geometry blob).
+         *
+         * The geometry is shared by every reconstructor in the process,
+         * which may already be reading it, so it is only built once. Asking
+         * for another geometry file after that cannot change it, and is
+         * reported as an error; the geometry stays that of the first file.
          */
         void initialize_geometry(string geom_file_name) {
+            if ( _pixel_graph != NULL ) {
+                if ( geom_file_name != _geom_file_name ) {
+                    cout << "ERROR: the geometry is already initialized from " << _geom_file_name
+                         << ", and is shared by every reconstructor, so " << geom_file_name
+                         << " is ignored\n";
+                }
+                return;
+            }
+            _geom_file_name = geom_file_name;
+
             cout << "Initializing geometry\n";
-            readGeomFile(geom_file_name);
-            makeGraph();
+            string blob_file_name;
+            if ( loadGeometry(geom_file_name, &blob_file_name) ) {
+                useGeometryBlob();
+                useCompiledLayout();
+                usePixelGraph();
+            } else {
+                makePixelIndex();
+                useCompiledLayout();
+                if (_sidloi3_compiled) makeGraph< layout_lookup<sidloi3_layout> >();
+                else makeGraph< layout_lookup<runtime_layout> >();
+                compileGeometry();
+                usePixelGraph();
+                if ( not blob_file_name.empty() ) {
+                    write_geometry_blob(blob_file_name, hash_geometry_file(geom_file_name), _geometry);
+                }
+            }
+            makeCellTable();
+            certifyAtan();
             cout << "Geometry initialized\n";
         }
     }
@@ -1,23 +1,81 @@
+#ifndef SIMPLE_LIST_GEOMETRY_H
+#define SIMPLE_LIST_GEOMETRY_H
+#include <string>
 #include <vector>
-#include <unordered_map>
 
 namespace scipp_ilc {
     namespace beamcal_recon {
-        struct surrounding_ids {
-            std::vector<int>* list;
-
-            //denotes the index of the element
-            //half-way around the id
+        /*
+         * The pixels around a pixel (by dense index), going anticlockwise
+         * around it: the next sector over on the same ring and the pixels
+         * on the ring inside it, then, from half_turn_index on, the
+         * previous sector over and the pixels on the ring outside it.
+         */
+        struct pixel_neighbors {
+            const int* first;
+            const int* last;
             int half_turn_index;
+
+            const int* begin() const { return first; }
+            const int* end() const { return last; }
+            int size() const { return last - first; }
+            int operator[](int i) const { return first[i]; }
+        };
+
+        /*
+         * The neighbors of every pixel, stored flat in compressed sparse
+         * rows: those of the pixel with index i are neighbors[offsets[i]]
+         * ... neighbors[offsets[i+1]-1]. The neighborhoods of two or three
+         * hops (see get_pixel_neighborhoods) are stored the same way, but
+         * without half_turn_indices.
+         */
+        struct pixel_graph {
+            const int* offsets;
+            const int* neighbors;
+            const int* half_turn_indices;
+
+            pixel_neighbors get(int index) const {
+                pixel_neighbors row;
+                row.first = neighbors + offsets[index];
+                row.last = neighbors + offsets[index+1];
+                row.half_turn_index = half_turn_indices ? half_turn_indices[index] : -1;
+                return row;
+            }
         };
 
 
         extern const int _IDlimit;
         extern int _LastRing;
-        extern std::unordered_map<int,surrounding_ids*>* _pixel_graph;
+        extern const pixel_graph* _pixel_graph;
+
+        //every pixel up to hops steps away over the pixel graph (1 to 3),
+        //nearest first; built on first use
+        const pixel_graph* get_pixel_neighborhoods(int hops);
+
+        int get_pixel_count();
+        int get_pixel_index(int ID);
+        int get_pixel_ID(int index);
+
+        int get_sector_count(int ring);
+        float get_ring_radius(int ring);
+        float get_sector_offset();
+
+        //whether the geometry is a layout compiled into beamcal_layout.h,
+        //which getID/getIndex (and the pixelation) then look pixels up in
+        bool has_compiled_layout();
 
         int getID(double x, double y);
+        int getIndex(double x, double y);
+        int get_cell_pixels(int cell_x, int cell_y, const int** indices, const float** fractions);
+
+        //getID and getIndex for count points at once; these return how
+        //many of the points had to be looked up one by one
+        int getIDs(const double* x, const double* y, int count, int* IDs);
+        int getIndices(const double* x, const double* y, int count, int* indices);
+        float get_atan_error_bound();
         void get_pixel_center(int ID, double& x, double& y);
+        double get_pixel_area(int index);
         void initialize_geometry(std::string geom_file);
     }
 }
+#endif
@@ -10,6 +10,7 @@ namespace scipp_ilc {
     static const float _BeamCal_outer_radius = 140.0;
     static const float _BeamCal_outgoing_pipe_radius = 20.5;
     static const float _BeamCal_incoming_pipe_radius = 15.5;
+    static const float _BeamCal_cell_size = 1.0; //side of the simulation's square cells
 
     static const float _crossing_angle = 0.014; // radians
     static const float _transform = _crossing_angle / 2.0;
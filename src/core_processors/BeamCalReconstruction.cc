@@ -44,7 +44,7 @@ BeamCalReconstruction BeamCalReconstruction;
 
 static TFile* _rootfile;
 static TProfile* _radeff;
-static int _detected_num = 0;
+static double _detected_num = 0;
 
 BeamCalReconstruction::BeamCalReconstruction() : Processor("BeamCalReconstruction") {
     // modify processor description
@@ -55,6 +55,20 @@ BeamCalReconstruction::BeamCalReconstruction() : Processor("BeamCalReconstructio
     registerProcessorParameter( "BeamcalGeometryFile" , "input file"  , _beamcal_geometry_file_name , std::string("input.xml") ) ;
     registerProcessorParameter( "BackgroundEventList" , "input file"  , _background_event_list , std::string("input.xml") ) ;
     registerProcessorParameter( "BackgroundEventsToRead" , "number"  , _num_bgd_events_to_read , 10 ) ;
+    registerProcessorParameter( "BackgroundCacheFile" , "cache file for the generated background database (empty to disable)"  , _background_cache_file , std::string("") ) ;
+    registerProcessorParameter( "BackgroundIngestThreads" , "number of threads reading background files"  , _num_bgd_ingest_threads , 1 ) ;
+    registerProcessorParameter( "CompressBackground" , "store the background database with compressed indices and 16 bit energies"  , _compress_background , false ) ;
+    registerProcessorParameter( "BackgroundZeroThreshold" , "background pixels with less energy than this are dropped as they are read"  , _background_zero_threshold , (float)0.0 ) ;
+    registerProcessorParameter( "BackgroundOutOfCore" , "keep the background database in the memory-mapped BackgroundCacheFile instead of in memory"  , _background_out_of_core , false ) ;
+    registerProcessorParameter( "CalibrationThreads" , "number of threads scanning background events during calibration"  , _num_calibration_threads , 1 ) ;
+    registerProcessorParameter( "BackgroundOverlays" , "number of background events each signal is overlayed on (0 for all of them); above 1, signals count by their detection fraction"  , _num_overlays , 1 ) ;
+    registerProcessorParameter( "OverlaySeed" , "seed for choosing the background events to overlay"  , _overlay_seed , 0 ) ;
+    registerProcessorParameter( "SeedCount" , "number of seed pixels the scanner clusters around"  , _num_seeds , 50 ) ;
+    registerProcessorParameter( "SeedThreads" , "number of threads growing clusters from the seed pixels of each event"  , _num_seed_threads , 1 ) ;
+    registerProcessorParameter( "SignificanceBackend" , "cluster significance from: exact, covariance, or check (both, compared)"  , _significance_backend , std::string("exact") ) ;
+    registerProcessorParameter( "ClusterStrategy" , "how far clusters grow from their seed: seed (not at all), ring (over its neighbors), or recursive; or regions, for connected regions of significant pixels"  , _cluster_strategy , std::string("seed") ) ;
+    registerProcessorParameter( "Pixelation" , "how a hit's energy goes to the pixels: point (all to the pixel at its position) or cell_area (shared by the area its cell overlaps each pixel)"  , _pixelation , std::string("point") ) ;
+    registerProcessorParameter( "RegionThreshold" , "significance a pixel needs on its own to be part of a region"  , _region_threshold , (float)2.0 ) ;
     registerProcessorParameter( "RootOutputName" , "output file"  , _root_file_name , std::string("output.root") );
 }
 
@@ -66,8 +80,43 @@ void BeamCalReconstruction::init() {
     _rootfile = new TFile(_root_file_name.c_str(),"RECREATE");
     _radeff = new TProfile("radeff","Radial Efficiency",14,0.0,140.0,0.0,1.0);
 
+    _reconstructor = new scipp_ilc::beamcal_recon::beamcal_reconstructor();
+    _scratch = new scipp_ilc::beamcal_recon::reconstruction_scratch();
+
+    if ( _significance_backend == "covariance" ) {
+        _reconstructor->set_significance_backend(scipp_ilc::beamcal_recon::SIGNIFICANCE_COVARIANCE);
+    } else if ( _significance_backend == "check" ) {
+        _reconstructor->set_significance_backend(scipp_ilc::beamcal_recon::SIGNIFICANCE_CHECK);
+    } else {
+        _reconstructor->set_significance_backend(scipp_ilc::beamcal_recon::SIGNIFICANCE_EXACT);
+    }
+
+    if ( _cluster_strategy == "ring" ) {
+        _reconstructor->set_clustering(scipp_ilc::beamcal_recon::CLUSTER_ONE_RING);
+    } else if ( _cluster_strategy == "recursive" ) {
+        _reconstructor->set_clustering(scipp_ilc::beamcal_recon::CLUSTER_RECURSIVE);
+    } else if ( _cluster_strategy == "regions" ) {
+        _reconstructor->set_clustering(scipp_ilc::beamcal_recon::CLUSTER_REGIONS);
+    } else {
+        _reconstructor->set_clustering(scipp_ilc::beamcal_recon::CLUSTER_SEED_ONLY);
+    }
+
+    if ( _pixelation == "cell_area" ) {
+        _reconstructor->set_pixelation(scipp_ilc::beamcal_recon::PIXELATION_CELL_AREA);
+    } else {
+        _reconstructor->set_pixelation(scipp_ilc::beamcal_recon::PIXELATION_POINT);
+    }
+
+    _reconstructor->set_max_seeds(_num_seeds);
+    _reconstructor->set_seed_threads(_num_seed_threads);
+    _reconstructor->set_region_threshold(_region_threshold);
+    _reconstructor->set_overlay_seed(_overlay_seed);
+    _reconstructor->set_background_storage(_compress_background, _background_zero_threshold, _background_out_of_core);
+
     //Load up all the bgd events, and initialize the reconstruction algorithm.
-    scipp_ilc::beamcal_recon::initialize_beamcal_reconstructor(_beamcal_geometry_file_name, _background_event_list, _num_bgd_events_to_read);
+    _reconstructor->initialize(_beamcal_geometry_file_name, _background_event_list, _num_bgd_events_to_read,
+                                _background_cache_file, _num_bgd_ingest_threads,
+                                _num_calibration_threads);
 
     _nRun = 0 ;
     _nEvt = 0 ;
@@ -98,9 +147,17 @@ void BeamCalReconstruction::processEvent( LCEvent* signal_event ) {
 
     //Perform the reconstrunction algorithm, determine if the algorithm
     //detected the electron.
-    scipp_ilc::beamcal_recon::beamcal_cluster* signal_cluster;
-    signal_cluster = scipp_ilc::beamcal_recon::reconstruct_beamcal_event(signal_event);
-    bool detected = signal_cluster->exceeds_sigma_cut;
+    double detected;
+    if ( _num_overlays == 1 ) {
+        scipp_ilc::beamcal_recon::beamcal_cluster* signal_cluster;
+        signal_cluster = _reconstructor->reconstruct(signal_event, _scratch);
+        detected = signal_cluster->exceeds_sigma_cut;
+    } else {
+        //the fraction of the backgrounds the electron was detected over
+        scipp_ilc::beamcal_recon::overlay_efficiency efficiency;
+        efficiency = _reconstructor->reconstruct_overlays(signal_event, _num_overlays, _scratch);
+        detected = efficiency.detection_fraction;
+    }
 
 
     //Plot our results with respect to the radius of the signal electron.
@@ -121,5 +178,10 @@ void BeamCalReconstruction::check( LCEvent * evt ) {
 
 void BeamCalReconstruction::end(){ 
     cout << "\ndetected: " << _detected_num << endl;
+    _reconstructor->report_significance_check();
+    _reconstructor->report_hit_cuts();
     _rootfile->Write();
+
+    delete _scratch;
+    delete _reconstructor;
 }
@@ -19,6 +19,7 @@
 
 #include <vector>
 #include <unordered_map>
+#include <algorithm>
 
 #include <EVENT/LCCollection.h>
 #include <EVENT/SimCalorimeterHit.h>
@@ -96,6 +97,44 @@ void GeometryTest::init() {
     cout << "finished y\n";
     _rootfile->Write();
 
+    checkBatchIDs(bound);
+}
+
+
+
+/*
+ * Check that the batch pixel lookup (getIDs) gives exactly what getID
+ * does, over a grid much finer than the pixels. The grid runs through
+ * the axes and the origin, where the angle is the most awkward. It is
+ * made a chunk of points at a time, and any mismatch fails the job.
+ */
+void GeometryTest::checkBatchIDs(float bound) {
+    const int steps = 4000;
+    const int chunk_size = 1 << 16;
+    double spacing = 2.0*bound / steps;
+    long long point_count = (long long)(steps+1) * (steps+1);
+
+    vector<double> x(chunk_size), y(chunk_size);
+    vector<int> IDs(chunk_size);
+    long long mismatches = 0;
+    long long exact_points = 0;
+    for (long long first = 0; first < point_count; first += chunk_size) {
+        int count = min( (long long)chunk_size, point_count - first );
+        for (int k = 0; k < count; k++) {
+            long long point = first + k;
+            x[k] = -bound + (point / (steps+1))*spacing;
+            y[k] = -bound + (point % (steps+1))*spacing;
+        }
+
+        exact_points += getIDs( x.data(), y.data(), count, IDs.data() );
+        for (int k = 0; k < count; k++) {
+            if ( IDs[k] != getID(x[k], y[k]) ) mismatches++;
+        }
+    }
+    cout << "Batch getIDs: " << mismatches << " mismatches with getID over " << point_count << " points ("
+         << exact_points << " looked up one by one, atan error bound " << get_atan_error_bound() << ")\n";
+
+    if ( mismatches > 0 ) throw Exception("GeometryTest: the batch pixel lookup disagrees with getID");
 }
 
 
@@ -0,0 +1,143 @@
+#undef _GLIBCXX_USE_CXX11_ABI
+#define _GLIBCXX_USE_CXX11_ABI 0
+/*
+ * Ok, so I like C++11. Unfortunately,
+ * Marlin is built with ansi C, so the processor
+ * constructor freaks out about the string that is
+ * passed to it as an argument. The above two lines
+ * fix that issue, allowing our code to be compatible
+ * with ansi C class declarations.
+ * Big thanks to Daniel Bittman for helping me fix this.
+ */
+
+#include "ScannerTest.h"
+#include "beamcal_reconstructor.h"
+#include "beamcal_scanner.h"
+#include <iostream>
+#include <cstdlib>
+
+#include <EVENT/LCCollection.h>
+
+
+// ----- include for verbosity dependend logging ---------
+#include "marlin/VerbosityLevels.h"
+
+
+
+using namespace lcio;
+using namespace marlin;
+using namespace std;
+
+using namespace scipp_ilc::beamcal_recon;
+
+
+ScannerTest ScannerTest;
+
+ScannerTest::ScannerTest() : Processor("ScannerTest") {
+    // modify processor description
+    _description = "Checks that pruned, threaded seed scans choose the clusters plain ones do" ;
+
+    // register steering parameters: name, description, class-variable, default value
+    registerInputCollection( LCIO::MCPARTICLE, "CollectionName" , "Name of the MCParticle collection"  , _colName , std::string("MCParticle") );
+    registerProcessorParameter( "BeamcalGeometryFile" , "input file"  , _beamcal_geometry_file_name , std::string("input.xml") ) ;
+    registerProcessorParameter( "BackgroundEventList" , "input file"  , _background_event_list , std::string("input.xml") ) ;
+    registerProcessorParameter( "BackgroundEventsToRead" , "number"  , _num_bgd_events_to_read , 10 ) ;
+    registerProcessorParameter( "SignificanceBackend" , "cluster significance from: exact, covariance, or check (both, compared)"  , _significance_backend , std::string("exact") ) ;
+    registerProcessorParameter( "ClusterStrategy" , "how far clusters grow from their seed: seed, ring, or recursive"  , _cluster_strategy , std::string("ring") ) ;
+    registerProcessorParameter( "SeedCount" , "number of seed pixels the scanner clusters around"  , _num_seeds , 50 ) ;
+    registerProcessorParameter( "SeedThreads" , "number of threads growing clusters in the scans checked"  , _num_seed_threads , 4 ) ;
+}
+
+
+
+void ScannerTest::init() {
+    _reconstructor = new beamcal_reconstructor();
+    _scratch = new reconstruction_scratch();
+
+    if ( _significance_backend == "covariance" ) {
+        _reconstructor->set_significance_backend(SIGNIFICANCE_COVARIANCE);
+    } else if ( _significance_backend == "check" ) {
+        _reconstructor->set_significance_backend(SIGNIFICANCE_CHECK);
+    } else {
+        _reconstructor->set_significance_backend(SIGNIFICANCE_EXACT);
+    }
+
+    if ( _cluster_strategy == "seed" ) {
+        _reconstructor->set_clustering(CLUSTER_SEED_ONLY);
+    } else if ( _cluster_strategy == "recursive" ) {
+        _reconstructor->set_clustering(CLUSTER_RECURSIVE);
+    } else {
+        _reconstructor->set_clustering(CLUSTER_ONE_RING);
+    }
+    _reconstructor->set_max_seeds(_num_seeds);
+
+    _reconstructor->initialize(_beamcal_geometry_file_name, _background_event_list, _num_bgd_events_to_read);
+
+    _mismatches = 0;
+    _nRun = 0 ;
+    _nEvt = 0 ;
+}
+
+
+
+void ScannerTest::processRunHeader( LCRunHeader* run) {
+//    _nRun++ ;
+}
+
+
+
+/*
+ * Whether the two scans chose the same pixels, with the same
+ * significance, energy and background.
+ */
+bool ScannerTest::sameCluster(const beamcal_cluster* plain, const beamcal_cluster* tested) {
+    if ( plain->significance != tested->significance ) return false;
+    if ( plain->energy != tested->energy ) return false;
+    if ( plain->background_average != tested->background_average ) return false;
+    if ( (plain->id_list == NULL) != (tested->id_list == NULL) ) return false;
+    return ( plain->id_list == NULL || *plain->id_list == *tested->id_list );
+}
+
+
+
+void ScannerTest::processEvent( LCEvent* signal_event ) {
+    //the scan as it is done without any of the shortcuts
+    _reconstructor->set_seed_threads(1);
+    _reconstructor->set_seed_pruning(false);
+    beamcal_cluster* plain = _reconstructor->reconstruct(signal_event, _scratch);
+
+    //and with them
+    _reconstructor->set_seed_threads(_num_seed_threads);
+    _reconstructor->set_seed_pruning(true);
+    beamcal_cluster* tested = _reconstructor->reconstruct(signal_event, _scratch);
+
+    if ( not sameCluster(plain, tested) ) {
+        cout << "ScannerTest: event " << _nEvt << " scanned to significance " << plain->significance
+             << " plainly, but " << tested->significance << " pruned over " << _num_seed_threads << " threads\n";
+        _mismatches++;
+    }
+
+    delete plain->id_list;
+    delete tested->id_list;
+    free(plain);
+    free(tested);
+    _nEvt++;
+}
+
+
+
+void ScannerTest::check( LCEvent * evt ) {
+    // nothing to check here - could be used to fill checkplots in reconstruction processor
+}
+
+
+
+void ScannerTest::end(){
+    cout << "ScannerTest: " << _mismatches << " of " << _nEvt << " events chose a different cluster\n";
+    _reconstructor->report_significance_check();
+
+    delete _scratch;
+    delete _reconstructor;
+
+    if ( _mismatches > 0 ) throw Exception("ScannerTest: pruned, threaded scans differ from plain ones");
+}
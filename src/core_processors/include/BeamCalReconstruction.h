@@ -10,6 +10,14 @@ using namespace lcio ;
 using namespace marlin ;
 
 
+namespace scipp_ilc {
+    namespace beamcal_recon {
+        class beamcal_reconstructor;
+        struct reconstruction_scratch;
+    }
+}
+
+
 /**  Example processor for marlin.
  * 
  *  If compiled with MARLIN_USE_AIDA 
@@ -66,8 +74,25 @@ class BeamCalReconstruction : public Processor {
         std::string _beamcal_geometry_file_name;
         std::string _background_event_list;
         int _num_bgd_events_to_read;
+        std::string _background_cache_file;
+        int _num_bgd_ingest_threads;
+        bool _compress_background;
+        float _background_zero_threshold;
+        bool _background_out_of_core;
+        int _num_calibration_threads;
+        std::string _significance_backend;
+        std::string _cluster_strategy;
+        std::string _pixelation;
+        float _region_threshold;
+        int _num_seeds;
+        int _num_seed_threads;
+        int _num_overlays;
+        int _overlay_seed;
         std::string _root_file_name;
 
+        scipp_ilc::beamcal_recon::beamcal_reconstructor* _reconstructor;
+        scipp_ilc::beamcal_recon::reconstruction_scratch* _scratch;
+
         int _nRun ;
         int _nEvt ;
 
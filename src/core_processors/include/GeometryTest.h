@@ -62,6 +62,8 @@ class GeometryTest : public Processor {
 
     protected:
 
+        void checkBatchIDs(float bound);
+
         /** Input collection name.
         */
         std::string _colName ;
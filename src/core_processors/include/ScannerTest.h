@@ -0,0 +1,94 @@
+#ifndef ScannerTest_h
+#define ScannerTest_h 1
+
+#include "marlin/Processor.h"
+#include "lcio.h"
+#include <string>
+
+
+using namespace lcio ;
+using namespace marlin ;
+
+
+namespace scipp_ilc {
+    namespace beamcal_recon {
+        class beamcal_reconstructor;
+        struct reconstruction_scratch;
+        struct beamcal_cluster;
+    }
+}
+
+
+/**  Checks the seed scan against its plain form.
+ *
+ *  Every signal event is reconstructed twice: once the plain way (one
+ *  thread, every seed grown), and once with the seeds pruned and shared
+ *  out between SeedThreads threads. The two must choose the very same
+ *  cluster.
+ *
+ *  <h4>Input - Prerequisites</h4>
+ *  Needs the background event list and the signal events.
+ *
+ *  <h4>Output</h4>
+ *  The number of events whose clusters differ; any at all fail the job.
+ *
+ * @param CollectionName Name of the MCParticle collection
+ */
+
+class ScannerTest : public Processor {
+
+    public:
+
+        virtual Processor*  newProcessor() { return new ScannerTest ; }
+
+
+        ScannerTest() ;
+
+        /** Called at the begin of the job before anything is read.
+         * Use to initialize the processor, e.g. book histograms.
+         */
+        virtual void init() ;
+
+        /** Called for every run.
+        */
+        virtual void processRunHeader( LCRunHeader* run ) ;
+
+        /** Called for every event - the working horse.
+        */
+        virtual void processEvent( LCEvent * evt ) ;
+
+
+        virtual void check( LCEvent * evt ) ;
+
+
+        /** Called after data processing for clean up.
+        */
+        virtual void end() ;
+
+
+    protected:
+
+        bool sameCluster(const scipp_ilc::beamcal_recon::beamcal_cluster* plain,
+                         const scipp_ilc::beamcal_recon::beamcal_cluster* tested);
+
+        /** Input collection name.
+        */
+        std::string _colName ;
+        std::string _beamcal_geometry_file_name;
+        std::string _background_event_list;
+        int _num_bgd_events_to_read;
+        std::string _significance_backend;
+        std::string _cluster_strategy;
+        int _num_seeds;
+        int _num_seed_threads;
+
+        scipp_ilc::beamcal_recon::beamcal_reconstructor* _reconstructor;
+        scipp_ilc::beamcal_recon::reconstruction_scratch* _scratch;
+        int _mismatches;
+
+        int _nRun ;
+        int _nEvt ;
+
+} ;
+
+#endif